@@ -0,0 +1,950 @@
+#include "structures.h"
+#include "schema.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// MICROBENCHMARKS
+// g++ -O2 -o bench bench.cpp -lsqlite3 -lpthread && ./bench
+// ./bench -s codec,sql -m 10k,1m -r 20 -j bench.json
+//
+// suites: cipher (throughput table), codec (the per-message encode/decode path) and sql (every statement
+// server.cpp issues, prepare and execute apart) against generated databases of the given message counts,
+// kept as bench-<count>.db in -D so later runs measure the same data
+// every measurement is warmed up, then repeated: the report is the median (and spread) of the repetitions
+
+#define BENCH_BYTES (512L * 1024 * 1024) // processed per measurement, whatever the buffer size
+#define DEFAULT_SUITES "cipher,codec,sql"
+#define DEFAULT_DATASETS "10k,1m,10m"
+#define DEFAULT_REPETITIONS 10
+#define DEFAULT_WARMUP 2 // repetitions thrown away after the batch size is found
+#define MIN_BATCH_SECONDS 0.02 // a repetition runs at least this long, so the clock's resolution does not matter
+#define SAMPLE_ROWS 1024 // messages the sql parameters are drawn from
+#define BENCH_USERS_PER_MESSAGES 100 // one user per this many messages
+#define BENCH_PEERS 5 // conversations each user starts, so about 20 messages per conversation
+
+// the packet cipher as it was before CipherContext: copy out, strlen and % per byte, copy back
+void referenceEncode(unsigned char *data, size_t length, char *key)
+{
+    unsigned char *buffer = (unsigned char *)malloc(length);
+    memcpy(buffer, data, length);
+    int key_length = strlen(key);
+    for (size_t i = 0; i < length; i++)
+    {
+        int poz = i % key_length;
+        int init = buffer[i];
+        int another = key[poz];
+        init += another;
+        init = init % 256;
+        buffer[i] = (unsigned char)init;
+    }
+    memcpy(data, buffer, length);
+    free(buffer);
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum CipherVariant {
+    VARIANT_REFERENCE,
+    VARIANT_SCALAR,
+    VARIANT_SSE2,
+    VARIANT_AVX2
+};
+
+const char *variantNames[] = {"reference", "scalar", "sse2", "avx2"};
+
+void runVariant(CipherVariant variant, const CipherContext *context, unsigned char *data, size_t length)
+{
+    switch (variant)
+    {
+        case VARIANT_REFERENCE:
+            referenceEncode(data, length, vigenere_key);
+            break;
+        case VARIANT_SCALAR:
+            cipherScalar(context, data, length, 0, 0);
+            break;
+#if defined(__SSE2__)
+        case VARIANT_SSE2:
+            cipherSse2(context, data, length, 0);
+            break;
+        case VARIANT_AVX2:
+            cipherAvx2(context, data, length, 0);
+            break;
+#else
+        default:
+            break;
+#endif
+    }
+}
+
+int variantAvailable(CipherVariant variant)
+{
+#if defined(__SSE2__)
+    if (variant == VARIANT_AVX2)
+        return __builtin_cpu_supports("avx2");
+    return 1;
+#else
+    return variant == VARIANT_REFERENCE || variant == VARIANT_SCALAR;
+#endif
+}
+
+// every variant has to produce the reference's bytes, at every length and both ways
+int checkCipher(const CipherContext *context)
+{
+    unsigned char original[1000], expected[1000], actual[1000];
+    for (size_t i = 0; i < sizeof(original); i++)
+        original[i] = (unsigned char)(i * 131 + 7);
+    for (size_t length = 0; length <= sizeof(original); length += (length < 80 ? 1 : 37))
+    {
+        memcpy(expected, original, length);
+        referenceEncode(expected, length, vigenere_key);
+        for (int variant = VARIANT_SCALAR; variant <= VARIANT_AVX2; variant++)
+        {
+            if (!variantAvailable((CipherVariant)variant))
+                continue;
+            memcpy(actual, original, length);
+            runVariant((CipherVariant)variant, context, actual, length);
+            if (memcmp(actual, expected, length) != 0)
+            {
+                fprintf(stderr, "cipher: %s differs from the reference at length %zu\n", variantNames[variant], length);
+                return -1;
+            }
+        }
+        cipherTransform(context, actual, length, 1);
+        if (memcmp(actual, original, length) != 0)
+        {
+            fprintf(stderr, "cipher: decoding does not give the original back at length %zu\n", length);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct BenchResult {
+    std::string suite;
+    std::string name;
+    std::string dataset; // empty outside the sql suite
+    const char *unit;
+    long iterations; // per repetition
+    int repetitions;
+    double median, mean, stddev, min, max;
+};
+
+std::vector<BenchResult> results;
+int repetitions = DEFAULT_REPETITIONS;
+int warmupRepetitions = DEFAULT_WARMUP;
+
+// one measurement: run does the operation iterations times, begin and end (if set) wrap each repetition
+// outside the clock, for what has to be undone between repetitions
+struct Benchmark {
+    const char *suite;
+    std::string name;
+    std::string dataset;
+    void (*run)(void *context, long iterations);
+    void (*begin)(void *context);
+    void (*end)(void *context);
+    void *context;
+};
+
+double timeBatch(const Benchmark *bench, long iterations)
+{
+    if (bench->begin != NULL)
+        bench->begin(bench->context);
+    double start = now();
+    bench->run(bench->context, iterations);
+    double elapsed = now() - start;
+    if (bench->end != NULL)
+        bench->end(bench->context);
+    return elapsed;
+}
+
+// doubles the batch until it takes MIN_BATCH_SECONDS, warms up, then keeps one ns/op sample per repetition
+void measure(const Benchmark *bench)
+{
+    long iterations = 1;
+    while (timeBatch(bench, iterations) < MIN_BATCH_SECONDS && iterations < (1L << 30))
+        iterations *= 2;
+    for (int i = 0; i < warmupRepetitions; i++)
+        timeBatch(bench, iterations);
+    std::vector<double> samples;
+    for (int i = 0; i < repetitions; i++)
+        samples.push_back(timeBatch(bench, iterations) * 1e9 / iterations);
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.suite = bench->suite;
+    result.name = bench->name;
+    result.dataset = bench->dataset;
+    result.unit = "ns/op";
+    result.iterations = iterations;
+    result.repetitions = repetitions;
+    result.median = samples.size() % 2 ? samples[samples.size() / 2] : (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]) / 2;
+    result.mean = 0;
+    for (double sample : samples)
+        result.mean += sample;
+    result.mean /= samples.size();
+    result.stddev = 0;
+    for (double sample : samples)
+        result.stddev += (sample - result.mean) * (sample - result.mean);
+    result.stddev = samples.size() > 1 ? sqrt(result.stddev / (samples.size() - 1)) : 0;
+    result.min = samples.front();
+    result.max = samples.back();
+    results.push_back(result);
+    printf("  %-34s %12.1f %10.1f %12.1f %12.1f %10ld\n", result.name.c_str(), result.median, result.stddev, result.min, result.max, iterations);
+    fflush(stdout);
+}
+
+void printMeasureHeader(const char *title)
+{
+    printf("%s, ns per operation\n  %-34s %12s %10s %12s %12s %10s\n", title, "benchmark", "median", "stddev", "min", "max", "batch");
+}
+
+void benchCipher()
+{
+    const CipherContext *context = vigenereContext();
+    if (checkCipher(context) == -1)
+        exit(1);
+    size_t sizes[] = {sizeof(LegacyPacket), 4096, 65536, 1024 * 1024};
+    printf("cipher throughput (GB/s), key \"%s\"\n", vigenere_key);
+    printf("%10s", "bytes");
+    for (int variant = VARIANT_REFERENCE; variant <= VARIANT_AVX2; variant++)
+        printf("%12s", variantNames[variant]);
+    printf("\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t length = sizes[s];
+        unsigned char *data = (unsigned char *)malloc(length);
+        memset(data, 'x', length);
+        long iterations = BENCH_BYTES / length;
+        printf("%10zu", length);
+        for (int variant = VARIANT_REFERENCE; variant <= VARIANT_AVX2; variant++)
+        {
+            if (!variantAvailable((CipherVariant)variant))
+            {
+                printf("%12s", "-");
+                continue;
+            }
+            // the reference is an order of magnitude slower, it gets fewer rounds
+            long rounds = variant == VARIANT_REFERENCE ? iterations / 8 + 1 : iterations;
+            runVariant((CipherVariant)variant, context, data, length); // warm up
+            double start = now();
+            for (long i = 0; i < rounds; i++)
+                runVariant((CipherVariant)variant, context, data, length);
+            double elapsed = now() - start;
+            double throughput = (double)rounds * length / elapsed / 1e9;
+            printf("%12.2f", throughput);
+            BenchResult result = {"cipher", std::string(variantNames[variant]) + "/" + std::to_string(length), "", "GB/s",
+                                  rounds, 1, throughput, throughput, 0, throughput, throughput};
+            results.push_back(result);
+        }
+        printf("\n");
+        // keeps the compiler from dropping the work
+        volatile unsigned char sink = data[length / 2];
+        (void)sink;
+        free(data);
+    }
+}
+
+
+// CODEC: what every message costs on its way through serializing, the cipher and framing
+
+struct CodecContext {
+    Packet packet;
+    LegacyPacket legacy;
+    unsigned char wire[sizeof(Packet) + MAX_FRAME_HEADER]; // the packet already encoded, for the decoders
+    size_t wireLength;
+    unsigned char scratch[sizeof(Packet) + MAX_FRAME_HEADER];
+};
+
+void runSerialize(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    for (long i = 0; i < iterations; i++)
+    {
+        serializePacket(&codec->legacy, codec->scratch, sizeof(codec->scratch));
+        __asm__ volatile("" : : "r"(codec->scratch) : "memory");
+    }
+}
+
+void runDeserialize(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    LegacyPacket legacy;
+    for (long i = 0; i < iterations; i++)
+    {
+        deserializePacket(codec->wire, &legacy);
+        __asm__ volatile("" : : "r"(&legacy) : "memory");
+    }
+}
+
+// the legacy packet's bytes are encoded in place over and over, which costs the same as encoding fresh ones
+void runEncodePacket(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    for (long i = 0; i < iterations; i++)
+        encode_vigenere_packet(&codec->legacy);
+}
+
+// the string cipher the passwords go through (a copy first, it works in place)
+void runEncodeString(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    char text[MAX_CONTENT_LENGTH];
+    for (long i = 0; i < iterations; i++)
+    {
+        strcpy(text, codec->packet.message.content);
+        encode_vigenere(text, vigenere_key);
+        __asm__ volatile("" : : "r"(text) : "memory");
+    }
+}
+
+void runEncodeLegacy(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    for (long i = 0; i < iterations; i++)
+        encodeLegacyPacket(&codec->packet, codec->scratch);
+}
+
+void runDecodeLegacy(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    Packet packet;
+    for (long i = 0; i < iterations; i++)
+    {
+        decodeLegacyPacket(codec->wire, &packet);
+        __asm__ volatile("" : : "r"(&packet) : "memory");
+    }
+}
+
+void runEncodeCompact(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    for (long i = 0; i < iterations; i++)
+        encodeCompactFrame(&codec->packet, codec->scratch, 1);
+}
+
+// a reader decodes the body in its own buffer, so the copy is part of the cost
+void runDecodeCompact(void *context, long iterations)
+{
+    CodecContext *codec = (CodecContext *)context;
+    Packet packet;
+    for (long i = 0; i < iterations; i++)
+    {
+        FrameHeader header;
+        memcpy(codec->scratch, codec->wire, codec->wireLength);
+        int headerLength = parseFrameHeader(codec->scratch, codec->wireLength, &header);
+        if (headerLength > 0)
+            decode_vigenere_bytes(codec->scratch + headerLength, header.length);
+        if (headerLength <= 0 || decodeCompactFrame(&header, codec->scratch + headerLength, &packet) == -1)
+        {
+            fprintf(stderr, "codec: a frame this side encoded does not decode\n");
+            exit(1);
+        }
+    }
+}
+
+void benchCodec()
+{
+    // a login, a full message as it is pushed to its receiver and a row of history as the server sends them
+    CodecContext codecs[3];
+    const char *shapes[] = {"login", "notification", "history"};
+    for (int i = 0; i < 3; i++)
+        memset(&codecs[i].packet, 0, sizeof(Packet));
+    codecs[0].packet.type = LOGIN;
+    strcpy(codecs[0].packet.user.username, "alexandra");
+    strcpy(codecs[0].packet.user.password, "correct horse");
+    codecs[1].packet.type = MESSAGE_NOTIFICATION;
+    strcpy(codecs[1].packet.message.id, "1152921504606");
+    strcpy(codecs[1].packet.message.sender, "alexandra");
+    strcpy(codecs[1].packet.message.receiver, "bogdan");
+    strcpy(codecs[1].packet.message.content, "are we still meeting at the library tomorrow? I can bring the notes from the last two lectures");
+    strcpy(codecs[1].packet.message.timeStamp, "2024-05-14 09:41:27");
+    strcpy(codecs[1].packet.message.replyId, "1152921504599");
+    codecs[1].packet.requestId = 42;
+    codecs[2].packet = codecs[1].packet;
+    codecs[2].packet.type = VIEW_CONVERSATION_RESPONSE;
+    codecs[2].packet.message.replyId[0] = '\0';
+    strcpy(codecs[2].packet.message.content, "ok, see you there");
+    codecs[2].packet.requestId = 0;
+
+    struct {
+        const char *name;
+        void (*run)(void *, long);
+        int wire; // 0: the decoder reads a legacy packet, 1: a compact frame
+    } operations[] = {
+        {"serializePacket", runSerialize, 0},
+        {"deserializePacket", runDeserialize, 0},
+        {"encode_vigenere_packet", runEncodePacket, 0},
+        {"encode_vigenere", runEncodeString, 0},
+        {"encodeLegacyPacket", runEncodeLegacy, 0},
+        {"decodeLegacyPacket", runDecodeLegacy, 0},
+        {"encodeCompactFrame", runEncodeCompact, 1},
+        {"decodeCompactFrame", runDecodeCompact, 1},
+    };
+    printMeasureHeader("codec");
+    for (int i = 0; i < 3; i++)
+    {
+        CodecContext *codec = &codecs[i];
+        packetToLegacy(&codec->packet, &codec->legacy);
+        for (size_t o = 0; o < sizeof(operations) / sizeof(operations[0]); o++)
+        {
+            // the one encoding a decoder gets is made fresh, an encoder may have left scratch in any state
+            if (operations[o].wire)
+                codec->wireLength = encodeCompactFrame(&codec->packet, codec->wire, 1);
+            else
+            {
+                encodeLegacyPacket(&codec->packet, codec->wire);
+                codec->wireLength = sizeof(LegacyPacket);
+            }
+            Benchmark bench = {"codec", std::string(operations[o].name) + "/" + shapes[i], "", operations[o].run, NULL, NULL, codec};
+            measure(&bench);
+        }
+    }
+}
+
+// SQL: every statement server.cpp issues, copied from it, with parameters drawn from the generated data
+
+enum SqlParameters {
+    PARAMS_NONE,
+    PARAMS_NEW_USER, // username, password
+    PARAMS_PAIR, // userA, userB of a conversation
+    PARAMS_OWNER_PEER, // a message's receiver, its sender
+    PARAMS_OWNER, // a message's receiver
+    PARAMS_INBOX, // a message's receiver, the message's id, limit
+    PARAMS_DELIVERED, // a message's receiver, the message's id
+    PARAMS_CONVERSATION, // a conversation
+    PARAMS_CONVERSATION_PAGE, // a conversation, limit
+    PARAMS_CONVERSATION_CURSOR, // a conversation, limit, a message of it
+    PARAMS_MESSAGE, // a message's id, its conversation
+    PARAMS_NEW_MESSAGE // a message after the last one, between the sample's users
+};
+
+struct SqlStatement {
+    const char *name;
+    const char *query;
+    SqlParameters parameters;
+    int limit;
+    int writes; // run inside a transaction that is rolled back after each repetition
+};
+
+// keep in step with server.cpp, the page limits are the ones it binds for a default request
+const SqlStatement sqlStatements[] = {
+    {"users.load", "SELECT username, password FROM Users;", PARAMS_NONE, 0, 0},
+    {"users.insert", "INSERT INTO Users (username, password) VALUES (?, ?);", PARAMS_NEW_USER, 0, 1},
+    {"conversations.find", "SELECT id FROM Conversations WHERE userA = ? AND userB = ?;", PARAMS_PAIR, 0, 0},
+    {"conversations.insert", "INSERT OR IGNORE INTO Conversations (userA, userB) VALUES (?, ?);", PARAMS_PAIR, 0, 1},
+    {"summaries.markRead", "UPDATE ConversationSummaries SET unreadCount = 0 WHERE owner = ? AND peer = ? AND unreadCount <> 0;", PARAMS_OWNER_PEER, 0, 1},
+    {"summaries.list", "SELECT peer, lastMessageId, lastTimeStamp, preview, unreadCount FROM ConversationSummaries"
+                       "    WHERE owner = ? ORDER BY lastCreatedAt DESC, lastMessageId DESC;", PARAMS_OWNER, 0, 0},
+    {"inbox.delivered", "SELECT deliveredUpTo FROM Inboxes WHERE owner = ?;", PARAMS_OWNER, 0, 0},
+    {"inbox.unread", "SELECT peer, unreadCount FROM ConversationSummaries INDEXED BY SummariesUnread WHERE owner = ? AND unreadCount > 0;", PARAMS_OWNER, 0, 0},
+    {"inbox.messages", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE receiver = ? AND id > ? ORDER BY id LIMIT ?;", PARAMS_INBOX, 101, 0},
+    {"inbox.updateDelivered", "INSERT INTO Inboxes (owner, deliveredUpTo) VALUES (?1, ?2)"
+                              "    ON CONFLICT (owner) DO UPDATE SET deliveredUpTo = max(deliveredUpTo, excluded.deliveredUpTo);", PARAMS_DELIVERED, 0, 1},
+    {"sync.first", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                   "conversationId = ?1 ORDER BY createdAt, id LIMIT ?2;", PARAMS_CONVERSATION_PAGE, 101, 0},
+    {"sync.after", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                   "conversationId = ?1 AND (createdAt, id) > (SELECT createdAt, id FROM Messages WHERE id = ?3 AND conversationId = ?1) "
+                   "ORDER BY createdAt, id LIMIT ?2;", PARAMS_CONVERSATION_CURSOR, 101, 0},
+    {"hotcache.fill", "SELECT id, sender, receiver, content, timeStamp, createdAt FROM Messages WHERE "
+                      "conversationId = ?1 ORDER BY createdAt DESC, id DESC LIMIT ?2;", PARAMS_CONVERSATION_PAGE, 65, 0},
+    {"history.all", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                    "conversationId = ? ORDER BY createdAt, id;", PARAMS_CONVERSATION, 0, 0},
+    {"history.latest", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                       "conversationId = ?1 ORDER BY createdAt DESC, id DESC LIMIT ?2;", PARAMS_CONVERSATION_PAGE, 21, 0},
+    {"history.before", "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                       "conversationId = ?1 AND (createdAt, id) < (SELECT createdAt, id FROM Messages WHERE id = ?3 AND conversationId = ?1) "
+                       "ORDER BY createdAt DESC, id DESC LIMIT ?2;", PARAMS_CONVERSATION_CURSOR, 21, 0},
+    {"reply.check", "SELECT content FROM Messages WHERE id = ? AND conversationId = ?;", PARAMS_MESSAGE, 0, 0},
+    {"messages.insert", "INSERT INTO Messages (id, sender, receiver, content, timeStamp, replyId, isDeleted, conversationId, createdAt) VALUES (?, ?, ?, ?, ?, ?, 0, ?, ?);", PARAMS_NEW_MESSAGE, 0, 1},
+};
+
+struct SampleRow {
+    sqlite3_int64 id;
+    sqlite3_int64 conversationId;
+    sqlite3_int64 createdAt;
+    char sender[USERNAME_LENGTH];
+    char receiver[USERNAME_LENGTH];
+};
+
+struct SqlContext {
+    sqlite3 *db;
+    const SqlStatement *statement;
+    sqlite3_stmt *stmt;
+    std::vector<SampleRow> samples;
+    size_t next; // sample to use next
+    long fresh; // new rows made this repetition, for unique keys
+    sqlite3_int64 lastId;
+    sqlite3_int64 lastCreatedAt;
+};
+
+void checkSql(int rc, sqlite3 *db, const char *what)
+{
+    if (rc != SQLITE_OK && rc != SQLITE_DONE && rc != SQLITE_ROW)
+    {
+        fprintf(stderr, "sql: %s: %s\n", what, sqlite3_errmsg(db));
+        exit(1);
+    }
+}
+
+void execSql(sqlite3 *db, const char *statement)
+{
+    checkSql(sqlite3_exec(db, statement, NULL, NULL, NULL), db, statement);
+}
+
+void formatTimeStamp(sqlite3_int64 createdAt, char *timeStamp)
+{
+    time_t seconds = createdAt / 1000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    strftime(timeStamp, TIMESTAMP_LENGTH, "%Y-%m-%d %H:%M:%S", &utc);
+}
+
+void benchUserName(long index, char *username)
+{
+    snprintf(username, USERNAME_LENGTH, "user%07ld", index);
+}
+
+// users pair up with the BENCH_PEERS users after them, every message goes to one of those conversations at
+// random, 10ms after the one before it, with an id made the way the server makes them. the tables are
+// filled bare, the indexes, summaries and triggers come after, which is much faster than row by row
+int generateDatabase(const char *path, long messages)
+{
+    printf("generating %s with %ld messages...\n", path, messages);
+    fflush(stdout);
+    double start = now();
+    unlink(path);
+    sqlite3 *db;
+    if (sqlite3_open(path, &db) != SQLITE_OK)
+        return -1;
+    execSql(db, "PRAGMA journal_mode = OFF;");
+    execSql(db, "PRAGMA synchronous = OFF;");
+    execSql(db, "PRAGMA cache_size = -262144;");
+    const char *tables[] = {createUsersTable, createConversationsTable, createMessagesTable, createSummariesTable, createInboxesTable};
+    for (const char *statement : tables)
+        execSql(db, statement);
+    execSql(db, "BEGIN;");
+
+    long users = std::max(messages / BENCH_USERS_PER_MESSAGES, (long)BENCH_PEERS * 4);
+    sqlite3_stmt *stmt;
+    checkSql(sqlite3_prepare_v2(db, "INSERT INTO Users (username, password) VALUES (?, ?);", -1, &stmt, NULL), db, "prepare users");
+    char username[USERNAME_LENGTH], peer[USERNAME_LENGTH];
+    for (long i = 0; i < users; i++)
+    {
+        benchUserName(i, username);
+        sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, "bench", -1, SQLITE_STATIC);
+        checkSql(sqlite3_step(stmt), db, "insert user");
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    // conversation c (from 1) is user (c - 1) / BENCH_PEERS with the (c - 1) % BENCH_PEERS + 1th user after it
+    long conversations = users * BENCH_PEERS;
+    checkSql(sqlite3_prepare_v2(db, "INSERT INTO Conversations (id, userA, userB) VALUES (?, ?, ?);", -1, &stmt, NULL), db, "prepare conversations");
+    for (long c = 1; c <= conversations; c++)
+    {
+        long user = (c - 1) / BENCH_PEERS;
+        benchUserName(user, username);
+        benchUserName((user + (c - 1) % BENCH_PEERS + 1) % users, peer);
+        sqlite3_bind_int64(stmt, 1, c);
+        sqlite3_bind_text(stmt, 2, strcmp(username, peer) < 0 ? username : peer, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, strcmp(username, peer) < 0 ? peer : username, -1, SQLITE_TRANSIENT);
+        checkSql(sqlite3_step(stmt), db, "insert conversation");
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    checkSql(sqlite3_prepare_v2(db, "INSERT INTO Messages (id, sender, receiver, content, timeStamp, replyId, isDeleted, conversationId, createdAt) "
+                                    "VALUES (?, ?, ?, ?, ?, NULL, 0, ?, ?);", -1, &stmt, NULL), db, "prepare messages");
+    unsigned int seed = 1;
+    char content[MAX_CONTENT_LENGTH], timeStamp[TIMESTAMP_LENGTH];
+    for (long m = 1; m <= messages; m++)
+    {
+        long c = rand_r(&seed) % conversations + 1;
+        long user = (c - 1) / BENCH_PEERS;
+        benchUserName(user, username);
+        benchUserName((user + (c - 1) % BENCH_PEERS + 1) % users, peer);
+        int reversed = rand_r(&seed) % 2;
+        sqlite3_int64 createdAt = 1704067200000LL + m * 10;
+        formatTimeStamp(createdAt, timeStamp);
+        // 20 to 120 characters
+        int length = snprintf(content, sizeof(content), "message %ld of the benchmark, ", m);
+        int target = 20 + rand_r(&seed) % 100;
+        for (; length < target; length++)
+            content[length] = 'a' + length % 26;
+        content[target] = '\0';
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(m * 10) << 6);
+        sqlite3_bind_text(stmt, 2, reversed ? peer : username, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, reversed ? username : peer, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, content, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 5, timeStamp, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 6, c);
+        sqlite3_bind_int64(stmt, 7, createdAt);
+        checkSql(sqlite3_step(stmt), db, "insert message");
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    execSql(db, "COMMIT;");
+
+    // a summary per side of every conversation that has messages, the receiver of the last one has it unread,
+    // and half of the users have had their inbox pushed up to the middle of the history
+    const char *after[] = {
+        createConversationsIndex,
+        createMessagesIndex,
+        createMessagesReceiverIndex,
+        "INSERT INTO ConversationSummaries (owner, peer, lastMessageId, lastCreatedAt, lastTimeStamp, preview, unreadCount)"
+        "    SELECT m.sender, m.receiver, m.id, m.createdAt, m.timeStamp, substr(m.content, 1, 32), 0 FROM Messages m"
+        "    WHERE m.id IN (SELECT max(id) FROM Messages GROUP BY conversationId)"
+        "    UNION ALL"
+        "    SELECT m.receiver, m.sender, m.id, m.createdAt, m.timeStamp, substr(m.content, 1, 32), 1 + m.id % 3 FROM Messages m"
+        "    WHERE m.id IN (SELECT max(id) FROM Messages GROUP BY conversationId);",
+        "INSERT INTO Inboxes (owner, deliveredUpTo) SELECT username, (SELECT max(id) / 2 FROM Messages) FROM Users WHERE rowid % 2 = 0;",
+        createSummariesIndex,
+        createSummariesUnreadIndex,
+        createMessagesTrigger,
+        createSummariesTrigger,
+        "ANALYZE;",
+    };
+    for (const char *statement : after)
+        execSql(db, statement);
+    std::string setVersion = "PRAGMA user_version = " + std::to_string(SCHEMA_VERSION) + ";";
+    execSql(db, setVersion.c_str());
+    execSql(db, "PRAGMA journal_mode = WAL;");
+    sqlite3_close(db);
+    printf("generated in %.1f s\n", now() - start);
+    return 0;
+}
+
+// an existing file is reused if it is at this schema version and holds that many messages
+int openDataset(const char *path, long messages, sqlite3 **db)
+{
+    if (access(path, F_OK) == 0 && sqlite3_open_v2(path, db, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK)
+    {
+        sqlite3_stmt *stmt;
+        long found = -1;
+        if (schemaVersion(*db) == SCHEMA_VERSION
+            && sqlite3_prepare_v2(*db, "SELECT count(*) FROM Messages;", -1, &stmt, NULL) == SQLITE_OK)
+        {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                found = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        if (found == messages)
+            return 0;
+        sqlite3_close(*db);
+    }
+    if (generateDatabase(path, messages) == -1 || sqlite3_open_v2(path, db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+void bindParameters(SqlContext *sql)
+{
+    const SampleRow *sample = &sql->samples[sql->next++ % sql->samples.size()];
+    sqlite3_stmt *stmt = sql->stmt;
+    const char *userA = strcmp(sample->sender, sample->receiver) < 0 ? sample->sender : sample->receiver;
+    const char *userB = userA == sample->sender ? sample->receiver : sample->sender;
+    switch (sql->statement->parameters)
+    {
+        case PARAMS_NONE:
+            break;
+        case PARAMS_NEW_USER: {
+            char username[USERNAME_LENGTH];
+            snprintf(username, USERNAME_LENGTH, "new%ld", sql->fresh++);
+            sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(stmt, 2, "bench", -1, SQLITE_STATIC);
+            break;
+        }
+        case PARAMS_PAIR:
+            sqlite3_bind_text(stmt, 1, userA, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, userB, -1, SQLITE_STATIC);
+            break;
+        case PARAMS_OWNER_PEER:
+            sqlite3_bind_text(stmt, 1, sample->receiver, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, sample->sender, -1, SQLITE_STATIC);
+            break;
+        case PARAMS_OWNER:
+            sqlite3_bind_text(stmt, 1, sample->receiver, -1, SQLITE_STATIC);
+            break;
+        case PARAMS_INBOX:
+            sqlite3_bind_text(stmt, 1, sample->receiver, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 2, sample->id);
+            sqlite3_bind_int(stmt, 3, sql->statement->limit);
+            break;
+        case PARAMS_DELIVERED:
+            sqlite3_bind_text(stmt, 1, sample->receiver, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 2, sample->id);
+            break;
+        case PARAMS_CONVERSATION:
+            sqlite3_bind_int64(stmt, 1, sample->conversationId);
+            break;
+        case PARAMS_CONVERSATION_PAGE:
+            sqlite3_bind_int64(stmt, 1, sample->conversationId);
+            sqlite3_bind_int(stmt, 2, sql->statement->limit);
+            break;
+        case PARAMS_CONVERSATION_CURSOR: {
+            // the cursor is a message id as text, the way it arrives in a packet
+            char cursor[ID_LENGTH];
+            snprintf(cursor, ID_LENGTH, "%lld", (long long)sample->id);
+            sqlite3_bind_int64(stmt, 1, sample->conversationId);
+            sqlite3_bind_int(stmt, 2, sql->statement->limit);
+            sqlite3_bind_text(stmt, 3, cursor, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case PARAMS_MESSAGE:
+            sqlite3_bind_int64(stmt, 1, sample->id);
+            sqlite3_bind_int64(stmt, 2, sample->conversationId);
+            break;
+        case PARAMS_NEW_MESSAGE: {
+            sqlite3_int64 createdAt = sql->lastCreatedAt + 10 * ++sql->fresh;
+            char timeStamp[TIMESTAMP_LENGTH];
+            formatTimeStamp(createdAt, timeStamp);
+            sqlite3_bind_int64(stmt, 1, sql->lastId + (sql->fresh << 6));
+            sqlite3_bind_text(stmt, 2, sample->sender, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, sample->receiver, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, "a message written by the benchmark", -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 5, timeStamp, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_null(stmt, 6);
+            sqlite3_bind_int64(stmt, 7, sample->conversationId);
+            sqlite3_bind_int64(stmt, 8, createdAt);
+            break;
+        }
+    }
+}
+
+// bind, step through every row reading the columns the server reads, reset: what one request costs
+void runExecute(void *context, long iterations)
+{
+    SqlContext *sql = (SqlContext *)context;
+    for (long i = 0; i < iterations; i++)
+    {
+        bindParameters(sql);
+        int rc;
+        while ((rc = sqlite3_step(sql->stmt)) == SQLITE_ROW)
+        {
+            for (int column = 0; column < sqlite3_column_count(sql->stmt); column++)
+                sqlite3_column_text(sql->stmt, column);
+        }
+        checkSql(rc, sql->db, sql->statement->name);
+        sqlite3_reset(sql->stmt);
+    }
+}
+
+// what a statement costs without the server's cache: compiled and thrown away each time
+void runPrepare(void *context, long iterations)
+{
+    SqlContext *sql = (SqlContext *)context;
+    for (long i = 0; i < iterations; i++)
+    {
+        sqlite3_stmt *stmt;
+        checkSql(sqlite3_prepare_v2(sql->db, sql->statement->query, -1, &stmt, NULL), sql->db, sql->statement->name);
+        sqlite3_finalize(stmt);
+    }
+}
+
+void beginWrites(void *context)
+{
+    SqlContext *sql = (SqlContext *)context;
+    sql->fresh = 0;
+    execSql(sql->db, "BEGIN IMMEDIATE;");
+}
+
+void rollbackWrites(void *context)
+{
+    execSql(((SqlContext *)context)->db, "ROLLBACK;");
+}
+
+void benchSql(const char *directory, long messages, const char *dataset)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench-%s.db", directory, dataset);
+    SqlContext sql;
+    if (openDataset(path, messages, &sql.db) == -1)
+    {
+        fprintf(stderr, "sql: cannot open or generate %s\n", path);
+        exit(1);
+    }
+    // the server's settings, synchronous FULL is left out: every write here is rolled back
+    execSql(sql.db, "PRAGMA cache_size = -8192;");
+    execSql(sql.db, "PRAGMA mmap_size = 268435456;");
+    execSql(sql.db, "PRAGMA journal_mode = WAL;");
+
+    // the same random messages for every statement and every run
+    sqlite3_stmt *stmt;
+    checkSql(sqlite3_prepare_v2(sql.db, "SELECT id, conversationId, createdAt, sender, receiver FROM Messages WHERE rowid = ?;", -1, &stmt, NULL), sql.db, "samples");
+    unsigned int seed = 7;
+    while ((long)sql.samples.size() < SAMPLE_ROWS)
+    {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(rand_r(&seed) % messages + 1) * 10 << 6);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            SampleRow sample;
+            sample.id = sqlite3_column_int64(stmt, 0);
+            sample.conversationId = sqlite3_column_int64(stmt, 1);
+            sample.createdAt = sqlite3_column_int64(stmt, 2);
+            snprintf(sample.sender, USERNAME_LENGTH, "%s", (const char *)sqlite3_column_text(stmt, 3));
+            snprintf(sample.receiver, USERNAME_LENGTH, "%s", (const char *)sqlite3_column_text(stmt, 4));
+            sql.samples.push_back(sample);
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    checkSql(sqlite3_prepare_v2(sql.db, "SELECT max(id), max(createdAt) FROM Messages;", -1, &stmt, NULL), sql.db, "last message");
+    sqlite3_step(stmt);
+    sql.lastId = sqlite3_column_int64(stmt, 0);
+    sql.lastCreatedAt = sqlite3_column_int64(stmt, 1);
+    sqlite3_finalize(stmt);
+
+    printMeasureHeader(("sql, " + std::string(dataset) + " messages").c_str());
+    for (const SqlStatement &statement : sqlStatements)
+    {
+        sql.statement = &statement;
+        sql.next = 0;
+        Benchmark prepare = {"sql", std::string(statement.name) + "/prepare", dataset, runPrepare, NULL, NULL, &sql};
+        measure(&prepare);
+        checkSql(sqlite3_prepare_v2(sql.db, statement.query, -1, &sql.stmt, NULL), sql.db, statement.name);
+        Benchmark execute = {"sql", std::string(statement.name) + "/execute", dataset, runExecute,
+                             statement.writes ? beginWrites : NULL, statement.writes ? rollbackWrites : NULL, &sql};
+        measure(&execute);
+        sqlite3_finalize(sql.stmt);
+    }
+    sqlite3_close(sql.db);
+}
+
+// "10k" is 10000, "1m" a million
+long parseCount(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'k' || *end == 'K')
+        value *= 1e3;
+    else if (*end == 'm' || *end == 'M')
+        value *= 1e6;
+    return (long)value;
+}
+
+void jsonString(FILE *file, const std::string &text)
+{
+    fputc('"', file);
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            fputc('\\', file);
+        fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+int writeJson(const char *path)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    fprintf(file, "{\n  \"repetitions\": %d,\n  \"warmup\": %d,\n  \"results\": [", repetitions, warmupRepetitions);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &result = results[i];
+        fprintf(file, "%s\n    {\"suite\": ", i ? "," : "");
+        jsonString(file, result.suite);
+        fprintf(file, ", \"name\": ");
+        jsonString(file, result.name);
+        if (!result.dataset.empty())
+        {
+            fprintf(file, ", \"dataset\": ");
+            jsonString(file, result.dataset);
+        }
+        fprintf(file, ", \"unit\": \"%s\", \"iterations\": %ld, \"repetitions\": %d, \"median\": %.3f, \"mean\": %.3f, "
+                      "\"stddev\": %.3f, \"min\": %.3f, \"max\": %.3f}",
+                result.unit, result.iterations, result.repetitions, result.median, result.mean, result.stddev, result.min, result.max);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    if (file != stdout)
+        fclose(file);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *suites = DEFAULT_SUITES;
+    const char *datasets = DEFAULT_DATASETS;
+    const char *directory = ".";
+    const char *jsonPath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "s:m:D:r:w:j:")) != -1)
+    {
+        switch (option)
+        {
+            case 's':
+                suites = optarg;
+                break;
+            case 'm':
+                datasets = optarg;
+                break;
+            case 'D':
+                directory = optarg;
+                break;
+            case 'r':
+                repetitions = atoi(optarg);
+                break;
+            case 'w':
+                warmupRepetitions = atoi(optarg);
+                break;
+            case 'j':
+                jsonPath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Syntax: %s [-s suites, default %s] [-m message_counts, default %s] [-D database_directory]\n"
+                                "       [-r repetitions] [-w warmup_repetitions] [-j json_file, - for stdout]\n", argv[0], DEFAULT_SUITES, DEFAULT_DATASETS);
+                return EXIT_FAILURE;
+        }
+    }
+    if (repetitions < 1 || warmupRepetitions < 0)
+    {
+        fprintf(stderr, "needs at least one repetition\n");
+        return EXIT_FAILURE;
+    }
+    std::string selected = std::string(",") + suites + ",";
+    if (selected.find(",cipher,") != std::string::npos)
+        benchCipher();
+    if (selected.find(",codec,") != std::string::npos)
+        benchCodec();
+    if (selected.find(",sql,") != std::string::npos)
+    {
+        std::string list = datasets;
+        size_t start = 0;
+        while (start < list.size())
+        {
+            size_t comma = list.find(',', start);
+            if (comma == std::string::npos)
+                comma = list.size();
+            std::string dataset = list.substr(start, comma - start);
+            long messages = parseCount(dataset.c_str());
+            if (messages <= 0)
+            {
+                fprintf(stderr, "not a message count: %s\n", dataset.c_str());
+                return EXIT_FAILURE;
+            }
+            benchSql(directory, messages, dataset.c_str());
+            start = comma + 1;
+        }
+    }
+    if (jsonPath != NULL && writeJson(jsonPath) == -1)
+    {
+        fprintf(stderr, "cannot write %s\n", jsonPath);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
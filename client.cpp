@@ -4,109 +4,805 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #define MAX_WORDS 32
+#define HISTORY_PAGE 20 // messages loaded by viewconvo, and by each 'older'
+#define MAX_PENDING 4096 // pipelined requests waiting for their answer, a burst sends at most this many
+#define MAX_HELD 64 // notifications held while the open conversation syncs, past that the sync runs once more
 
-void* receiveThread(void* arg) {
-    int clientSocket = *(int*)arg;
-    while (1) {
-        unsigned char receivedBuffer[sizeof(Packet)];
-        ssize_t totalBytesReceived = 0;
-        ssize_t bytesReceived;
-        while (totalBytesReceived < sizeof(Packet)) {
-            bytesReceived = recv(clientSocket, receivedBuffer + totalBytesReceived, sizeof(receivedBuffer) - totalBytesReceived, 0);
-            if (bytesReceived <= 0) {
-                break;
+// where the next 'older' continues from, updated by every VIEW_CONVERSATION_END (or by the cache)
+pthread_mutex_t historyMutex = PTHREAD_MUTEX_INITIALIZER;
+char historyUser[USERNAME_LENGTH];
+char historyCursor[ID_LENGTH];
+int historyHasOlder = 0;
+
+// where the next 'sync' continues the inbox from, updated by every SYNC_END of the inbox
+pthread_mutex_t inboxMutex = PTHREAD_MUTEX_INITIALIZER;
+char inboxCursor[ID_LENGTH];
+
+int legacyMode = 0; // speak the old fixed-size format, for servers that only know it
+
+int serverSocket;
+pthread_mutex_t sendMutex = PTHREAD_MUTEX_INITIALIZER; // requests are sent by both threads
+
+// LOCAL MESSAGE CACHE: <user>.cache holds the messages of each conversation downloaded so far, appended in
+// the server's order, <user>.index says where each conversation's latest one is. the first open caches the
+// latest page, 'older' adds the pages before it in front, and opening it again only asks the server for what
+// came after the last one. .cache is only ever appended to: a page added in front is tied to the messages
+// after it by a link record, the index is what gets rewritten
+
+#define CACHE_MAGIC 0x4d43574f
+#define CACHE_VERSION 3
+#define CACHE_NONE ((uint64_t)-1)
+#define CACHE_INITIAL_BYTES (1024 * 1024) // both files double from here when they fill up
+#define CACHE_INITIAL_ENTRIES 64
+
+struct CacheIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dataLength; // bytes of .cache in use, anything after it is an append that did not finish
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+};
+
+struct CacheIndexEntry {
+    char peer[USERNAME_LENGTH];
+    int64_t lastId; // the next sync asks for what came after it
+    uint64_t lastOffset;
+    uint64_t firstOffset; // the oldest message cached
+    uint64_t lastLink; // the latest link record, CACHE_NONE until a page was added in front
+    uint64_t count;
+    uint32_t complete; // the oldest message cached is the conversation's first, before that 'older' asks the server
+    uint32_t reserved;
+};
+
+// one message in .cache: this header, then the message as an unencoded compact frame, padded to 8 bytes
+struct CacheRecord {
+    uint64_t previous; // the conversation's message before this one, CACHE_NONE for the oldest when it was written
+    int64_t id;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+// in .cache after an older page: the message before the one at from, which had none when it was written, is at to
+struct CacheLink {
+    uint64_t from;
+    uint64_t to;
+    uint64_t previous; // the conversation's link before this one
+};
+
+struct MappedFile {
+    int fd;
+    unsigned char *data;
+    size_t capacity;
+};
+
+struct MessageCache {
+    int open;
+    MappedFile data;
+    MappedFile index;
+};
+
+// what happens to the conversation being opened: its VIEW_CONVERSATION (entering it server side) is answered,
+// then its SYNC pages are appended, then live notifications are appended as they come
+enum CacheState {
+    CACHE_IDLE,
+    CACHE_SEEDING, // not cached yet: the latest page is shown and cached as it comes, the sync goes on from it
+    CACHE_OPENING,
+    CACHE_SYNCING,
+    CACHE_LIVE,
+    CACHE_PAGING, // live, and an older page from the server is going in front of the cached ones
+    CACHE_FAILED // the server refused the conversation, the SYNC's error is not shown twice
+};
+
+// all under historyMutex
+MessageCache cache;
+CacheState cacheState = CACHE_IDLE;
+char cacheUser[USERNAME_LENGTH];
+int64_t shownUpTo; // last cached id when the conversation was opened, what the sync brings is after it
+uint64_t olderOffset = CACHE_NONE; // oldest message printed, 'older' goes on from the one before it
+uint64_t pageFirst, pageLast; // the older page written so far, linked in front once its end arrives
+uint64_t pageCount;
+Packet held[MAX_HELD]; // notifications of the conversation that came before it was live, cached once the sync is in
+int heldCount, heldOverflow;
+
+int mapFile(MappedFile *file, const char *path, size_t minimum) {
+    file->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (file->fd == -1)
+        return -1;
+    struct stat info;
+    fstat(file->fd, &info);
+    file->capacity = (size_t)info.st_size < minimum ? minimum : (size_t)info.st_size;
+    if ((size_t)info.st_size < file->capacity && ftruncate(file->fd, file->capacity) == -1) {
+        close(file->fd);
+        return -1;
+    }
+    file->data = (unsigned char *)mmap(NULL, file->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (file->data == MAP_FAILED) {
+        close(file->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// makes room for needed bytes, pointers into the old mapping are not valid afterwards
+int growFile(MappedFile *file, size_t needed) {
+    if (needed <= file->capacity)
+        return 0;
+    size_t capacity = file->capacity;
+    while (capacity < needed)
+        capacity *= 2;
+    if (ftruncate(file->fd, capacity) == -1)
+        return -1;
+    munmap(file->data, file->capacity);
+    file->data = (unsigned char *)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    file->capacity = capacity;
+    return file->data == MAP_FAILED ? -1 : 0;
+}
+
+void unmapFile(MappedFile *file) {
+    munmap(file->data, file->capacity);
+    close(file->fd);
+}
+
+CacheIndexHeader *cacheHeader() {
+    return (CacheIndexHeader *)cache.index.data;
+}
+
+CacheIndexEntry *cacheEntries() {
+    return (CacheIndexEntry *)(cache.index.data + sizeof(CacheIndexHeader));
+}
+
+void closeCache() {
+    if (!cache.open)
+        return;
+    unmapFile(&cache.data);
+    unmapFile(&cache.index);
+    cache.open = 0;
+}
+
+// the cache lives next to the client, one pair of files per user. a name that is not a plain file name gets none
+void openCache(const char *username) {
+    closeCache();
+    if (legacyMode || username[0] == '\0' || username[0] == '.' || strchr(username, '/') != NULL)
+        return;
+    char dataPath[USERNAME_LENGTH + 16], indexPath[USERNAME_LENGTH + 16];
+    snprintf(dataPath, sizeof(dataPath), "%s.cache", username);
+    snprintf(indexPath, sizeof(indexPath), "%s.index", username);
+    if (mapFile(&cache.data, dataPath, CACHE_INITIAL_BYTES) == -1)
+        return;
+    if (mapFile(&cache.index, indexPath, sizeof(CacheIndexHeader) + CACHE_INITIAL_ENTRIES * sizeof(CacheIndexEntry)) == -1) {
+        unmapFile(&cache.data);
+        return;
+    }
+    cache.open = 1;
+    CacheIndexHeader *header = cacheHeader();
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->dataLength > cache.data.capacity) {
+        // new, or written by another version: start over
+        header->magic = CACHE_MAGIC;
+        header->version = CACHE_VERSION;
+        header->dataLength = 0;
+        header->entryCount = 0;
+    }
+    header->entryCapacity = (cache.index.capacity - sizeof(CacheIndexHeader)) / sizeof(CacheIndexEntry);
+}
+
+// the conversation's index entry, a new one if create is set, NULL if there is none
+CacheIndexEntry *findCacheEntry(const char *peer, int create) {
+    CacheIndexHeader *header = cacheHeader();
+    for (uint32_t i = 0; i < header->entryCount; i++)
+        if (strcmp(cacheEntries()[i].peer, peer) == 0)
+            return &cacheEntries()[i];
+    if (!create)
+        return NULL;
+    if (header->entryCount == header->entryCapacity) {
+        if (growFile(&cache.index, cache.index.capacity * 2) == -1) {
+            closeCache();
+            return NULL;
+        }
+        header = cacheHeader();
+        header->entryCapacity = (cache.index.capacity - sizeof(CacheIndexHeader)) / sizeof(CacheIndexEntry);
+    }
+    CacheIndexEntry *entry = &cacheEntries()[header->entryCount];
+    memset(entry, 0, sizeof(CacheIndexEntry));
+    strcpy(entry->peer, peer);
+    entry->lastOffset = CACHE_NONE;
+    entry->firstOffset = CACHE_NONE;
+    entry->lastLink = CACHE_NONE;
+    header->entryCount++;
+    return entry;
+}
+
+// writes the message after everything already there, its offset or CACHE_NONE if the cache had to close
+uint64_t writeCached(const Packet *packet, uint64_t previous) {
+    unsigned char frame[sizeof(Packet) + MAX_FRAME_HEADER];
+    size_t frameLength = encodeCompactFrame(packet, frame, 0);
+    size_t recordLength = (sizeof(CacheRecord) + frameLength + 7) & ~(size_t)7;
+    uint64_t offset = cacheHeader()->dataLength;
+    if (growFile(&cache.data, offset + recordLength) == -1) {
+        closeCache();
+        return CACHE_NONE;
+    }
+    CacheRecord *record = (CacheRecord *)(cache.data.data + offset);
+    record->previous = previous;
+    record->id = atoll(packet->message.id);
+    record->length = frameLength;
+    record->reserved = 0;
+    memcpy(cache.data.data + offset + sizeof(CacheRecord), frame, frameLength);
+    cacheHeader()->dataLength = offset + recordLength;
+    return offset;
+}
+
+// the message goes after the conversation's latest one, the index moves only once it is written
+void appendCached(const char *peer, const Packet *packet) {
+    CacheIndexEntry *entry = findCacheEntry(peer, 1);
+    if (entry == NULL)
+        return;
+    uint64_t offset = writeCached(packet, entry->lastOffset);
+    if (offset == CACHE_NONE)
+        return;
+    if (entry->firstOffset == CACHE_NONE)
+        entry->firstOffset = offset;
+    entry->lastId = atoll(packet->message.id);
+    entry->lastOffset = offset;
+    entry->count++;
+}
+
+// the older page written since pageFirst goes in front of the conversation's oldest cached message
+void linkOlderPage(int complete) {
+    CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+    if (entry == NULL)
+        return;
+    if (pageFirst != CACHE_NONE) {
+        uint64_t offset = cacheHeader()->dataLength;
+        if (growFile(&cache.data, offset + sizeof(CacheLink)) == -1) {
+            closeCache();
+            return;
+        }
+        CacheLink *link = (CacheLink *)(cache.data.data + offset);
+        link->from = entry->firstOffset;
+        link->to = pageLast;
+        link->previous = entry->lastLink;
+        cacheHeader()->dataLength = offset + sizeof(CacheLink);
+        entry->lastLink = offset;
+        entry->firstOffset = pageFirst;
+        entry->count += pageCount;
+        olderOffset = pageFirst;
+    }
+    entry->complete = complete;
+}
+
+// the conversation's cached message before the one at offset, CACHE_NONE if it is the oldest cached
+uint64_t cachedBefore(const CacheIndexEntry *entry, uint64_t offset) {
+    uint64_t previous = ((CacheRecord *)(cache.data.data + offset))->previous;
+    if (previous != CACHE_NONE || entry == NULL)
+        return previous;
+    for (uint64_t link = entry->lastLink; link != CACHE_NONE; link = ((CacheLink *)(cache.data.data + link))->previous)
+        if (((CacheLink *)(cache.data.data + link))->from == offset)
+            return ((CacheLink *)(cache.data.data + link))->to;
+    return CACHE_NONE;
+}
+
+// a cache the server no longer recognises (its cursor is unknown there) is dropped, the next open seeds it again
+void forgetCached(CacheIndexEntry *entry) {
+    entry->lastId = 0;
+    entry->lastOffset = CACHE_NONE;
+    entry->firstOffset = CACHE_NONE;
+    entry->lastLink = CACHE_NONE;
+    entry->count = 0;
+    entry->complete = 0;
+}
+
+CacheRecord *readCached(uint64_t offset, Packet *packet) {
+    CacheRecord *record = (CacheRecord *)(cache.data.data + offset);
+    unsigned char *frame = cache.data.data + offset + sizeof(CacheRecord);
+    FrameHeader header;
+    int headerLength = parseFrameHeader(frame, record->length, &header);
+    if (headerLength <= 0 || decodeCompactFrame(&header, frame + headerLength, packet) == -1)
+        memset(packet, 0, sizeof(Packet));
+    return record;
+}
+
+void printHistoryMessage(const Packet &packet) {
+    printf("\n-- Message [%s] ----------- %s >>> %s (%s)\n%s\n", packet.message.id, packet.message.sender, packet.message.receiver, packet.message.timeStamp, packet.message.content);
+}
+
+// prints up to limit cached messages ending with the one at offset, oldest first, as long as their id is
+// above after. returns 1 if the conversation has messages before the first one printed, cached or not
+int printCached(uint64_t offset, int limit, int64_t after) {
+    CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+    uint64_t offsets[HISTORY_PAGE];
+    int count = 0;
+    while (offset != CACHE_NONE && count < limit && ((CacheRecord *)(cache.data.data + offset))->id > after) {
+        offsets[count++] = offset;
+        offset = cachedBefore(entry, offset);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        Packet packet;
+        readCached(offsets[i], &packet);
+        printHistoryMessage(packet);
+    }
+    if (count > 0)
+        olderOffset = offsets[count - 1];
+    if (olderOffset == CACHE_NONE)
+        return 0;
+    return cachedBefore(entry, olderOffset) != CACHE_NONE || (entry != NULL && !entry->complete);
+}
+
+// REQUEST IDS: sends and syncs carry one, so the server runs them alongside each other and the answers
+// are matched back by it. the rest go without, and the server answers them in order as before
+
+struct PendingRequest {
+    uint32_t id; // 0 for a free slot
+    PacketType type;
+    int burst; // one of the messages of the running burst
+};
+
+pthread_mutex_t pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+PendingRequest pending[MAX_PENDING]; // by id % MAX_PENDING
+uint32_t nextRequestId = 1;
+
+// the running burst: how many of its messages were answered, and how
+int burstTotal, burstSent, burstFailed;
+struct timespec burstStart;
+
+// the answer that ends a request of this type
+PacketType finalResponse(PacketType type) {
+    return type == SEND_MESSAGE ? SEND_MESSAGE_RESPONSE : SYNC_END;
+}
+
+// called for every response: frees the request's slot once its last answer is in
+void finishRequest(const Packet &packet) {
+    if (packet.requestId == 0)
+        return;
+    pthread_mutex_lock(&pendingMutex);
+    PendingRequest &request = pending[packet.requestId % MAX_PENDING];
+    if (request.id != packet.requestId || finalResponse(request.type) != packet.type) {
+        pthread_mutex_unlock(&pendingMutex);
+        return;
+    }
+    request.id = 0;
+    if (request.burst) {
+        if (packet.error == SUCCESS)
+            burstSent++;
+        else
+            burstFailed++;
+        if (burstSent + burstFailed == burstTotal) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - burstStart.tv_sec) * 1e3 + (now.tv_nsec - burstStart.tv_nsec) / 1e6;
+            printf("\n-- Burst done: %d sent, %d failed in %.1f ms\n", burstSent, burstFailed, elapsed);
+            fflush(stdout);
+        }
+    }
+    pthread_mutex_unlock(&pendingMutex);
+}
+
+// 0 if MAX_PENDING requests are already waiting
+uint32_t trackRequest(PacketType type, int burst) {
+    pthread_mutex_lock(&pendingMutex);
+    uint32_t id = nextRequestId;
+    PendingRequest &request = pending[id % MAX_PENDING];
+    if (request.id != 0) {
+        pthread_mutex_unlock(&pendingMutex);
+        return 0;
+    }
+    nextRequestId = nextRequestId + 1 == 0 ? 1 : nextRequestId + 1;
+    request.id = id;
+    request.type = type;
+    request.burst = burst;
+    pthread_mutex_unlock(&pendingMutex);
+    return id;
+}
+
+// returns 0 if it could not be sent because too many requests are waiting already
+int sendRequest(Packet *P, int burst = 0) {
+    if (!legacyMode && (P->type == SEND_MESSAGE || P->type == SYNC)) {
+        P->requestId = trackRequest(P->type, burst);
+        if (P->requestId == 0)
+            return 0;
+    }
+    unsigned char buffer[sizeof(Packet) + MAX_FRAME_HEADER];
+    size_t length;
+    if (legacyMode) {
+        encodeLegacyPacket(P, buffer);
+        length = sizeof(LegacyPacket);
+    } else {
+        length = encodeCompactFrame(P, buffer, 1);
+    }
+    pthread_mutex_lock(&sendMutex);
+    send(serverSocket, buffer, length, 0);
+    pthread_mutex_unlock(&sendMutex);
+    return 1;
+}
+
+// next page of the conversation being opened, after the last message cached
+void requestSync(const char *peer, const char *cursor) {
+    Packet P;
+    memset(&P, 0, sizeof(P));
+    P.type = SYNC;
+    strcpy(P.user.username, peer);
+    strcpy(P.message.id, cursor);
+    sendRequest(&P);
+}
+
+// the held notifications the sync did not bring, in id order
+void cacheHeld() {
+    while (cache.open) {
+        CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+        int64_t after = entry ? entry->lastId : 0;
+        int next = -1;
+        for (int i = 0; i < heldCount; i++)
+            if (atoll(held[i].message.id) > after && (next == -1 || atoll(held[i].message.id) < atoll(held[next].message.id)))
+                next = i;
+        if (next == -1)
+            break;
+        appendCached(cacheUser, &held[next]);
+    }
+    heldCount = 0;
+}
+
+// SYNC_END of the conversation being opened: ask for the next page, or show what it brought
+void finishSync(const Packet &packet) {
+    if (heldOverflow) {
+        // some notifications were not held, the sync goes on until it has them
+        heldOverflow = 0;
+        heldCount = 0;
+        requestSync(cacheUser, packet.message.id);
+        return;
+    }
+    if (packet.count) {
+        requestSync(cacheUser, packet.message.id);
+        return;
+    }
+    cacheState = CACHE_LIVE;
+    CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+    if (entry == NULL || entry->lastId <= shownUpTo) {
+        cacheHeld();
+        return;
+    }
+    uint64_t cachedOlder = olderOffset;
+    int more = printCached(entry->lastOffset, HISTORY_PAGE, shownUpTo);
+    uint64_t before = cachedBefore(entry, olderOffset);
+    int allShown = before == CACHE_NONE || ((CacheRecord *)(cache.data.data + before))->id <= shownUpTo;
+    // every new message fit: 'older' goes on from the cached page shown when the conversation was opened
+    if (allShown && cachedOlder != CACHE_NONE)
+        olderOffset = cachedOlder;
+    else
+        historyHasOlder = more;
+    if (historyHasOlder)
+        printf("\n-- Type 'older' to load earlier messages\n");
+    cacheHeld(); // already shown as they came
+}
+
+// prints one response, whether it came as its own Packet or as a record of a BULK_RESPONSE
+void showPacket(Packet &receivedPacket) {
+    finishRequest(receivedPacket);
+    switch(receivedPacket.type) {
+        case REGISTER_RESPONSE: {
+            if(receivedPacket.error == USER_ALREADY_EXISTS)
+                printf("\n-- That username is already taken!\n");
+            else {
+                pthread_mutex_lock(&historyMutex);
+                openCache(receivedPacket.user.username);
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
+                printf("\n-- Welcome, %s!\n", receivedPacket.user.username);
             }
-            totalBytesReceived += bytesReceived;
-        }
-        Packet receivedPacket;
-        deserializePacket(receivedBuffer, &receivedPacket);
-        decode_vigenere_packet(&receivedPacket, vigenere_key);
-        if (totalBytesReceived > 0) {
-            switch(receivedPacket.type) {
-                case REGISTER_RESPONSE: {
-                    if(receivedPacket.error == USER_ALREADY_EXISTS)
-                        printf("\n-- That username is already taken!\n");
-                    else
-                        printf("\n-- Welcome, %s!\n", receivedPacket.user.username);
-                    fflush(stdout);
-                    break;
-                }
-                case LOGIN_RESPONSE: {
-                    if(receivedPacket.error == NOT_LOGGED_OUT)
-                        printf("\n-- You are already logged in!\n");
-                    else if(receivedPacket.error == INVALID_USER_DATA)
-                        printf("\n-- Username or password wrong!\n");
-                    else if(receivedPacket.error == USER_ALREADY_CONNECTED)
-                        printf("\n-- User is already connected on different device!\n");
-                    else
-                        printf("\n-- Welcome, %s!\n", receivedPacket.user.username);
-                    fflush(stdout);
-                    break;
-                }
-                case LOGOUT_RESPONSE: {
-                    if(receivedPacket.error == NOT_LOGGED_IN)
-                        printf("\n-- You are not logged in!\n");
-                    else
-                        printf("\n-- Goodbye, %s!\n", receivedPacket.user.username);
-                    fflush(stdout);
-                    break;
-                }
-                case SEND_MESSAGE_RESPONSE: {
-                    if(receivedPacket.error == NOT_LOGGED_IN)
-                        printf("\n-- You are not logged in!\n");
-                    else if(receivedPacket.error == INVALID_USER_DATA)
-                        printf("\n-- No such user!\n");
-                    else if(receivedPacket.error == INVALID_REPLY_ID)
-                    printf("\n-- Invalid reply message!\n");
-                    else if(receivedPacket.error == WRONG_VIEW)
-                    printf("\n-- Enter a conversation to send message!\n");
-                    else { /* nothing! good! */ }
-                    fflush(stdout);
-                    break;
-                }
-                case MESSAGE_NOTIFICATION: {
-                    printf("\n-- Message [%s] ----------- %s >>> %s (%s)\n%s\n\n", receivedPacket.message.id, receivedPacket.message.sender, receivedPacket.message.receiver, receivedPacket.message.timeStamp, receivedPacket.message.content);
-                    fflush(stdout);
-                    break;
-                }
-                case VIEW_ALL_CONVOS_RESPONSE: {
-                    if(receivedPacket.error == NOT_LOGGED_IN)
-                        printf("\n-- You are not logged in!\n");
-                    else
-                        printf("\n-- Convo: %s\n", receivedPacket.user.username);
-                    fflush(stdout);
-                    break;
-                }
-                case VIEW_CONVERSATION_RESPONSE: {
-                    if(receivedPacket.error == NOT_LOGGED_IN)
-                        printf("\n-- You are not logged in!\n");
-                    else if(receivedPacket.error == INVALID_USER_DATA)
-                        printf("\n-- Inexistent user!\n");
+            fflush(stdout);
+            break;
+        }
+        case LOGIN_RESPONSE: {
+            if(receivedPacket.error == NOT_LOGGED_OUT)
+                printf("\n-- You are already logged in!\n");
+            else if(receivedPacket.error == INVALID_USER_DATA)
+                printf("\n-- Username or password wrong!\n");
+            else if(receivedPacket.error == USER_ALREADY_CONNECTED)
+                printf("\n-- User is already connected on different device!\n");
+            else {
+                // a new session starts from the server's cursor, the pushed inbox's SYNC_END follows if there is one
+                pthread_mutex_lock(&inboxMutex);
+                strcpy(inboxCursor, "");
+                pthread_mutex_unlock(&inboxMutex);
+                pthread_mutex_lock(&historyMutex);
+                openCache(receivedPacket.user.username);
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
+                printf("\n-- Welcome, %s!\n", receivedPacket.user.username);
+                if (receivedPacket.count > 0)
+                    printf("-- You have %d unread messages\n", receivedPacket.count);
+            }
+            fflush(stdout);
+            break;
+        }
+        case LOGOUT_RESPONSE: {
+            if(receivedPacket.error == NOT_LOGGED_IN)
+                printf("\n-- You are not logged in!\n");
+            else {
+                pthread_mutex_lock(&historyMutex);
+                closeCache();
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
+                printf("\n-- Goodbye, %s!\n", receivedPacket.user.username);
+            }
+            fflush(stdout);
+            break;
+        }
+        case SEND_MESSAGE_RESPONSE: {
+            if(receivedPacket.error == NOT_LOGGED_IN)
+                printf("\n-- You are not logged in!\n");
+            else if(receivedPacket.error == INVALID_USER_DATA)
+                printf("\n-- No such user!\n");
+            else if(receivedPacket.error == INVALID_REPLY_ID)
+            printf("\n-- Invalid reply message!\n");
+            else if(receivedPacket.error == WRONG_VIEW)
+            printf("\n-- Enter a conversation to send message!\n");
+            else { /* nothing! good! */ }
+            fflush(stdout);
+            break;
+        }
+        case MESSAGE_NOTIFICATION: {
+            printf("\n-- Message [%s] ----------- %s >>> %s (%s)\n%s\n\n", receivedPacket.message.id, receivedPacket.message.sender, receivedPacket.message.receiver, receivedPacket.message.timeStamp, receivedPacket.message.content);
+            fflush(stdout);
+            // a message of the open conversation, once it is synced, is the next one to cache. before that
+            // it is held, the sync may have read the conversation before it was stored
+            pthread_mutex_lock(&historyMutex);
+            if (cache.open && cacheState != CACHE_IDLE && cacheState != CACHE_FAILED
+                && (strcmp(receivedPacket.message.sender, cacheUser) == 0 || strcmp(receivedPacket.message.receiver, cacheUser) == 0)) {
+                CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+                if (cacheState != CACHE_LIVE && cacheState != CACHE_PAGING) {
+                    if (heldCount < MAX_HELD)
+                        held[heldCount++] = receivedPacket;
                     else
-                        printf("\n-- Message [%s] ----------- %s >>> %s (%s)\n%s\n", receivedPacket.message.id, receivedPacket.message.sender, receivedPacket.message.receiver, receivedPacket.message.timeStamp, receivedPacket.message.content);
-                    fflush(stdout);
-                    break;
+                        heldOverflow = 1;
+                } else if (entry == NULL || atoll(receivedPacket.message.id) > entry->lastId)
+                    appendCached(cacheUser, &receivedPacket);
+            }
+            pthread_mutex_unlock(&historyMutex);
+            break;
+        }
+        case VIEW_ALL_CONVOS_RESPONSE: {
+            if(receivedPacket.error == NOT_LOGGED_IN)
+                printf("\n-- You are not logged in!\n");
+            else
+                printf("\n-- Convo: %s (%d unread) ----------- [%s] %s (%s)\n", receivedPacket.user.username, receivedPacket.count, receivedPacket.message.id, receivedPacket.message.content, receivedPacket.message.timeStamp);
+            fflush(stdout);
+            break;
+        }
+        case VIEW_CONVERSATION_RESPONSE: {
+            pthread_mutex_lock(&historyMutex);
+            if (receivedPacket.error != SUCCESS && cacheState == CACHE_OPENING)
+                cacheState = CACHE_FAILED;
+            else if (receivedPacket.error != SUCCESS && cacheState == CACHE_SEEDING)
+                cacheState = CACHE_IDLE; // no sync was asked for yet
+            else if (receivedPacket.error != SUCCESS && cacheState == CACHE_PAGING)
+                cacheState = CACHE_LIVE;
+            if(receivedPacket.error == NOT_LOGGED_IN)
+                printf("\n-- You are not logged in!\n");
+            else if(receivedPacket.error == INVALID_USER_DATA)
+                printf("\n-- Inexistent user!\n");
+            else if (cacheState == CACHE_SYNCING || cacheState == CACHE_SEEDING) {
+                // a page of the sync is cached now and shown once the last page is in, the latest page right away
+                CacheIndexEntry *entry = findCacheEntry(cacheUser, 0);
+                if (entry == NULL || atoll(receivedPacket.message.id) > entry->lastId)
+                    appendCached(cacheUser, &receivedPacket);
+                if (cacheState == CACHE_SEEDING)
+                    printHistoryMessage(receivedPacket);
+            }
+            else if (cacheState == CACHE_PAGING) {
+                printHistoryMessage(receivedPacket);
+                if (cache.open) {
+                    uint64_t offset = writeCached(&receivedPacket, pageLast);
+                    if (offset != CACHE_NONE) {
+                        if (pageFirst == CACHE_NONE)
+                            pageFirst = offset;
+                        pageLast = offset;
+                        pageCount++;
+                    }
                 }
-                default: {
-                    printf("\nFeedback: UNKNOWN!\n");
-                    fflush(stdout);
+            }
+            else if (cacheState != CACHE_OPENING) // the cache already showed it
+                printHistoryMessage(receivedPacket);
+            pthread_mutex_unlock(&historyMutex);
+            fflush(stdout);
+            break;
+        }
+        case VIEW_CONVERSATION_END: {
+            pthread_mutex_lock(&historyMutex);
+            if (cacheState == CACHE_OPENING) {
+                // in the conversation server side, its sync comes next
+                cacheState = CACHE_SYNCING;
+                pthread_mutex_unlock(&historyMutex);
+                break;
+            }
+            if (cacheState == CACHE_SEEDING) {
+                // the latest page is cached, the sync brings what came after it
+                CacheIndexEntry *entry = cache.open ? findCacheEntry(cacheUser, 1) : NULL;
+                if (entry == NULL) {
+                    cacheState = CACHE_IDLE;
+                } else {
+                    entry->complete = !receivedPacket.count;
+                    olderOffset = entry->firstOffset;
+                    shownUpTo = entry->lastId;
+                    cacheState = CACHE_SYNCING;
+                    char cursor[ID_LENGTH] = "";
+                    if (entry->count > 0)
+                        snprintf(cursor, sizeof(cursor), "%lld", (long long)entry->lastId);
+                    requestSync(cacheUser, cursor);
                 }
+            } else if (cacheState == CACHE_PAGING) {
+                if (cache.open)
+                    linkOlderPage(!receivedPacket.count);
+                cacheState = CACHE_LIVE;
+            }
+            strcpy(historyUser, receivedPacket.user.username);
+            strcpy(historyCursor, receivedPacket.message.id);
+            historyHasOlder = receivedPacket.count;
+            pthread_mutex_unlock(&historyMutex);
+            if (receivedPacket.count)
+                printf("\n-- Type 'older' to load earlier messages\n");
+            fflush(stdout);
+            break;
+        }
+        case SYNC_END: {
+            pthread_mutex_lock(&historyMutex);
+            if (receivedPacket.error != SUCCESS && cacheState == CACHE_FAILED) {
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
+                break;
+            }
+            if (receivedPacket.error == INVALID_USER_DATA && cacheState == CACHE_SYNCING) {
+                // the server does not know the cached cursor
+                CacheIndexEntry *entry = cache.open ? findCacheEntry(cacheUser, 0) : NULL;
+                if (entry != NULL)
+                    forgetCached(entry);
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
+                printf("\n-- The cached conversation is out of date, open it again\n");
+                fflush(stdout);
+                break;
+            }
+            if (receivedPacket.user.username[0] != '\0' && cacheState == CACHE_SYNCING && strcmp(receivedPacket.user.username, cacheUser) == 0)
+                finishSync(receivedPacket);
+            pthread_mutex_unlock(&historyMutex);
+            if (receivedPacket.error == NOT_LOGGED_IN)
+                printf("\n-- You are not logged in!\n");
+            else if (receivedPacket.error == INVALID_USER_DATA)
+                printf("\n-- Inexistent user!\n");
+            else if (receivedPacket.user.username[0] == '\0') {
+                pthread_mutex_lock(&inboxMutex);
+                strcpy(inboxCursor, receivedPacket.message.id);
+                pthread_mutex_unlock(&inboxMutex);
+                if (receivedPacket.count)
+                    printf("\n-- Type 'sync' to get more new messages\n");
+            }
+            fflush(stdout);
+            break;
+        }
+        default: {
+            printf("\nFeedback: UNKNOWN!\n");
+            fflush(stdout);
+        }
+    }
+}
+
+// reads exactly length bytes, returns 0 if the server went away first
+int receiveAll(int clientSocket, unsigned char *buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytesReceived = recv(clientSocket, buffer + total, length - total, 0);
+        if (bytesReceived <= 0)
+            return 0;
+        total += bytesReceived;
+    }
+    return 1;
+}
+
+// one response that is not a BULK_RESPONSE
+void handleResponse(Packet &receivedPacket) {
+    if (receivedPacket.error == SERVER_BUSY) {
+        finishRequest(receivedPacket);
+        printf("\n-- Server is busy, try again!\n");
+        fflush(stdout);
+    } else {
+        showPacket(receivedPacket);
+    }
+}
+
+// legacy format: one fixed-size LegacyPacket per response, lists included
+int receiveLegacy(int clientSocket) {
+    unsigned char receivedBuffer[sizeof(LegacyPacket)];
+    if (!receiveAll(clientSocket, receivedBuffer, sizeof(receivedBuffer)))
+        return 0;
+    Packet receivedPacket;
+    decodeLegacyPacket(receivedBuffer, &receivedPacket);
+    handleResponse(receivedPacket);
+    return 1;
+}
+
+// compact format: a frame, a BULK_RESPONSE frame carrying the records' frames in its body
+int receiveCompact(int clientSocket) {
+    unsigned char headerBuffer[MAX_FRAME_HEADER];
+    size_t headerRead = FRAME_PREFIX;
+    if (!receiveAll(clientSocket, headerBuffer, FRAME_PREFIX))
+        return 0;
+    FrameHeader header;
+    int headerLength;
+    // the length varint is read a byte at a time, it is at most 5 of them
+    while ((headerLength = parseFrameHeader(headerBuffer, headerRead, &header)) == 0) {
+        if (!receiveAll(clientSocket, headerBuffer + headerRead, 1))
+            return 0;
+        headerRead++;
+    }
+    if (headerLength < 0)
+        return -1;
+    unsigned char *body = (unsigned char *)malloc(header.length > 0 ? header.length : 1);
+    if (!receiveAll(clientSocket, body, header.length)) {
+        free(body);
+        return 0;
+    }
+    decode_vigenere_bytes(body, header.length);
+    int result = 1;
+    Packet receivedPacket;
+    if (header.type != BULK_RESPONSE) {
+        if (decodeCompactFrame(&header, body, &receivedPacket) == -1)
+            result = -1;
+        else
+            handleResponse(receivedPacket);
+    } else {
+        size_t offset = 0;
+        while (offset < header.length) {
+            FrameHeader recordHeader;
+            int recordHeaderLength = parseFrameHeader(body + offset, header.length - offset, &recordHeader);
+            if (recordHeaderLength <= 0 || offset + recordHeaderLength + recordHeader.length > header.length
+                || decodeCompactFrame(&recordHeader, body + offset + recordHeaderLength, &receivedPacket) == -1) {
+                result = -1;
+                break;
             }
-        } else if (bytesReceived <= 0) {
+            showPacket(receivedPacket);
+            offset += recordHeaderLength + recordHeader.length;
+        }
+    }
+    free(body);
+    return result;
+}
+
+void* receiveThread(void* arg) {
+    int clientSocket = *(int*)arg;
+    while (1) {
+        int result = legacyMode ? receiveLegacy(clientSocket) : receiveCompact(clientSocket);
+        if (result == 0) {
             printf("\nServer disconnected!\n");
             break;
         }
+        if (result == -1) {
+            printf("\nServer sent a malformed response!\n");
+            break;
+        }
     }
     pthread_exit(NULL);
 }
 
-void* userInputThread(void* arg) {
-    int clientSocket = *(int*)arg;
+// content is everything after the command, cut to what a message holds
+void joinWords(char *content, char **params, int first, int paramCount) {
+    size_t length = 0;
+    content[0] = '\0';
+    for (int i = first; i < paramCount; i++) {
+        int written = snprintf(content + length, MAX_CONTENT_LENGTH - length, i == first ? "%s" : " %s", params[i]);
+        if (written < 0 || length + written >= MAX_CONTENT_LENGTH)
+            break;
+        length += written;
+    }
+}
+
+void* userInputThread(void*) {
     while (1) {
-        char userInput[256];
+        char userInput[MAX_CONTENT_LENGTH + 64];
         fgets(userInput, sizeof(userInput), stdin);
         char* params[MAX_WORDS];
         int paramCount = 0;
@@ -117,6 +813,7 @@ void* userInputThread(void* arg) {
             token = strtok(NULL, " "); 
         }
         Packet P;
+        memset(&P, 0, sizeof(P));
         int okToSend = 1;
         if (paramCount > 0) {
             if (strcmp(params[0], "register") == 0) {
@@ -146,13 +843,7 @@ void* userInputThread(void* arg) {
                     okToSend = 0;
                 } else {
                     strcpy(P.message.replyId, "");
-                    strcpy(P.message.content, params[1]);
-
-                    for(int i=2;i<paramCount;i++)
-                    {
-                        strcat(P.message.content, " ");
-                        strcat(P.message.content, params[i]);
-                    }
+                    joinWords(P.message.content, params, 1, paramCount);
                 }
             } else if (strcmp(params[0], "reply") == 0) {
                 P.type = SEND_MESSAGE;
@@ -161,22 +852,122 @@ void* userInputThread(void* arg) {
                     okToSend = 0;
                 } else {
                     strcpy(P.message.replyId, params[1]);
-                    strcpy(P.message.content, params[2]);
-                    for(int i=3;i<paramCount;i++)
-                    {
-                        strcat(P.message.content, " ");
-                        strcat(P.message.content, params[i]);
+                    joinWords(P.message.content, params, 2, paramCount);
+                }
+            } else if (strcmp(params[0], "burst") == 0) {
+                // count messages at once, none of them waits for the answer to the one before
+                int count = paramCount < 3 ? 0 : atoi(params[1]);
+                if (count <= 0 || count > MAX_PENDING || legacyMode) {
+                    printf("-- Syntax: burst <count (1-%d)> <content>\n", MAX_PENDING);
+                } else {
+                    pthread_mutex_lock(&pendingMutex);
+                    burstTotal = count;
+                    burstSent = burstFailed = 0;
+                    clock_gettime(CLOCK_MONOTONIC, &burstStart);
+                    pthread_mutex_unlock(&pendingMutex);
+                    P.type = SEND_MESSAGE;
+                    char content[MAX_CONTENT_LENGTH];
+                    joinWords(content, params, 2, paramCount);
+                    for (int i = 0; i < count; i++) {
+                        snprintf(P.message.content, sizeof(P.message.content), "%.1000s #%d", content, i + 1);
+                        if (!sendRequest(&P, 1)) {
+                            // as many in flight as the client keeps track of, the rest are not sent
+                            pthread_mutex_lock(&pendingMutex);
+                            burstTotal = i;
+                            pthread_mutex_unlock(&pendingMutex);
+                            printf("-- Only %d messages could be sent at once\n", i);
+                            break;
+                        }
                     }
                 }
+                okToSend = 0;
             } else if (strcmp(params[0], "viewallconvos") == 0) {
                 P.type = VIEW_ALL_CONVOS;
+                pthread_mutex_lock(&historyMutex);
+                cacheState = CACHE_IDLE;
+                pthread_mutex_unlock(&historyMutex);
             } else if (strcmp(params[0], "viewconvo") == 0) {
                 P.type = VIEW_CONVERSATION;
                 if(paramCount < 2) {
                     printf("-- Syntax: viewconvo <username>\n");
                     okToSend = 0;
-                } else
+                } else {
+                    // latest page only, older ones on demand
                     strcpy(P.user.username, params[1]);
+                    P.count = HISTORY_PAGE;
+                    pthread_mutex_lock(&historyMutex);
+                    if (cache.open && strlen(params[1]) < USERNAME_LENGTH) {
+                        // the cached page right away, then only what the cache does not have yet: the server
+                        // enters the conversation with a page of one (which the cache skips) and syncs after the last id
+                        CacheIndexEntry *entry = findCacheEntry(params[1], 0);
+                        strcpy(cacheUser, params[1]);
+                        olderOffset = CACHE_NONE;
+                        heldCount = heldOverflow = 0;
+                        if (entry == NULL || entry->count == 0) {
+                            // nothing cached yet: the latest page as usual, cached as it comes
+                            cacheState = CACHE_SEEDING;
+                            historyHasOlder = 0;
+                        } else {
+                            cacheState = CACHE_OPENING;
+                            shownUpTo = entry->lastId;
+                            historyHasOlder = printCached(entry->lastOffset, HISTORY_PAGE, 0);
+                            if (historyHasOlder)
+                                printf("\n-- Type 'older' to load earlier messages\n");
+                            fflush(stdout);
+                            P.count = 1;
+                            sendRequest(&P);
+                            char cursor[ID_LENGTH];
+                            snprintf(cursor, sizeof(cursor), "%lld", (long long)entry->lastId);
+                            requestSync(params[1], cursor);
+                            okToSend = 0;
+                        }
+                    }
+                    pthread_mutex_unlock(&historyMutex);
+                }
+            } else if (strcmp(params[0], "older") == 0) {
+                P.type = VIEW_CONVERSATION;
+                pthread_mutex_lock(&historyMutex);
+                uint64_t previous = cacheState != CACHE_IDLE && cacheState != CACHE_FAILED && historyHasOlder
+                    ? cachedBefore(findCacheEntry(cacheUser, 0), olderOffset) : CACHE_NONE;
+                if (cacheState == CACHE_LIVE && historyHasOlder && previous == CACHE_NONE) {
+                    // past the oldest cached message: the server's page before it, cached in front as it comes
+                    strcpy(P.user.username, cacheUser);
+                    snprintf(P.message.id, sizeof(P.message.id), "%lld", (long long)((CacheRecord *)(cache.data.data + olderOffset))->id);
+                    P.count = HISTORY_PAGE;
+                    pageFirst = pageLast = CACHE_NONE;
+                    pageCount = 0;
+                    cacheState = CACHE_PAGING;
+                    historyHasOlder = 0; // until this page's end arrives
+                } else if (historyHasOlder && previous == CACHE_NONE && cacheState != CACHE_IDLE && cacheState != CACHE_FAILED) {
+                    printf("-- Still loading the conversation, try again in a moment\n");
+                    okToSend = 0;
+                } else if (cacheState != CACHE_IDLE && cacheState != CACHE_FAILED) {
+                    // the rest from the cache
+                    if (!historyHasOlder) {
+                        printf("-- No older messages!\n");
+                    } else {
+                        historyHasOlder = printCached(previous, HISTORY_PAGE, 0);
+                        if (historyHasOlder)
+                            printf("\n-- Type 'older' to load earlier messages\n");
+                        fflush(stdout);
+                    }
+                    okToSend = 0;
+                } else if (!historyHasOlder) {
+                    printf("-- No older messages!\n");
+                    okToSend = 0;
+                } else {
+                    strcpy(P.user.username, historyUser);
+                    strcpy(P.message.id, historyCursor);
+                    P.count = HISTORY_PAGE;
+                    historyHasOlder = 0; // until this page's end arrives
+                }
+                pthread_mutex_unlock(&historyMutex);
+            } else if (strcmp(params[0], "sync") == 0) {
+                // the inbox from where the last one stopped (the server's own cursor before the first)
+                P.type = SYNC;
+                pthread_mutex_lock(&inboxMutex);
+                strcpy(P.message.id, inboxCursor);
+                pthread_mutex_unlock(&inboxMutex);
             } else if (strcmp(params[0], "exit") == 0) {
                 printf("disconnecting...\n");
                 fflush(stdout);
@@ -186,8 +977,11 @@ void* userInputThread(void* arg) {
                 printf("register <user> <pass> - create a new account\n");
                 printf("viewallconvos - see all your past conversations\n");
                 printf("viewconvo <user> - enter conversation with [user]\n");
+                printf("older - load earlier messages of the current conversation\n");
                 printf("send <message> - send message to the user of the current conversation\n");
                 printf("reply <id> <message> - reply to a specific message\n");
+                printf("sync - get the messages that arrived since the last ones you got\n");
+                printf("burst <count> <message> - send count copies of a message without waiting for each answer\n");
                 printf("exit - close the app\n");
                 okToSend = 0;
             } else {
@@ -196,23 +990,19 @@ void* userInputThread(void* arg) {
                 okToSend = 0;
             }
         }
-        if(okToSend)
-        {
-            unsigned char buffer[sizeof(Packet)];
-            encode_vigenere_packet(&P, vigenere_key);
-            serializePacket(&P, buffer, sizeof(buffer));
-            send(clientSocket, buffer, sizeof(buffer), 0);
-        }
+        if(okToSend && !sendRequest(&P))
+            printf("-- Too many requests waiting for an answer, try again!\n");
     }
     pthread_exit(NULL);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3)
+    if (argc != 3 && !(argc == 4 && strcmp(argv[3], "legacy") == 0))
     {
-        printf("Syntax: %s <adress> <port>\n", argv[0]);
+        printf("Syntax: %s <adress> <port> [legacy]\n", argv[0]);
         return -1;
     }
+    legacyMode = argc == 4;
     int port = port = atoi(argv[2]);
     int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in serverAddress;
@@ -226,6 +1016,7 @@ int main(int argc, char *argv[]) {
         exit(2);
     }
 
+    serverSocket = clientSocket;
     pthread_t receiveThreadId, userInputThreadId;
     pthread_create(&receiveThreadId, NULL, receiveThread, (void*)&clientSocket);
     pthread_create(&userInputThreadId, NULL, userInputThread, (void*)&clientSocket);
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <sqlite3.h>
+#include "schema.h"
 
 int main() {
     sqlite3* db;
@@ -15,46 +16,36 @@ int main() {
 
     std::cout << "database 'database.db' opened successfully." << std::endl;
 
-    // Execute SQL commands to create tables
-    const char* createUsersTable = "CREATE TABLE Users ("
-                                "    username VARCHAR PRIMARY KEY,"
-                                "    password VARCHAR NOT NULL"
-                                ");";
-
-    const char* createMessagesTable = "CREATE TABLE Messages ("
-                                        "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                                        "    sender VARCHAR NOT NULL,"
-                                        "    receiver VARCHAR NOT NULL,"
-                                        "    content VARCHAR NOT NULL,"
-                                        "    timeStamp DATETIME NOT NULL,"
-                                        "    replyId INTEGER,"
-                                        "    isDeleted BOOLEAN NOT NULL,"
-                                        "    FOREIGN KEY (sender) REFERENCES Users(username),"
-                                        "    FOREIGN KEY (receiver) REFERENCES Users(username),"
-                                        "    FOREIGN KEY (replyId) REFERENCES Messages(id)"
-                                        ");";
-
-
-    // USERS
-    rc = sqlite3_exec(db, createUsersTable, nullptr, nullptr, &errorMessage);
-    if (rc != SQLITE_OK) {
-        std::cerr << "error creating Users table: " << errorMessage << std::endl;
-        sqlite3_free(errorMessage);
-        sqlite3_close(db);
-        return rc;
+    // Execute SQL commands to create tables (see schema.h)
+    const char* statements[] = {
+        createUsersTable,
+        createConversationsTable,
+        createMessagesTable,
+        createConversationsIndex,
+        createMessagesIndex,
+        createMessagesTrigger,
+        createSummariesTable,
+        createSummariesIndex,
+        createSummariesTrigger,
+        createSummariesUnreadIndex,
+        createMessagesReceiverIndex,
+        createInboxesTable
+    };
+
+    for (const char* statement : statements) {
+        rc = sqlite3_exec(db, statement, nullptr, nullptr, &errorMessage);
+        if (rc != SQLITE_OK) {
+            std::cerr << "error creating tables: " << errorMessage << std::endl;
+            sqlite3_free(errorMessage);
+            sqlite3_close(db);
+            return rc;
+        }
     }
 
+    std::string setVersion = "PRAGMA user_version = " + std::to_string(SCHEMA_VERSION) + ";";
+    sqlite3_exec(db, setVersion.c_str(), nullptr, nullptr, nullptr);
 
-    // MESSAGES
-    rc = sqlite3_exec(db, createMessagesTable, nullptr, nullptr, &errorMessage);
-    if (rc != SQLITE_OK) {
-        std::cerr << "error creating Messages table: " << errorMessage << std::endl;
-        sqlite3_free(errorMessage);
-        sqlite3_close(db);
-        return rc;
-    }
-
-    std::cout << "tables created successfully." << std::endl;
+    std::cout << "tables created successfully (schema version " << SCHEMA_VERSION << ")." << std::endl;
 
     sqlite3_close(db);
 
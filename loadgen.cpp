@@ -0,0 +1,747 @@
+#include "structures.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+
+// LOAD GENERATOR
+// g++ -O2 -o loadgen loadgen.cpp -lpthread && ./loadgen -u 2000 -r 5000 -d 30 -j result.json
+//
+// every simulated user has its own connection and account: it registers, opens a conversation with another
+// user and then, for the length of the run, gets requests at random from an open-loop arrival process
+// (a Poisson process at the total rate, spread over the users): a request is due at its arrival time whether
+// or not the server kept up, and its latency runs from that time to the answer. a user sends one request at a
+// time, so the ones that arrive while it waits queue up, and that wait is part of their latency too
+
+#define DEFAULT_PORT 2024
+#define DEFAULT_USERS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_RATE 1000.0 // requests per second, over all users
+#define DEFAULT_DURATION 10.0 // seconds
+#define DEFAULT_MIX "send=70,view=15,viewall=10,login=4,register=1"
+#define DRAIN_SECONDS 5.0 // after the run, how long requests still in flight are waited for
+#define USER_BACKLOG 64 // requests queued at one user while it waits, more are dropped (and counted)
+#define HISTORY_PAGE 20
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+
+// latency histogram: 32 linear sub-buckets per power of two of microseconds, so any value is within ~3%
+#define SUB_BUCKET_BITS 5
+#define HISTOGRAM_BUCKETS (64 << SUB_BUCKET_BITS)
+
+enum Operation {
+    OP_REGISTER,
+    OP_LOGIN,
+    OP_SEND,
+    OP_VIEW,
+    OP_VIEW_ALL,
+    OP_COUNT,
+    // before the run, not measured: every user registers, then (once all of them exist) opens its conversation
+    OP_SETUP = OP_COUNT,
+    OP_OPEN
+};
+
+const char *operationNames[] = {"register", "login", "send", "view", "viewall"};
+const PacketType operationTypes[] = {REGISTER, LOGIN, SEND_MESSAGE, VIEW_CONVERSATION, VIEW_ALL_CONVOS};
+const char *packetTypeNames[] = {"REGISTER", "LOGIN", "SEND_MESSAGE", "VIEW_CONVERSATION", "VIEW_ALL_CONVOS"};
+
+struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t errors;
+    double sum; // microseconds
+    uint64_t max;
+};
+
+struct Arrival {
+    double due; // seconds since the start of the run
+    Operation operation;
+};
+
+struct SimUser {
+    int sd;
+    int index;
+    char username[USERNAME_LENGTH];
+    char peer[USERNAME_LENGTH]; // the setup account of another user, never renamed
+    int viewing; // in the conversation with peer, so SEND_MESSAGE is accepted
+    int registrations;
+    // the request in flight: what answer ends it
+    int busy;
+    Arrival current;
+    PacketType expected;
+    int failed;
+    Arrival backlog[USER_BACKLOG];
+    int backlogHead;
+    int backlogCount;
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> output; // what the socket did not take yet
+};
+
+struct LoadThread {
+    int index;
+    pthread_t thread;
+    int epollFd;
+    std::vector<SimUser *> users;
+    int settingUp; // users still in setup
+    double rate; // this thread's share of the arrivals
+    unsigned int seed;
+    Histogram histograms[OP_COUNT];
+    uint64_t dropped;
+    uint64_t unanswered;
+    uint64_t notifications;
+};
+
+enum Phase {
+    PHASE_SETUP,
+    PHASE_OPEN,
+    PHASE_RUN,
+    PHASE_DRAIN,
+    PHASE_DONE
+};
+
+const char *host = "127.0.0.1";
+int port = DEFAULT_PORT;
+int userCount = DEFAULT_USERS;
+int threadCount = DEFAULT_THREADS;
+double rate = DEFAULT_RATE;
+double duration = DEFAULT_DURATION;
+double warmup = 0;
+int mixWeights[OP_COUNT];
+int mixTotal;
+unsigned int runTag; // keeps the accounts of two runs against the same database apart
+std::atomic<int> readyThreads(0);
+std::atomic<int> phase(PHASE_SETUP);
+struct timespec runStart;
+
+double secondsSince(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int bucketOf(uint64_t value)
+{
+    if (value < (1u << SUB_BUCKET_BITS))
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * (1 << SUB_BUCKET_BITS) + (int)((value >> shift) - (1u << SUB_BUCKET_BITS));
+}
+
+// the highest value that lands in the bucket
+uint64_t bucketValue(int bucket)
+{
+    if (bucket < (1 << SUB_BUCKET_BITS))
+        return bucket;
+    int shift = bucket / (1 << SUB_BUCKET_BITS) - 1;
+    uint64_t sub = bucket % (1 << SUB_BUCKET_BITS) + (1u << SUB_BUCKET_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void recordLatency(Histogram *histogram, uint64_t micros, int failed)
+{
+    histogram->counts[bucketOf(micros)]++;
+    histogram->total++;
+    histogram->sum += micros;
+    if (micros > histogram->max)
+        histogram->max = micros;
+    if (failed)
+        histogram->errors++;
+}
+
+void mergeHistogram(Histogram *into, const Histogram *from)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->errors += from->errors;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+// milliseconds
+double percentile(const Histogram *histogram, double fraction)
+{
+    if (histogram->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(fraction * histogram->total);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+            return (bucketValue(i) < histogram->max ? bucketValue(i) : histogram->max) / 1000.0;
+    }
+    return histogram->max / 1000.0;
+}
+
+// "send=70,view=15,..." into mixWeights, -1 if it names something else
+int parseMix(const char *text)
+{
+    memset(mixWeights, 0, sizeof(mixWeights));
+    mixTotal = 0;
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *equals = strchr(item, '=');
+        if (equals == NULL)
+            return -1;
+        *equals = '\0';
+        int operation;
+        for (operation = 0; operation < OP_COUNT; operation++)
+            if (strcmp(item, operationNames[operation]) == 0)
+                break;
+        if (operation == OP_COUNT || atoi(equals + 1) < 0)
+            return -1;
+        mixWeights[operation] = atoi(equals + 1);
+        mixTotal += mixWeights[operation];
+    }
+    return mixTotal > 0 ? 0 : -1;
+}
+
+Operation pickOperation(unsigned int *seed)
+{
+    int value = rand_r(seed) % mixTotal;
+    for (int operation = 0; operation < OP_COUNT; operation++)
+    {
+        if (value < mixWeights[operation])
+            return (Operation)operation;
+        value -= mixWeights[operation];
+    }
+    return OP_SEND;
+}
+
+void setupName(int index, char *username)
+{
+    snprintf(username, USERNAME_LENGTH, "lg%04x_%d", runTag & 0xffff, index);
+}
+
+void updateInterest(LoadThread *thread, SimUser *user)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | (user->output.empty() ? 0 : (uint32_t)EPOLLOUT);
+    event.data.ptr = user;
+    epoll_ctl(thread->epollFd, EPOLL_CTL_MOD, user->sd, &event);
+}
+
+void flushUser(LoadThread *thread, SimUser *user)
+{
+    size_t offset = 0;
+    while (offset < user->output.size())
+    {
+        ssize_t sent = send(user->sd, user->output.data() + offset, user->output.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0)
+            break;
+        offset += sent;
+    }
+    int waiting = !user->output.empty();
+    user->output.erase(user->output.begin(), user->output.begin() + offset);
+    if (waiting != !user->output.empty() || !user->output.empty())
+        updateInterest(thread, user);
+}
+
+void sendRequest(LoadThread *thread, SimUser *user, Packet *packet)
+{
+    unsigned char buffer[sizeof(Packet) + MAX_FRAME_HEADER];
+    size_t length = encodeCompactFrame(packet, buffer, 1);
+    user->output.insert(user->output.end(), buffer, buffer + length);
+    flushUser(thread, user);
+}
+
+Packet request(PacketType type)
+{
+    Packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.type = type;
+    return packet;
+}
+
+void sendViewConversation(LoadThread *thread, SimUser *user, int pageSize)
+{
+    Packet packet = request(VIEW_CONVERSATION);
+    strcpy(packet.user.username, user->peer);
+    packet.count = pageSize;
+    sendRequest(thread, user, &packet);
+}
+
+// sends what the operation needs and sets the answer that ends it
+void startOperation(LoadThread *thread, SimUser *user, Arrival arrival)
+{
+    user->busy = 1;
+    user->current = arrival;
+    user->failed = 0;
+    switch (arrival.operation)
+    {
+        case OP_SETUP: {
+            Packet packet = request(REGISTER);
+            strcpy(packet.user.username, user->username);
+            strcpy(packet.user.password, "pw");
+            sendRequest(thread, user, &packet);
+            user->expected = REGISTER_RESPONSE;
+            break;
+        }
+        case OP_OPEN: {
+            sendViewConversation(thread, user, 1);
+            user->viewing = 1;
+            user->expected = VIEW_CONVERSATION_END;
+            break;
+        }
+        case OP_REGISTER: {
+            // a new account each time, the connection is logged in as it afterwards
+            Packet packet = request(REGISTER);
+            snprintf(packet.user.username, USERNAME_LENGTH, "lg%04x_%d_%d", runTag & 0xffff, user->index, ++user->registrations);
+            strcpy(packet.user.password, "pw");
+            strcpy(user->username, packet.user.username);
+            sendRequest(thread, user, &packet);
+            user->viewing = 0;
+            user->expected = REGISTER_RESPONSE;
+            break;
+        }
+        case OP_LOGIN: {
+            // the user is logged in, logging in again needs a logout first (which does not touch the database)
+            Packet logout = request(LOGOUT);
+            sendRequest(thread, user, &logout);
+            Packet packet = request(LOGIN);
+            strcpy(packet.user.username, user->username);
+            strcpy(packet.user.password, "pw");
+            sendRequest(thread, user, &packet);
+            user->viewing = 0;
+            user->expected = LOGIN_RESPONSE;
+            break;
+        }
+        case OP_SEND: {
+            if (!user->viewing)
+            {
+                sendViewConversation(thread, user, 1);
+                user->viewing = 1;
+            }
+            Packet packet = request(SEND_MESSAGE);
+            snprintf(packet.message.content, sizeof(packet.message.content), "load %d %.3f", user->index, arrival.due);
+            sendRequest(thread, user, &packet);
+            user->expected = SEND_MESSAGE_RESPONSE;
+            break;
+        }
+        case OP_VIEW: {
+            sendViewConversation(thread, user, HISTORY_PAGE);
+            user->viewing = 1;
+            user->expected = VIEW_CONVERSATION_END;
+            break;
+        }
+        case OP_VIEW_ALL: {
+            // the list has no end marker (and no rows at all for a user without conversations): the EMPTY
+            // packet after it is answered right after the list, since the connection handles requests in order
+            Packet packet = request(VIEW_ALL_CONVOS);
+            sendRequest(thread, user, &packet);
+            Packet marker = request(EMPTY);
+            sendRequest(thread, user, &marker);
+            user->viewing = 0;
+            user->expected = EMPTY;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void finishOperation(LoadThread *thread, SimUser *user)
+{
+    user->busy = 0;
+    if (user->current.operation >= OP_COUNT)
+    {
+        if (user->failed)
+        {
+            fprintf(stderr, "loadgen: setting up user %s failed (%s)\n", user->username, user->current.operation == OP_SETUP ? "register" : "open");
+            exit(1);
+        }
+        if (--thread->settingUp == 0)
+            readyThreads++;
+    }
+    else if (user->current.due >= warmup && user->current.due < duration)
+    {
+        double now = secondsSince(&runStart);
+        uint64_t micros = now > user->current.due ? (uint64_t)((now - user->current.due) * 1e6) : 0;
+        recordLatency(&thread->histograms[user->current.operation], micros, user->failed);
+    }
+    if (user->backlogCount > 0)
+    {
+        Arrival next = user->backlog[user->backlogHead];
+        user->backlogHead = (user->backlogHead + 1) % USER_BACKLOG;
+        user->backlogCount--;
+        startOperation(thread, user, next);
+    }
+}
+
+void handleResponse(LoadThread *thread, SimUser *user, const Packet *packet)
+{
+    if (packet->type == MESSAGE_NOTIFICATION && packet->error == SUCCESS && strcmp(packet->message.sender, user->username) != 0)
+    {
+        thread->notifications++;
+        return;
+    }
+    if (!user->busy)
+        return;
+    if (packet->error != SUCCESS)
+        user->failed = 1;
+    // a refused VIEW_CONVERSATION has no VIEW_CONVERSATION_END
+    int refusedView = user->expected == VIEW_CONVERSATION_END && packet->type == VIEW_CONVERSATION_RESPONSE && packet->error != SUCCESS;
+    if (packet->type == user->expected || refusedView)
+        finishOperation(thread, user);
+}
+
+// frames are taken out of user->input as they complete, BULK_RESPONSE records one by one
+int readUser(LoadThread *thread, SimUser *user)
+{
+    unsigned char chunk[READ_CHUNK];
+    while (1)
+    {
+        ssize_t received = recv(user->sd, chunk, sizeof(chunk), 0);
+        if (received == 0)
+            return -1;
+        if (received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        user->input.insert(user->input.end(), chunk, chunk + received);
+    }
+    size_t offset = 0;
+    while (offset < user->input.size())
+    {
+        FrameHeader header;
+        int headerLength = parseFrameHeader(user->input.data() + offset, user->input.size() - offset, &header);
+        if (headerLength < 0)
+            return -1;
+        if (headerLength == 0 || user->input.size() - offset < headerLength + header.length)
+            break;
+        unsigned char *body = user->input.data() + offset + headerLength;
+        decode_vigenere_bytes(body, header.length);
+        Packet packet;
+        if (header.type != BULK_RESPONSE)
+        {
+            if (decodeCompactFrame(&header, body, &packet) == -1)
+                return -1;
+            handleResponse(thread, user, &packet);
+        }
+        else
+        {
+            size_t recordOffset = 0;
+            while (recordOffset < header.length)
+            {
+                FrameHeader recordHeader;
+                int recordHeaderLength = parseFrameHeader(body + recordOffset, header.length - recordOffset, &recordHeader);
+                if (recordHeaderLength <= 0 || recordOffset + recordHeaderLength + recordHeader.length > header.length
+                    || decodeCompactFrame(&recordHeader, body + recordOffset + recordHeaderLength, &packet) == -1)
+                    return -1;
+                handleResponse(thread, user, &packet);
+                recordOffset += recordHeaderLength + recordHeader.length;
+            }
+        }
+        offset += headerLength + header.length;
+    }
+    user->input.erase(user->input.begin(), user->input.begin() + offset);
+    return 0;
+}
+
+int connectUser(LoadThread *thread, SimUser *user)
+{
+    user->sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(host);
+    address.sin_port = htons(port);
+    if (user->sd == -1 || connect(user->sd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        return -1;
+    int one = 1;
+    setsockopt(user->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(user->sd, F_SETFL, fcntl(user->sd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = user;
+    return epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, user->sd, &event);
+}
+
+void *loadThreadLoop(void *args)
+{
+    LoadThread *thread = (LoadThread *)args;
+    thread->settingUp = thread->users.size();
+    for (SimUser *user : thread->users)
+    {
+        if (connectUser(thread, user) == -1)
+        {
+            fprintf(stderr, "loadgen: cannot connect user %d to %s:%d: %s\n", user->index, host, port, strerror(errno));
+            exit(1);
+        }
+        Arrival setup = {0, OP_SETUP};
+        startOperation(thread, user, setup);
+    }
+    if (thread->settingUp == 0)
+        readyThreads++;
+
+    int opened = 0;
+    double nextArrival = -1;
+    struct epoll_event events[MAX_EVENTS];
+    while (phase.load() != PHASE_DONE)
+    {
+        int timeoutMs = 1;
+        if (phase.load() == PHASE_OPEN && !opened)
+        {
+            opened = 1;
+            thread->settingUp = thread->users.size();
+            for (SimUser *user : thread->users)
+            {
+                Arrival open = {0, OP_OPEN};
+                startOperation(thread, user, open);
+            }
+        }
+        if (phase.load() == PHASE_RUN)
+        {
+            if (nextArrival < 0)
+                nextArrival = -log(1.0 - rand_r(&thread->seed) / (RAND_MAX + 1.0)) / thread->rate;
+            double now = secondsSince(&runStart);
+            // every arrival that is due goes to a random user, now or after what it is doing
+            while (nextArrival <= now && nextArrival < duration)
+            {
+                SimUser *user = thread->users[rand_r(&thread->seed) % thread->users.size()];
+                Arrival arrival = {nextArrival, pickOperation(&thread->seed)};
+                if (!user->busy)
+                    startOperation(thread, user, arrival);
+                else if (user->backlogCount < USER_BACKLOG)
+                    user->backlog[(user->backlogHead + user->backlogCount++) % USER_BACKLOG] = arrival;
+                else
+                    thread->dropped++;
+                nextArrival += -log(1.0 - rand_r(&thread->seed) / (RAND_MAX + 1.0)) / thread->rate;
+            }
+            timeoutMs = nextArrival > now ? (int)((nextArrival - now) * 1000) : 0;
+        }
+        int ready = epoll_wait(thread->epollFd, events, MAX_EVENTS, timeoutMs);
+        for (int i = 0; i < ready; i++)
+        {
+            SimUser *user = (SimUser *)events[i].data.ptr;
+            if (user->sd == -1)
+                continue;
+            if (events[i].events & EPOLLOUT)
+                flushUser(thread, user);
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && readUser(thread, user) == -1)
+            {
+                fprintf(stderr, "loadgen: the server closed user %d's connection\n", user->index);
+                epoll_ctl(thread->epollFd, EPOLL_CTL_DEL, user->sd, NULL);
+                close(user->sd);
+                user->sd = -1;
+            }
+        }
+    }
+    for (SimUser *user : thread->users)
+    {
+        if (user->busy && user->sd != -1)
+            thread->unanswered += 1 + user->backlogCount;
+        if (user->sd != -1)
+            close(user->sd);
+    }
+    return NULL;
+}
+
+int allIdle(std::vector<LoadThread> &threads)
+{
+    for (LoadThread &thread : threads)
+        for (SimUser *user : thread.users)
+            if (user->sd != -1 && (user->busy || user->backlogCount > 0))
+                return 0;
+    return 1;
+}
+
+void printReport(Histogram *histograms, double measured, uint64_t dropped, uint64_t unanswered, uint64_t notifications)
+{
+    printf("loadgen: %d users on %d threads, %.0f requests/s for %.0f s (%.0f s warmup) against %s:%d\n",
+           userCount, threadCount, rate, duration, warmup, host, port);
+    printf("%-18s %9s %7s %10s %9s %9s %9s %9s %9s\n", "type", "count", "errors", "req/s", "mean ms", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int operation = 0; operation < OP_COUNT; operation++)
+    {
+        Histogram *histogram = &histograms[operation];
+        if (histogram->total == 0)
+            continue;
+        printf("%-18s %9llu %7llu %10.1f %9.2f %9.2f %9.2f %9.2f %9.2f\n", packetTypeNames[operation],
+               (unsigned long long)histogram->total, (unsigned long long)histogram->errors, histogram->total / measured,
+               histogram->sum / histogram->total / 1000.0, percentile(histogram, 0.5), percentile(histogram, 0.99),
+               percentile(histogram, 0.999), histogram->max / 1000.0);
+    }
+    printf("dropped (user backlog full): %llu, unanswered at the end: %llu, notifications received: %llu\n",
+           (unsigned long long)dropped, (unsigned long long)unanswered, (unsigned long long)notifications);
+}
+
+int writeJson(const char *path, Histogram *histograms, double measured, uint64_t dropped, uint64_t unanswered, uint64_t notifications)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    fprintf(file, "{\n  \"host\": \"%s\",\n  \"port\": %d,\n  \"users\": %d,\n  \"threads\": %d,\n", host, port, userCount, threadCount);
+    fprintf(file, "  \"rate\": %.1f,\n  \"duration_s\": %.1f,\n  \"warmup_s\": %.1f,\n", rate, duration, warmup);
+    fprintf(file, "  \"dropped\": %llu,\n  \"unanswered\": %llu,\n  \"notifications\": %llu,\n  \"types\": {",
+            (unsigned long long)dropped, (unsigned long long)unanswered, (unsigned long long)notifications);
+    int first = 1;
+    for (int operation = 0; operation < OP_COUNT; operation++)
+    {
+        Histogram *histogram = &histograms[operation];
+        if (histogram->total == 0)
+            continue;
+        fprintf(file, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, \"throughput\": %.1f, \"mean_ms\": %.3f, "
+                      "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}",
+                first ? "" : ",", packetTypeNames[operation], (unsigned long long)histogram->total,
+                (unsigned long long)histogram->errors, histogram->total / measured, histogram->sum / histogram->total / 1000.0,
+                percentile(histogram, 0.5), percentile(histogram, 0.99), percentile(histogram, 0.999), histogram->max / 1000.0);
+        first = 0;
+    }
+    fprintf(file, "\n  }\n}\n");
+    if (file != stdout)
+        fclose(file);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mix = DEFAULT_MIX;
+    const char *jsonPath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "h:p:u:t:r:d:w:x:j:")) != -1)
+    {
+        switch (option)
+        {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'u':
+                userCount = atoi(optarg);
+                break;
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'x':
+                mix = optarg;
+                break;
+            case 'j':
+                jsonPath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Syntax: %s [-h host] [-p port] [-u users] [-t threads] [-r requests_per_second] [-d seconds] [-w warmup_seconds]\n"
+                                "       [-x mix, default %s] [-j json_file, - for stdout]\n", argv[0], DEFAULT_MIX);
+                return EXIT_FAILURE;
+        }
+    }
+    if (parseMix(mix) == -1)
+    {
+        fprintf(stderr, "mix is a list of register, login, send, view and viewall with weights, like %s\n", DEFAULT_MIX);
+        return EXIT_FAILURE;
+    }
+    if (userCount < 2 || threadCount < 1 || rate <= 0 || duration <= 0 || warmup < 0 || warmup >= duration)
+    {
+        fprintf(stderr, "needs at least 2 users, 1 thread, a positive rate and a warmup shorter than the run\n");
+        return EXIT_FAILURE;
+    }
+    if (threadCount > userCount)
+        threadCount = userCount;
+    signal(SIGPIPE, SIG_IGN);
+    // a connection per user
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    runTag = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 8);
+
+    std::vector<SimUser> users(userCount);
+    std::vector<LoadThread> threads(threadCount);
+    for (int i = 0; i < threadCount; i++)
+    {
+        threads[i].index = i;
+        threads[i].epollFd = epoll_create1(0);
+        threads[i].rate = rate / threadCount;
+        threads[i].seed = runTag + i;
+        memset(threads[i].histograms, 0, sizeof(threads[i].histograms));
+        threads[i].dropped = threads[i].unanswered = threads[i].notifications = 0;
+    }
+    unsigned int peerSeed = runTag;
+    for (int i = 0; i < userCount; i++)
+    {
+        SimUser &user = users[i];
+        user.sd = -1;
+        user.index = i;
+        setupName(i, user.username);
+        setupName((i + 1 + rand_r(&peerSeed) % (userCount - 1)) % userCount, user.peer);
+        user.viewing = user.registrations = user.busy = 0;
+        user.backlogHead = user.backlogCount = 0;
+        threads[i % threadCount].users.push_back(&user);
+    }
+
+    printf("loadgen: registering %d users...\n", userCount);
+    fflush(stdout);
+    for (LoadThread &thread : threads)
+        pthread_create(&thread.thread, NULL, loadThreadLoop, &thread);
+    while (readyThreads.load() < threadCount)
+        usleep(10000);
+    phase.store(PHASE_OPEN);
+    while (readyThreads.load() < 2 * threadCount)
+        usleep(10000);
+
+    clock_gettime(CLOCK_MONOTONIC, &runStart);
+    phase.store(PHASE_RUN);
+    usleep((useconds_t)(duration * 1e6));
+    phase.store(PHASE_DRAIN);
+    struct timespec drainStart;
+    clock_gettime(CLOCK_MONOTONIC, &drainStart);
+    // the users are only read here, a late answer just makes this wait one more round
+    while (!allIdle(threads) && secondsSince(&drainStart) < DRAIN_SECONDS)
+        usleep(10000);
+    phase.store(PHASE_DONE);
+
+    Histogram *histograms = (Histogram *)calloc(OP_COUNT, sizeof(Histogram));
+    uint64_t dropped = 0, unanswered = 0, notifications = 0;
+    for (LoadThread &thread : threads)
+    {
+        pthread_join(thread.thread, NULL);
+        for (int operation = 0; operation < OP_COUNT; operation++)
+            mergeHistogram(&histograms[operation], &thread.histograms[operation]);
+        dropped += thread.dropped;
+        unanswered += thread.unanswered;
+        notifications += thread.notifications;
+    }
+    double measured = duration - warmup;
+    printReport(histograms, measured, dropped, unanswered, notifications);
+    if (jsonPath != NULL && writeJson(jsonPath, histograms, measured, dropped, unanswered, notifications) == -1)
+    {
+        fprintf(stderr, "loadgen: cannot write %s\n", jsonPath);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
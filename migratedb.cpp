@@ -0,0 +1,256 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "schema.h"
+
+// upgrades database.db to SCHEMA_VERSION in place, while a server may still be serving it:
+// every step runs in short transactions so the server only ever waits for one batch
+
+#define DEFAULT_BATCH_SIZE 5000
+#define BATCH_PAUSE_US 10000 // gives the server's writers a chance between two batches
+
+int execute(sqlite3* db, const char* statement) {
+    char* errorMessage = nullptr;
+    int rc = sqlite3_exec(db, statement, nullptr, nullptr, &errorMessage);
+    if (rc != SQLITE_OK) {
+        std::cerr << "error: " << errorMessage << std::endl << "while running: " << statement << std::endl;
+        sqlite3_free(errorMessage);
+    }
+    return rc;
+}
+
+int hasColumn(sqlite3* db, const char* table, const char* column) {
+    std::string query = std::string("SELECT COUNT(*) FROM pragma_table_info('") + table + "') WHERE name = ?;";
+    sqlite3_stmt* stmt;
+    int found = 0;
+    if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, column, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            found = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return found;
+}
+
+int setVersion(sqlite3* db, int version) {
+    std::string statement = "PRAGMA user_version = " + std::to_string(version) + ";";
+    return execute(db, statement.c_str());
+}
+
+// VERSION 1 -> 2: Conversations table, Messages.conversationId / createdAt and the (conversationId, createdAt, id) index
+int migrateToVersion2(sqlite3* db, int batchSize) {
+    // 1. new columns and the trigger together, so from here on every insert (old server included) is filled in
+    if (execute(db, "BEGIN IMMEDIATE;") != SQLITE_OK)
+        return -1;
+    int rc = execute(db, createConversationsTable);
+    if (rc == SQLITE_OK)
+        rc = execute(db, createConversationsIndex);
+    if (rc == SQLITE_OK && !hasColumn(db, "Messages", "conversationId"))
+        rc = execute(db, "ALTER TABLE Messages ADD COLUMN conversationId INTEGER REFERENCES Conversations(id);");
+    if (rc == SQLITE_OK && !hasColumn(db, "Messages", "createdAt"))
+        rc = execute(db, "ALTER TABLE Messages ADD COLUMN createdAt INTEGER;");
+    if (rc == SQLITE_OK)
+        rc = execute(db, createMessagesTrigger);
+    if (rc != SQLITE_OK) {
+        execute(db, "ROLLBACK;");
+        return -1;
+    }
+    if (execute(db, "COMMIT;") != SQLITE_OK)
+        return -1;
+
+    // 2. backfill the existing rows, batchSize ids at a time in id order (so no batch rescans the ones already done)
+    const char* batchEndQuery = "SELECT MAX(id) FROM (SELECT id FROM Messages WHERE id > ? ORDER BY id LIMIT ?);";
+    const char* fillConversationsQuery = "INSERT OR IGNORE INTO Conversations (userA, userB) "
+                                        "    SELECT DISTINCT min(sender, receiver), max(sender, receiver) FROM Messages"
+                                        "    WHERE id > ? AND id <= ? AND conversationId IS NULL;";
+    const char* fillMessagesQuery = "UPDATE Messages SET"
+                                    "    conversationId = (SELECT id FROM Conversations WHERE userA = min(sender, receiver) AND userB = max(sender, receiver)),"
+                                    "    createdAt = CAST(strftime('%s', timeStamp) AS INTEGER) * 1000"
+                                    "    WHERE id > ? AND id <= ? AND conversationId IS NULL;";
+    sqlite3_stmt* batchEndStmt;
+    sqlite3_stmt* fillConversationsStmt;
+    sqlite3_stmt* fillMessagesStmt;
+    sqlite3_prepare_v2(db, batchEndQuery, -1, &batchEndStmt, nullptr);
+    sqlite3_prepare_v2(db, fillConversationsQuery, -1, &fillConversationsStmt, nullptr);
+    sqlite3_prepare_v2(db, fillMessagesQuery, -1, &fillMessagesStmt, nullptr);
+
+    sqlite3_int64 lastId = 0;
+    long long filled = 0;
+    rc = SQLITE_DONE;
+    while (1) {
+        sqlite3_bind_int64(batchEndStmt, 1, lastId);
+        sqlite3_bind_int(batchEndStmt, 2, batchSize);
+        sqlite3_int64 batchEnd = 0;
+        if (sqlite3_step(batchEndStmt) == SQLITE_ROW && sqlite3_column_type(batchEndStmt, 0) != SQLITE_NULL)
+            batchEnd = sqlite3_column_int64(batchEndStmt, 0);
+        sqlite3_reset(batchEndStmt);
+        if (batchEnd == 0)
+            break;
+
+        if ((rc = execute(db, "BEGIN IMMEDIATE;")) != SQLITE_OK)
+            break;
+        sqlite3_bind_int64(fillConversationsStmt, 1, lastId);
+        sqlite3_bind_int64(fillConversationsStmt, 2, batchEnd);
+        rc = sqlite3_step(fillConversationsStmt);
+        sqlite3_reset(fillConversationsStmt);
+        if (rc == SQLITE_DONE) {
+            sqlite3_bind_int64(fillMessagesStmt, 1, lastId);
+            sqlite3_bind_int64(fillMessagesStmt, 2, batchEnd);
+            rc = sqlite3_step(fillMessagesStmt);
+            filled += sqlite3_changes(db);
+            sqlite3_reset(fillMessagesStmt);
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "error filling messages up to id " << batchEnd << ": " << sqlite3_errmsg(db) << std::endl;
+            execute(db, "ROLLBACK;");
+            break;
+        }
+        if ((rc = execute(db, "COMMIT;")) != SQLITE_OK)
+            break;
+
+        lastId = batchEnd;
+        std::cout << "filled " << filled << " messages (up to id " << lastId << ")" << std::endl;
+        usleep(BATCH_PAUSE_US);
+    }
+    sqlite3_finalize(batchEndStmt);
+    sqlite3_finalize(fillConversationsStmt);
+    sqlite3_finalize(fillMessagesStmt);
+    if (rc != SQLITE_DONE && rc != SQLITE_OK)
+        return -1;
+
+    // 3. the index is built last, once, instead of being updated row by row during the backfill
+    std::cout << "building index on Messages (conversationId, createdAt, id)..." << std::endl;
+    if (execute(db, createMessagesIndex) != SQLITE_OK)
+        return -1;
+    return setVersion(db, 2) == SQLITE_OK ? 0 : -1;
+}
+
+// VERSION 2 -> 3: ConversationSummaries, kept by a trigger, backfilled from each conversation's last message
+int migrateToVersion3(sqlite3* db, int batchSize) {
+    // 1. trigger first: from here on new messages keep their summaries current, the backfill only adds missing rows
+    if (execute(db, "BEGIN IMMEDIATE;") != SQLITE_OK)
+        return -1;
+    int rc = execute(db, createSummariesTable);
+    if (rc == SQLITE_OK)
+        rc = execute(db, createSummariesIndex);
+    if (rc == SQLITE_OK)
+        rc = execute(db, createSummariesTrigger);
+    if (rc != SQLITE_OK) {
+        execute(db, "ROLLBACK;");
+        return -1;
+    }
+    if (execute(db, "COMMIT;") != SQLITE_OK)
+        return -1;
+
+    // 2. batchSize conversations at a time, one row for each side; history counts as read
+    const char* batchEndQuery = "SELECT MAX(id) FROM (SELECT id FROM Conversations WHERE id > ? ORDER BY id LIMIT ?);";
+    const char* fillSummariesQuery = "INSERT INTO ConversationSummaries (owner, peer, lastMessageId, lastCreatedAt, lastTimeStamp, preview, unreadCount)"
+                                    "    SELECT side.owner, side.peer, m.id, m.createdAt, m.timeStamp, substr(m.content, 1, 32), 0"
+                                    "    FROM (SELECT id, userA AS owner, userB AS peer FROM Conversations WHERE id > ?1 AND id <= ?2"
+                                    "          UNION ALL"
+                                    "          SELECT id, userB, userA FROM Conversations WHERE id > ?1 AND id <= ?2) AS side"
+                                    "    JOIN Messages m ON m.id = (SELECT id FROM Messages WHERE conversationId = side.id ORDER BY createdAt DESC, id DESC LIMIT 1)"
+                                    "    WHERE true"
+                                    "    ON CONFLICT (owner, peer) DO NOTHING;";
+    sqlite3_stmt* batchEndStmt;
+    sqlite3_stmt* fillSummariesStmt;
+    sqlite3_prepare_v2(db, batchEndQuery, -1, &batchEndStmt, nullptr);
+    sqlite3_prepare_v2(db, fillSummariesQuery, -1, &fillSummariesStmt, nullptr);
+
+    sqlite3_int64 lastId = 0;
+    rc = SQLITE_DONE;
+    while (1) {
+        sqlite3_bind_int64(batchEndStmt, 1, lastId);
+        sqlite3_bind_int(batchEndStmt, 2, batchSize);
+        sqlite3_int64 batchEnd = 0;
+        if (sqlite3_step(batchEndStmt) == SQLITE_ROW && sqlite3_column_type(batchEndStmt, 0) != SQLITE_NULL)
+            batchEnd = sqlite3_column_int64(batchEndStmt, 0);
+        sqlite3_reset(batchEndStmt);
+        if (batchEnd == 0)
+            break;
+
+        if ((rc = execute(db, "BEGIN IMMEDIATE;")) != SQLITE_OK)
+            break;
+        sqlite3_bind_int64(fillSummariesStmt, 1, lastId);
+        sqlite3_bind_int64(fillSummariesStmt, 2, batchEnd);
+        rc = sqlite3_step(fillSummariesStmt);
+        sqlite3_reset(fillSummariesStmt);
+        if (rc != SQLITE_DONE) {
+            std::cerr << "error summarizing conversations up to id " << batchEnd << ": " << sqlite3_errmsg(db) << std::endl;
+            execute(db, "ROLLBACK;");
+            break;
+        }
+        if ((rc = execute(db, "COMMIT;")) != SQLITE_OK)
+            break;
+
+        lastId = batchEnd;
+        std::cout << "summarized conversations up to id " << lastId << std::endl;
+        usleep(BATCH_PAUSE_US);
+    }
+    sqlite3_finalize(batchEndStmt);
+    sqlite3_finalize(fillSummariesStmt);
+    if (rc != SQLITE_DONE && rc != SQLITE_OK)
+        return -1;
+    return setVersion(db, 3) == SQLITE_OK ? 0 : -1;
+}
+
+// VERSION 3 -> 4: Inboxes, and the indexes the inbox reads. nothing to backfill, a user without
+// an Inboxes row gets the unread messages they already have on their next login
+int migrateToVersion4(sqlite3* db) {
+    if (execute(db, createInboxesTable) != SQLITE_OK)
+        return -1;
+    if (execute(db, createSummariesUnreadIndex) != SQLITE_OK)
+        return -1;
+    std::cout << "building index on Messages (receiver, id)..." << std::endl;
+    if (execute(db, createMessagesReceiverIndex) != SQLITE_OK)
+        return -1;
+    return setVersion(db, 4) == SQLITE_OK ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    int batchSize = DEFAULT_BATCH_SIZE;
+    if (argc > 2 || (argc == 2 && (batchSize = atoi(argv[1])) <= 0)) {
+        std::cerr << "Syntax: " << argv[0] << " [batch_size]" << std::endl;
+        return 1;
+    }
+
+    sqlite3* db;
+    int rc = sqlite3_open("database.db", &db);
+    if (rc != SQLITE_OK) {
+        std::cerr << "error: cannot open database: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        return rc;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    int version = schemaVersion(db);
+    std::cout << "database 'database.db' is at schema version " << version << "." << std::endl;
+    if (version >= SCHEMA_VERSION) {
+        std::cout << "nothing to migrate." << std::endl;
+        sqlite3_close(db);
+        return 0;
+    }
+
+    // version 0 is a database made by the original createdb, which matches version 1
+    if (version < 2 && migrateToVersion2(db, batchSize) != 0) {
+        std::cerr << "error: migration to version 2 failed, run migratedb again to resume." << std::endl;
+        sqlite3_close(db);
+        return 1;
+    }
+    if (version < 3 && migrateToVersion3(db, batchSize) != 0) {
+        std::cerr << "error: migration to version 3 failed, run migratedb again to resume." << std::endl;
+        sqlite3_close(db);
+        return 1;
+    }
+    if (version < 4 && migrateToVersion4(db) != 0) {
+        std::cerr << "error: migration to version 4 failed, run migratedb again to resume." << std::endl;
+        sqlite3_close(db);
+        return 1;
+    }
+
+    std::cout << "database migrated to schema version " << schemaVersion(db) << "." << std::endl;
+    sqlite3_close(db);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <sqlite3.h>
+
+// DATABASE SCHEMA SHARED BY createdb, migratedb & server
+// PRAGMA user_version holds the version a database.db is at, migratedb upgrades it one version at a time
+
+#define SCHEMA_VERSION 4
+
+const char* createUsersTable = "CREATE TABLE Users ("
+                            "    username VARCHAR PRIMARY KEY,"
+                            "    password VARCHAR NOT NULL"
+                            ");";
+
+// timeStamp is kept (as text, UTC) so an older server can still run against the same file,
+// createdAt is the same instant in epoch milliseconds and is what the server sorts by
+const char* createMessagesTable = "CREATE TABLE Messages ("
+                                    "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                                    "    sender VARCHAR NOT NULL,"
+                                    "    receiver VARCHAR NOT NULL,"
+                                    "    content VARCHAR NOT NULL,"
+                                    "    timeStamp DATETIME NOT NULL,"
+                                    "    replyId INTEGER,"
+                                    "    isDeleted BOOLEAN NOT NULL,"
+                                    "    conversationId INTEGER REFERENCES Conversations(id),"
+                                    "    createdAt INTEGER,"
+                                    "    FOREIGN KEY (sender) REFERENCES Users(username),"
+                                    "    FOREIGN KEY (receiver) REFERENCES Users(username),"
+                                    "    FOREIGN KEY (replyId) REFERENCES Messages(id)"
+                                    ");";
+
+// one row per pair of users, userA < userB, so both directions of a chat share one key
+const char* createConversationsTable = "CREATE TABLE IF NOT EXISTS Conversations ("
+                                        "    id INTEGER PRIMARY KEY,"
+                                        "    userA VARCHAR NOT NULL,"
+                                        "    userB VARCHAR NOT NULL,"
+                                        "    UNIQUE (userA, userB)"
+                                        ");";
+
+const char* createConversationsIndex = "CREATE INDEX IF NOT EXISTS ConversationsByUserB ON Conversations (userB);";
+
+const char* createMessagesIndex = "CREATE INDEX IF NOT EXISTS MessagesByConversation ON Messages (conversationId, createdAt, id);";
+
+// rows written without a conversation (by a server from before version 2) get one filled in
+const char* createMessagesTrigger = "CREATE TRIGGER IF NOT EXISTS MessagesFillConversation AFTER INSERT ON Messages"
+                                    "    WHEN NEW.conversationId IS NULL "
+                                    "BEGIN"
+                                    "    INSERT OR IGNORE INTO Conversations (userA, userB) VALUES (min(NEW.sender, NEW.receiver), max(NEW.sender, NEW.receiver));"
+                                    "    UPDATE Messages SET"
+                                    "        conversationId = (SELECT id FROM Conversations WHERE userA = min(NEW.sender, NEW.receiver) AND userB = max(NEW.sender, NEW.receiver)),"
+                                    "        createdAt = CAST(strftime('%s', NEW.timeStamp) AS INTEGER) * 1000"
+                                    "    WHERE id = NEW.id;"
+                                    "END;";
+
+// one row per (owner, peer): what the conversation list shows, so it never has to look at Messages
+const char* createSummariesTable = "CREATE TABLE IF NOT EXISTS ConversationSummaries ("
+                                    "    owner VARCHAR NOT NULL,"
+                                    "    peer VARCHAR NOT NULL,"
+                                    "    lastMessageId INTEGER NOT NULL,"
+                                    "    lastCreatedAt INTEGER NOT NULL,"
+                                    "    lastTimeStamp DATETIME NOT NULL,"
+                                    "    preview VARCHAR NOT NULL,"
+                                    "    unreadCount INTEGER NOT NULL DEFAULT 0,"
+                                    "    PRIMARY KEY (owner, peer)"
+                                    ") WITHOUT ROWID;";
+
+const char* createSummariesIndex = "CREATE INDEX IF NOT EXISTS SummariesByRecency ON ConversationSummaries (owner, lastCreatedAt DESC, lastMessageId DESC);";
+
+// kept up to date in the same statement as every message insert (whichever server version made it),
+// the sender's row moves to the top, the receiver's row also gains one unread message
+// the preview is the first 32 characters of the content
+const char* createSummariesTrigger = "CREATE TRIGGER IF NOT EXISTS MessagesUpdateSummaries AFTER INSERT ON Messages "
+                                    "BEGIN"
+                                    "    INSERT INTO ConversationSummaries (owner, peer, lastMessageId, lastCreatedAt, lastTimeStamp, preview, unreadCount)"
+                                    "        VALUES (NEW.sender, NEW.receiver, NEW.id, COALESCE(NEW.createdAt, CAST(strftime('%s', NEW.timeStamp) AS INTEGER) * 1000), NEW.timeStamp, substr(NEW.content, 1, 32), 0)"
+                                    "        ON CONFLICT (owner, peer) DO UPDATE SET"
+                                    "            lastMessageId = excluded.lastMessageId, lastCreatedAt = excluded.lastCreatedAt,"
+                                    "            lastTimeStamp = excluded.lastTimeStamp, preview = excluded.preview;"
+                                    "    INSERT INTO ConversationSummaries (owner, peer, lastMessageId, lastCreatedAt, lastTimeStamp, preview, unreadCount)"
+                                    "        VALUES (NEW.receiver, NEW.sender, NEW.id, COALESCE(NEW.createdAt, CAST(strftime('%s', NEW.timeStamp) AS INTEGER) * 1000), NEW.timeStamp, substr(NEW.content, 1, 32), 1)"
+                                    "        ON CONFLICT (owner, peer) DO UPDATE SET"
+                                    "            lastMessageId = excluded.lastMessageId, lastCreatedAt = excluded.lastCreatedAt,"
+                                    "            lastTimeStamp = excluded.lastTimeStamp, preview = excluded.preview, unreadCount = unreadCount + 1;"
+                                    "END;";
+
+// conversations with something unread, so the inbox never looks at the ones that are caught up
+const char* createSummariesUnreadIndex = "CREATE INDEX IF NOT EXISTS SummariesUnread ON ConversationSummaries (owner) WHERE unreadCount > 0;";
+
+// what each user received, in id order: the inbox is the range above the user's deliveredUpTo
+const char* createMessagesReceiverIndex = "CREATE INDEX IF NOT EXISTS MessagesByReceiver ON Messages (receiver, id);";
+
+// highest message id pushed to the user by the inbox (at login or by a sync), no row is the same as 0
+const char* createInboxesTable = "CREATE TABLE IF NOT EXISTS Inboxes ("
+                                "    owner VARCHAR PRIMARY KEY,"
+                                "    deliveredUpTo INTEGER NOT NULL"
+                                ") WITHOUT ROWID;";
+
+int schemaVersion(sqlite3* db)
+{
+    sqlite3_stmt* stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
@@ -1,53 +1,568 @@
 
 #include "structures.h"
+#include "schema.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <iostream>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <list>
+#include <functional>
 #include <pthread.h>
 #include <sqlite3.h>
 #include <signal.h>
+#include <time.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #define SERVER_PORT 2024
-#define MAX_CLIENTS 256
+#define DEFAULT_MAX_CONNECTIONS 131072 // split evenly across the shards
+#define CONNECTION_SLAB 256 // connections allocated together when a shard's table grows
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_DB_WORKERS 4
+#define DEFAULT_DB_QUEUE 4096
+#define DEFAULT_CHECKPOINT_PAGES 1000 // WAL pages written before the writer checkpoints them into the database
+#define DEFAULT_DB_CACHE_KB 8192 // page cache of each connection
+#define DEFAULT_MMAP_MB 256
+#define DEFAULT_WRITE_QUEUE 8192 // messages waiting for the message writer, a full queue holds the workers back
+#define DEFAULT_WRITE_BATCH 256 // messages per transaction at most
+#define DEFAULT_WRITE_DELAY_US 2000 // how long a batch waits to fill up before it is committed anyway
+#define DEFAULT_BULK_FRAME_BYTES 65536 // records per BULK_RESPONSE frame, in bytes (0 sends one Packet per record)
+#define PIPELINE_DEPTH 64 // requests with a request id one connection may have in flight at once
+#define MAX_HISTORY_PAGE 500 // messages per VIEW_CONVERSATION page, and per SYNC
+#define INBOX_PUSH 100 // inbox messages pushed after a login, the rest is fetched with SYNC
+#define SESSION_STRIPES 256 // a login copies one stripe's map, more stripes keep the copies small
+#define BLOOM_BITS_PER_USER 16 // ~0.05% false positives with BLOOM_HASHES probes
+#define BLOOM_HASHES 7
+#define MIN_BLOOM_USERS 4096
+#define HOT_MESSAGES 64 // latest messages kept in memory per conversation
+#define HOT_WRITE_SLOTS 1024
+#define DEFAULT_HOT_CACHE_MB 64
+#define STATEMENT_CACHE_SIZE 16 // more than the number of distinct queries the server issues
+#define ACCEPT_BATCH 64 // connections accepted per wakeup of the listening socket
+#define MAX_EVENTS 256
+#define READ_CHUNK 16384
+#define MAX_READ_BUFFER (64 * sizeof(Packet)) // input buffered while a connection waits on the database
+#define MAX_REQUEST_LENGTH 4096 // body of a compact request frame, a client sending more is dropped
+#define MAX_WRITE_BUFFER (4 * 1024 * 1024) // a client that stops reading gets dropped past this
+
+#define ADMIN_SOCKET "admin.sock" // metrics for whoever can open it, next to database.db
+#define ADMIN_COMMAND_LENGTH 64
+#define DEFAULT_TRACE_EVENTS 65536 // spans kept per thread, rounded up to a power of two
+#define DEFAULT_TRACE_SECONDS 10 // how far back a dump goes
+
+#define LISTEN_TAG ((uint64_t)-1)
+#define INBOX_TAG ((uint64_t)-2)
+
+struct Shard;
+struct ShardMetrics;
+struct TraceRing;
+
+// a request that needs SQLite, run by a database worker and completed back on the connection's shard
+struct DbJob {
+    Shard *shard;
+    int connectionIndex;
+    unsigned int generation;
+    Packet request;
+    char username[USERNAME_LENGTH]; // session state when the request was read
+    char viewingConvo[USERNAME_LENGTH];
+    // filled in by the worker
+    ErrorType error;
+    std::vector<Packet> responses; // rows to stream back, in order
+    Packet notification; // SEND_MESSAGE: the stored message, ready to deliver
+    // SEND_MESSAGE: filled in by the worker for the message writer
+    sqlite3_int64 messageId;
+    sqlite3_int64 conversationId;
+    long long createdAt;
+    int unread; // LOGIN: unread messages in all of the user's conversations
+    sqlite3_int64 inboxUpTo; // LOGIN, SYNC of the inbox: deliveredUpTo once the pages are sent (0: stays)
+    uint64_t queuedAt; // monotonic ns when the shard submitted it
+    uint64_t traceRequest; // ties the worker's spans to the shard's
+};
+
+enum InboxItemType {
+    INBOX_NOTIFICATION,
+    INBOX_COMPLETION
+};
+
+// something handed to a shard from another thread: a notification for one of its users or a finished DbJob
+struct InboxItem {
+    InboxItem *next;
+    InboxItemType type;
+    Packet packet;
+    int connectionIndex; // notification: the receiver's connection, as the session index saw it
+    unsigned int generation;
+    DbJob *job;
+};
+
+// where a logged in user's session lives
+struct SessionRef {
+    int shard;
+    int connectionIndex;
+    unsigned int generation;
+};
+
+typedef std::unordered_map<std::string, SessionRef> SessionMap;
+
+// a stripe's map replaced at epoch, freed once no shard can still be reading it
+struct RetiredSessions {
+    const SessionMap *sessions;
+    uint64_t epoch;
+};
+
+// one reactor thread: its own listening socket, epoll set and connections
+struct Shard {
+    int index;
+    pthread_t thread;
+    int cpu;
+    int epollFd;
+    int listenSocket;
+    int inboxFd; // eventfd, written when the inbox goes from empty to non-empty
+    std::atomic<InboxItem*> inbox; // lock-free multi-producer stack, drained by the owning thread only
+    // connection table: slabs of CONNECTION_SLAB, allocated as the shard fills up and never moved,
+    // so an index stays valid (and its generation meaningful) for as long as the server runs
+    Connection **slabs;
+    int slabCount;
+    int capacity; // most connections this shard will hold at once
+    int connectionCount; // slots handed out so far, free or not
+    int freeList; // most recently closed slot, -1 if none
+    std::atomic<uint64_t> readEpoch; // session epoch when this loop iteration started, 0 while waiting in epoll_wait
+    std::vector<RetiredSessions> retired; // session maps this shard replaced
+    ShardMetrics *metrics;
+    TraceRing *trace;
+    uint64_t requestCount;
+};
+
+Connection *connectionAt(Shard *shard, int connectionIndex)
+{
+    return &shard->slabs[connectionIndex / CONNECTION_SLAB][connectionIndex % CONNECTION_SLAB];
+}
+
+// bounded queue of DbJobs shared by the database workers (and the one feeding the message writer)
+struct DbQueue {
+    DbJob **jobs;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+};
+
+// when the sender of a message gets its SEND_MESSAGE_RESPONSE
+enum Durability {
+    DURABLE_COMMIT, // once the transaction holding the message has committed
+    DURABLE_QUEUED // as soon as the message is queued for the writer (notifications too), a crash may lose the last batch
+};
+
+// message ids are made here instead of by SQLite: milliseconds since ID_EPOCH_MS, then ID_NODE_BITS of node,
+// then ID_SEQUENCE_BITS of sequence, 49 bits in all so an id stays under 10^15 and fits a message id field
+#define ID_EPOCH_MS 1704067200000LL // 2024-01-01 UTC
+#define ID_NODE_BITS 3 // -n: servers sharing one database need different nodes
+#define ID_SEQUENCE_BITS 6 // ids per millisecond, a busier millisecond borrows from the next one
+
+// a prepared statement kept alive across requests, keyed by its SQL text
+struct CachedStatement {
+    const char *query;
+    sqlite3_stmt *stmt;
+};
+
+struct DbWorker {
+    pthread_t thread;
+    sqlite3 *db;
+    CachedStatement statements[STATEMENT_CACHE_SIZE]; // owned by this worker's connection, never shared
+    int statementCount;
+    unsigned long statementHits;
+    unsigned long statementMisses;
+    TraceRing *trace;
+    std::atomic<uint64_t> readEpoch; // like a shard's, set only around the session lookups a job makes
+};
+
+Shard *shards = NULL;
+int shardCount = 0;
+int listenBacklog = DEFAULT_BACKLOG;
+size_t bulkFrameBytes = DEFAULT_BULK_FRAME_BYTES;
+DbQueue dbQueue;
+DbWorker *dbWorkers = NULL;
+int dbWorkerCount = 0;
+DbQueue messageQueue;
+// the one read-write connection: the message writer's batches and the few writes the workers make
+// (new users, new conversations, marking read) take turns on it, the workers' own connections only read
+DbWorker dbWriter;
+pthread_mutex_t writerMutex;
+int checkpointPages = DEFAULT_CHECKPOINT_PAGES;
+int dbCacheKb = DEFAULT_DB_CACHE_KB;
+int mmapMb = DEFAULT_MMAP_MB;
+const char *synchronousMode = "FULL";
+int writeBatch = DEFAULT_WRITE_BATCH;
+int writeDelayUs = DEFAULT_WRITE_DELAY_US;
+Durability durability = DURABLE_COMMIT;
+int idNode = 0;
+std::atomic<uint64_t> messageClock(0); // milliseconds since ID_EPOCH_MS << ID_SEQUENCE_BITS | sequence, of the last id
+unsigned long writtenMessages = 0;
+unsigned long writtenBatches = 0;
+int maxConnections = DEFAULT_MAX_CONNECTIONS;
+
+// username -> session for every shard, read-mostly: lookups load the stripe's current map without
+// any lock, logins and logouts copy it under the stripe's mutex and publish the copy.
+// a replaced map is freed by the shard that replaced it once every other shard has either
+// gone back to epoll_wait or started an iteration after the replacement
+struct alignas(64) SessionStripe {
+    pthread_mutex_t mutex; // writers only
+    std::atomic<const SessionMap*> sessions;
+};
+
+SessionStripe sessionIndex[SESSION_STRIPES];
+std::atomic<uint64_t> sessionEpoch(1);
+
+// every row of Users, loaded at startup and added to on REGISTER, so existence checks and logins
+// never reach SQLite. the Bloom filter answers "no such user" without probing the map;
+// it is rebuilt twice as large whenever the user count passes what it was sized for
+struct UserDirectory {
+    pthread_rwlock_t lock;
+    std::unordered_map<std::string, std::string> passwords; // username -> password as stored in Users
+    std::vector<uint64_t> bloom;
+    size_t bloomUsers; // users the filter was sized for
+    std::atomic<unsigned long> lookups;
+    std::atomic<unsigned long> bloomRejects;
+};
+
+UserDirectory userDirectory;
+
+// one message as the hot conversation cache keeps it, sender and receiver come from the conversation
+struct HotMessage {
+    sqlite3_int64 id;
+    long long createdAt;
+    int fromA; // sent by the conversation's userA
+    char timeStamp[TIMESTAMP_LENGTH];
+    char content[MAX_CONTENT_LENGTH];
+};
+
+// the latest messages of one conversation, oldest first starting at head, in a ring that grows up to HOT_MESSAGES
+struct HotConversation {
+    std::string key; // userA '\n' userB
+    std::string userA;
+    std::string userB;
+    HotMessage *ring;
+    int capacity;
+    int head;
+    int count;
+    int complete; // the ring holds the whole conversation
+};
+
+// LRU of HotConversations shared by the database workers, bounded by budget bytes of rings.
+// writes[] counts inserts per key hash, so a fill that raced with an insert is not installed
+struct HotCache {
+    pthread_mutex_t mutex;
+    std::list<HotConversation> conversations; // most recently used first
+    std::unordered_map<std::string, std::list<HotConversation>::iterator> index;
+    unsigned long writes[HOT_WRITE_SLOTS];
+    size_t bytes;
+    size_t budget; // 0 disables the cache
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+HotCache hotCache;
+
+// METRICS: every shard counts what it handles in its own ShardMetrics, which only its thread writes
+// (a relaxed load and store, no locked instruction) and the admin thread sums up when asked.
+// a request's time is split in decode (reading its frame), db (queued and run by a worker, back on
+// the shard) and send (encoding and writing the answer), each into a histogram per PacketType
+#define PACKET_TYPES (SYNC_END + 1)
+#define LATENCY_SUB_BITS 3 // 8 buckets per power of two of nanoseconds, values within 12.5%
+#define LATENCY_MAX_EXPONENT 36 // ~69 s, slower lands in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+const char *packetTypeNames[PACKET_TYPES] = {
+    "EMPTY", "REGISTER", "REGISTER_RESPONSE", "LOGIN", "LOGIN_RESPONSE", "LOGOUT", "LOGOUT_RESPONSE",
+    "SEND_MESSAGE", "SEND_MESSAGE_RESPONSE", "MESSAGE_NOTIFICATION", "VIEW_ALL_CONVOS", "VIEW_ALL_CONVOS_RESPONSE",
+    "VIEW_CONVERSATION", "VIEW_CONVERSATION_RESPONSE", "VIEW_CONVERSATION_END", "BULK_RESPONSE", "SYNC", "SYNC_END"
+};
+
+enum RequestPhase {
+    PHASE_DECODE,
+    PHASE_DB,
+    PHASE_SEND,
+    REQUEST_PHASES
+};
+
+const char *requestPhaseNames[REQUEST_PHASES] = {"decode", "db", "send"};
+
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+    std::atomic<uint64_t> sumNs;
+};
+
+struct ShardMetrics {
+    std::atomic<uint64_t> requests[PACKET_TYPES];
+    std::atomic<uint64_t> errors[PACKET_TYPES]; // requests answered with an error
+    LatencyHistogram latency[PACKET_TYPES][REQUEST_PHASES];
+    std::atomic<int64_t> connections;
+    std::atomic<int64_t> sessions; // logged in users whose connection is on this shard
+    std::atomic<uint64_t> inboxItems; // notifications and completions handed over by other threads
+    // the request being handled right now
+    uint64_t sendNs;
+    int responseErrors;
+    int startedJob;
+};
+
+uint64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void bumpCounter(std::atomic<uint64_t> &counter, uint64_t by)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+void moveGauge(std::atomic<int64_t> &gauge, int64_t by)
+{
+    gauge.store(gauge.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+int latencyBucket(uint64_t ns)
+{
+    if (ns < (1u << LATENCY_SUB_BITS))
+        return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > LATENCY_MAX_EXPONENT)
+        return LATENCY_BUCKETS - 1;
+    int shift = exponent - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + (int)((ns >> shift) - (1u << LATENCY_SUB_BITS));
+}
+
+// the highest value that lands in the bucket
+uint64_t latencyBucketLimit(int bucket)
+{
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << LATENCY_SUB_BITS) - 1)) + (1u << LATENCY_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+// anything the server does not know is counted as EMPTY, which is also how it answers it
+int metricType(int type)
+{
+    return type >= 0 && type < PACKET_TYPES ? type : EMPTY;
+}
+
+void recordLatency(ShardMetrics *metrics, int type, RequestPhase phase, uint64_t ns)
+{
+    LatencyHistogram *histogram = &metrics->latency[type][phase];
+    bumpCounter(histogram->buckets[latencyBucket(ns)], 1);
+    bumpCounter(histogram->sumNs, ns);
+}
+
+// called before a request is handled or a job completed: what is sent until finishSend counts for it
+void startSend(ShardMetrics *metrics)
+{
+    metrics->sendNs = 0;
+    metrics->responseErrors = 0;
+}
+
+void finishSend(ShardMetrics *metrics, int type)
+{
+    recordLatency(metrics, type, PHASE_SEND, metrics->sendNs);
+    if (metrics->responseErrors > 0)
+        bumpCounter(metrics->errors[type], 1);
+}
+
+// TRACING: every thread records what it spends time on as spans in its own ring, overwriting the oldest.
+// only the owning thread writes a ring (relaxed stores, then head is published), a dump copies the spans
+// and drops the ones the thread may have overwritten meanwhile. a span carries the request it was for,
+// numbered by the shard that read it, so a request can be followed from its shard to a worker and back
+enum TraceName {
+    TRACE_DECODE, // reading a request's frame
+    TRACE_HANDLE, // handling it on the shard, answering it unless it went to the database
+    TRACE_DB, // from queueing the job to its completion, drawn per request rather than per thread
+    TRACE_COMPLETE, // applying the job's outcome and answering, back on the shard
+    TRACE_SEND, // send() on a client socket, value: bytes taken
+    TRACE_INBOX, // handling what other threads handed to the shard, value: items
+    TRACE_EXECUTE, // a worker running the job, value: microseconds it waited in the queue
+    TRACE_COMMIT, // the message writer storing a batch, value: messages
+    TRACE_LOCK_WRITER, // waiting for a lock someone else held
+    TRACE_LOCK_SESSIONS,
+    TRACE_LOCK_HOT_CACHE,
+    TRACE_LOCK_DB_QUEUE,
+    TRACE_LOCK_WRITE_QUEUE,
+    TRACE_WRITE_QUEUE_FULL, // a worker waiting for room in the message writer's queue
+    TRACE_NAMES
+};
+
+const char *traceNames[TRACE_NAMES] = {
+    "decode", "handle", "db", "complete", "send", "inbox", "execute", "commit", "lock writerMutex",
+    "lock session stripe", "lock hotCache", "lock dbQueue", "lock messageQueue", "wait messageQueue full"
+};
+
+const char *traceValueNames[TRACE_NAMES] = {
+    NULL, NULL, NULL, NULL, "bytes", "items", "queued_us", "messages", NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+// a seqlock per slot: sequence is 0 while the owner rewrites it, else the span's index + 1
+struct TraceSpan {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> start; // monotonic ns
+    std::atomic<uint64_t> duration;
+    std::atomic<uint64_t> request;
+    std::atomic<uint64_t> detail; // name, packet type + 1 (0 for none), value << 16
+};
+
+struct TraceRing {
+    char name[32];
+    TraceSpan *spans;
+    uint64_t mask;
+    std::atomic<uint64_t> head; // spans written so far
+};
+
+int traceEvents = DEFAULT_TRACE_EVENTS;
+std::vector<TraceRing*> traceRings; // made before any thread starts, never changed after
+thread_local TraceRing *traceRing = NULL;
+thread_local uint64_t traceRequest = 0; // the request this thread is working on, 0 for none
+
+TraceRing *newTraceRing(const char *name)
+{
+    if (traceEvents <= 0)
+        return NULL;
+    TraceRing *ring = new TraceRing();
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    uint64_t capacity = 1;
+    while (capacity < (uint64_t)traceEvents)
+        capacity *= 2;
+    ring->spans = (TraceSpan *)calloc(capacity, sizeof(TraceSpan));
+    ring->mask = capacity - 1;
+    ring->head.store(0);
+    traceRings.push_back(ring);
+    return ring;
+}
 
-Connection connectionList[MAX_CLIENTS];
-pthread_mutex_t connectionListMutex = PTHREAD_MUTEX_INITIALIZER;
-sqlite3 *db;
+void traceSpan(TraceName name, uint64_t start, uint64_t end, int type, uint64_t value)
+{
+    TraceRing *ring = traceRing;
+    if (ring == NULL)
+        return;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceSpan *span = &ring->spans[head & ring->mask];
+    // the fence keeps the fields from being written before a reader can see the slot is being rewritten
+    span->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    span->start.store(start, std::memory_order_relaxed);
+    span->duration.store(end - start, std::memory_order_relaxed);
+    span->request.store(traceRequest, std::memory_order_relaxed);
+    span->detail.store(name | (uint64_t)(type + 1) << 8 | value << 16, std::memory_order_relaxed);
+    span->sequence.store(head + 1, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// takes the mutex, with a span for the wait only if someone else held it
+void lockTraced(pthread_mutex_t *mutex, TraceName name)
+{
+    if (pthread_mutex_trylock(mutex) == 0)
+        return;
+    uint64_t start = monotonicNs();
+    pthread_mutex_lock(mutex);
+    traceSpan(name, start, monotonicNs(), -1, 0);
+}
 
 void sigintHandler(int sig_num) {
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    unsigned long hits = 0, misses = 0;
+    for (int i = 0; i < dbWorkerCount; i++)
+    {
+        hits += dbWorkers[i].statementHits;
+        misses += dbWorkers[i].statementMisses;
+    }
+    hits += dbWriter.statementHits;
+    misses += dbWriter.statementMisses;
+    printf("statement cache: %lu hits, %lu prepares\n", hits, misses);
+    printf("message writer: %lu messages in %lu transactions\n", writtenMessages, writtenBatches);
+    printf("conversation cache: %lu hits, %lu misses, %lu evictions, %zu bytes\n", hotCache.hits, hotCache.misses, hotCache.evictions, hotCache.bytes);
+    printf("user directory: %lu lookups, %lu rejected by the bloom filter\n", userDirectory.lookups.load(), userDirectory.bloomRejects.load());
+    for (int s = 0; s < shardCount; s++)
     {
-        if (connectionList[i].sd != -1) {
-            close(connectionList[i].sd);
+        for (int i = 0; i < shards[s].connectionCount; i++)
+        {
+            if (connectionAt(&shards[s], i)->sd != -1) {
+                close(connectionAt(&shards[s], i)->sd);
+            }
         }
     }
     exit(0);
 }
 
 
-void initializeConnectionList() {
-    for(int i = 0; i < MAX_CLIENTS; i++)
+void initializeConnectionList(Shard *shard, int capacity) {
+    shard->capacity = capacity;
+    shard->slabs = (Connection **)calloc((capacity + CONNECTION_SLAB - 1) / CONNECTION_SLAB, sizeof(Connection *));
+    shard->slabCount = 0;
+    shard->connectionCount = 0;
+    shard->freeList = -1;
+}
+
+// returns a free slot, reusing the last one closed before growing the table, or -1 if the shard is full
+int allocateConnection(Shard *shard)
+{
+    if (shard->freeList != -1)
+    {
+        int connectionIndex = shard->freeList;
+        shard->freeList = connectionAt(shard, connectionIndex)->nextFree;
+        return connectionIndex;
+    }
+    if (shard->connectionCount == shard->capacity)
+        return -1;
+    if (shard->connectionCount == shard->slabCount * CONNECTION_SLAB)
     {
-        connectionList[i].sd = -1;
-        strcpy(connectionList[i].username, "");
+        Connection *slab = (Connection *)calloc(CONNECTION_SLAB, sizeof(Connection));
+        if (slab == NULL)
+            return -1;
+        for (int i = 0; i < CONNECTION_SLAB; i++)
+            slab[i].sd = -1;
+        shard->slabs[shard->slabCount++] = slab;
     }
+    return shard->connectionCount++;
+}
+
+void freeConnection(Shard *shard, int connectionIndex)
+{
+    connectionAt(shard, connectionIndex)->nextFree = shard->freeList;
+    shard->freeList = connectionIndex;
 }
 
-// void printConnectionList()
+// what epoll hands back for a connection: its index tagged with the generation it was registered under,
+// so an event still queued for a client that has since closed never reaches whoever got the slot next
+uint64_t connectionHandle(Shard *shard, int connectionIndex)
+{
+    return ((uint64_t)connectionAt(shard, connectionIndex)->generation << 32) | (uint32_t)connectionIndex;
+}
+
+// void printConnectionList(Shard *shard)
 // {
-//     pthread_mutex_lock(&connectionListMutex);
 //     printf("list: ");
-//     for (int i = 0; i < MAX_CLIENTS; i++)
+//     for (int i = 0; i < shard->connectionCount; i++)
 //     {
-//         if (connectionList[i].sd != -1) {
-//             printf("(%d, %d, %s) ", i, connectionList[i].sd, connectionList[i].username);
+//         if (connectionAt(shard, i)->sd != -1) {
+//             printf("(%d, %d, %s) ", i, connectionAt(shard, i)->sd, connectionAt(shard, i)->username);
 //         }
 //     }
 //     printf("\n");
-//     pthread_mutex_unlock(&connectionListMutex);
 // }
 
 void handleDbError(int rc, const char *errorMsg)
@@ -59,661 +574,2622 @@ void handleDbError(int rc, const char *errorMsg)
     }
 }
 
-void* clientHandler(void* args) {
-    int* arguments = (int*)args;
-    int clientSocket = arguments[0];
-    int connectionIndex = arguments[1];
-    free(args);
-    while(1) {
-        // printConnectionList();
-        Packet receivedPacket;
-        unsigned char receivedBuffer[sizeof(Packet)];
-        ssize_t totalBytesReceived = 0;
-        ssize_t bytesReceived;
-        while (totalBytesReceived < sizeof(Packet)) {
-            bytesReceived = recv(clientSocket, receivedBuffer + totalBytesReceived, sizeof(receivedBuffer) - totalBytesReceived, 0);
-            if (bytesReceived <= 0) {
-                break;
-            }
-            totalBytesReceived += bytesReceived;
-        }
-        deserializePacket(receivedBuffer, &receivedPacket);
-        decode_vigenere_packet(&receivedPacket, vigenere_key);
-        if (bytesReceived > 0) {
-            switch(receivedPacket.type) {
-                case REGISTER: {
-                    // check if user already exists
-                    const char *checkUserQuery = "SELECT COUNT(*) FROM Users WHERE username = ?;";
-                    sqlite3_stmt *checkUserStmt;
-
-                    int rc = sqlite3_prepare_v2(db, checkUserQuery, -1, &checkUserStmt, NULL);
-                    handleDbError(rc, "Failed to prepare SQL statement for checking user existence");
-
-                    rc = sqlite3_bind_text(checkUserStmt, 1, receivedPacket.user.username, -1, SQLITE_STATIC);
-                    handleDbError(rc, "Failed to bind username parameter for checking user existence");
-                    int userCount = 0;
-                    rc = sqlite3_step(checkUserStmt);
-                    if (rc == SQLITE_ROW)
-                    {
-                        userCount = sqlite3_column_int(checkUserStmt, 0);
-                    }
+SessionStripe *sessionStripe(const char *username)
+{
+    return &sessionIndex[std::hash<std::string>()(username) % SESSION_STRIPES];
+}
 
-                    sqlite3_finalize(checkUserStmt);
+// swaps in a stripe's new map, called with the stripe's mutex held
+void publishSessions(Shard *shard, SessionStripe *stripe, const SessionMap *sessions)
+{
+    const SessionMap *old = stripe->sessions.exchange(sessions);
+    shard->retired.push_back({old, sessionEpoch.fetch_add(1) + 1});
+}
 
-                    // if yes, send USER_ALREADY_EXISTS response
-                    if (userCount > 0)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = REGISTER_RESPONSE;
-                        responsePacket.error = USER_ALREADY_EXISTS;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        // if no, ok! insert new user into the database
-                        const char *insertUserQuery = "INSERT INTO Users (username, password) VALUES (?, ?);";
-                        sqlite3_stmt *insertUserStmt;
-
-                        rc = sqlite3_prepare_v2(db, insertUserQuery, -1, &insertUserStmt, NULL);
-                        handleDbError(rc, "Failed to prepare SQL statement for user registration");
-
-                        char encryptedUser[256];
-                        strcpy(encryptedUser, receivedPacket.user.username);
-                        encode_vigenere(encryptedUser, vigenere_key);
-
-                        rc = sqlite3_bind_text(insertUserStmt, 1, receivedPacket.user.username, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind username parameter for user registration");
-                        
-                        char encryptedPass[256];
-                        strcpy(encryptedPass, receivedPacket.user.password);
-                        encode_vigenere(encryptedPass, encryptedUser);
-
-                        rc = sqlite3_bind_text(insertUserStmt, 2, encryptedPass, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind password parameter for user registration");
-
-                        rc = sqlite3_step(insertUserStmt);
-                        sqlite3_finalize(insertUserStmt);
-                        pthread_mutex_lock(&connectionListMutex);
-                        strcpy(connectionList[connectionIndex].username, receivedPacket.user.username);
-                        connectionList[connectionIndex].currentView = MAIN_VIEW;
-
-                        // send SUCCESS response
-                        Packet responsePacket;
-                        responsePacket.type = REGISTER_RESPONSE;
-                        responsePacket.error = SUCCESS;
-                        strcpy(responsePacket.user.username, connectionList[connectionIndex].username);
-                        pthread_mutex_unlock(&connectionListMutex);
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
+// frees the maps no shard or database worker can still hold, called while this shard is outside its loop iteration
+void reclaimSessions(Shard *shard)
+{
+    if (shard->retired.empty())
+        return;
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < shardCount; i++)
+    {
+        uint64_t epoch = shards[i].readEpoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    for (int i = 0; i < dbWorkerCount; i++)
+    {
+        uint64_t epoch = dbWorkers[i].readEpoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < shard->retired.size(); i++)
+    {
+        if (shard->retired[i].epoch <= oldest)
+            delete shard->retired[i].sessions;
+        else
+            shard->retired[kept++] = shard->retired[i];
+    }
+    shard->retired.resize(kept);
+}
 
-                    break;
-                }
-                case LOGIN: {
-                    // check if username and password combination exists in the database
-                    const char *checkLoginQuery = "SELECT COUNT(*) FROM Users WHERE username = ? AND password = ?;";
-                    sqlite3_stmt *checkLoginStmt;
-
-                    int rc = sqlite3_prepare_v2(db, checkLoginQuery, -1, &checkLoginStmt, NULL);
-                    handleDbError(rc, "Failed to prepare SQL statement for checking login");
-
-                    char encryptedUser[256];
-                    strcpy(encryptedUser, receivedPacket.user.username);
-                    encode_vigenere(encryptedUser, vigenere_key);
-
-                    rc = sqlite3_bind_text(checkLoginStmt, 1, receivedPacket.user.username, -1, SQLITE_STATIC);
-                    handleDbError(rc, "Failed to bind username parameter for checking login");
-                    
-                    char encryptedPass[256];
-                    strcpy(encryptedPass, receivedPacket.user.password);
-                    encode_vigenere(encryptedPass, encryptedUser);
-                    rc = sqlite3_bind_text(checkLoginStmt, 2, encryptedPass, -1, SQLITE_STATIC);
-                    handleDbError(rc, "Failed to bind password parameter for checking login");
-
-                    int loginCount = 0;
-                    rc = sqlite3_step(checkLoginStmt);
-                    if (rc == SQLITE_ROW)
-                    {
-                        loginCount = sqlite3_column_int(checkLoginStmt, 0);
-                    }
+// returns 1 if the username was free and is now bound to this connection, 0 if someone already holds it
+int claimSession(const char *username, Shard *shard, int connectionIndex)
+{
+    SessionStripe *stripe = sessionStripe(username);
+    SessionRef session = {shard->index, connectionIndex, connectionAt(shard, connectionIndex)->generation};
+    lockTraced(&stripe->mutex, TRACE_LOCK_SESSIONS);
+    const SessionMap *current = stripe->sessions.load();
+    int claimed = current->find(username) == current->end();
+    if (claimed)
+    {
+        SessionMap *sessions = new SessionMap(*current);
+        sessions->emplace(username, session);
+        publishSessions(shard, stripe, sessions);
+        moveGauge(shard->metrics->sessions, 1);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    return claimed;
+}
 
-                    sqlite3_finalize(checkLoginStmt);
-                    pthread_mutex_lock(&connectionListMutex);
-                    int foundAnother = 0;
-                    for (int i = 0; i < MAX_CLIENTS; i++)
-                    {
-                        if (strcmp(connectionList[i].username, receivedPacket.user.username) == 0)
-                            foundAnother = 1;
-                    }
-                    pthread_mutex_unlock(&connectionListMutex);
-                    // if correct, mark connectionList[i].username and send LOGIN_RESPONSE SUCCESS
-                    if (loginCount < 1)
-                    {
-                        // if the login combination is incorrect, send LOGIN_RESPONSE INVALID_USER_DATA
-                        Packet responsePacket;
-                        responsePacket.type = LOGIN_RESPONSE;
-                        responsePacket.error = INVALID_USER_DATA;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else if (foundAnother == 1)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = LOGIN_RESPONSE;
-                        responsePacket.error = USER_ALREADY_CONNECTED;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        // mark connectionList[i].username
-                        strcpy(connectionList[connectionIndex].username, receivedPacket.user.username);
-
-                        // send SUCCESS response
-                        Packet responsePacket;
-                        responsePacket.type = LOGIN_RESPONSE;
-                        responsePacket.error = SUCCESS;
-                        pthread_mutex_lock(&connectionListMutex);
-                        connectionList[connectionIndex].currentView = MAIN_VIEW;
-                        strcpy(connectionList[connectionIndex].username, receivedPacket.user.username);
-                        strcpy(responsePacket.user.username, connectionList[connectionIndex].username);
-                        pthread_mutex_unlock(&connectionListMutex);
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    break;
-                }
-                case LOGOUT: {
-                    if (strcmp(connectionList[connectionIndex].username, "") == 0)
-                    {
-                        // user is not logged in, send error through Packet
-                        Packet responsePacket;
-                        responsePacket.type = LOGOUT_RESPONSE;
-                        responsePacket.error = NOT_LOGGED_IN;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        Packet responsePacket;
-                        pthread_mutex_lock(&connectionListMutex);
-                        strcpy(responsePacket.user.username, connectionList[connectionIndex].username);
-                        strcpy(connectionList[connectionIndex].username, "");
-                        connectionList[connectionIndex].currentView = LOGIN_VIEW;
-                        responsePacket.type = LOGOUT_RESPONSE;
-                        responsePacket.error = SUCCESS;
-                        pthread_mutex_unlock(&connectionListMutex);
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    break;
-                }
-                case SEND_MESSAGE: {
-                    int okToAdd = 1;
-                    char replyContent[CONTENT_LENGTH];
-                    memset(replyContent, 0, sizeof(replyContent));
-                    pthread_mutex_lock(&connectionListMutex);
-                    strcpy(receivedPacket.message.receiver, connectionList[connectionIndex].viewingConvo);
-                    pthread_mutex_unlock(&connectionListMutex);
-                    if (connectionList[connectionIndex].currentView != CONVERSATION_VIEW)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = SEND_MESSAGE_RESPONSE;
-                        responsePacket.error = WRONG_VIEW;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else if (strcmp(connectionList[connectionIndex].username, "") == 0)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = SEND_MESSAGE_RESPONSE;
-                        responsePacket.error = NOT_LOGGED_IN;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        // check if receiver username exists in db
-                        const char *checkUserQuery = "SELECT COUNT(*) FROM Users WHERE username = ?;";
-                        sqlite3_stmt *checkUserStmt;
-
-                        int rc = sqlite3_prepare_v2(db, checkUserQuery, -1, &checkUserStmt, NULL);
-                        handleDbError(rc, "Failed to prepare SQL statement for checking user existence");
-
-                        rc = sqlite3_bind_text(checkUserStmt, 1, receivedPacket.message.receiver, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind receiver username parameter for checking user existence");
-
-                        int userCount = 0;
-                        rc = sqlite3_step(checkUserStmt);
-                        if (rc == SQLITE_ROW)
-                        {
-                            userCount = sqlite3_column_int(checkUserStmt, 0);
-                        }
-
-                        sqlite3_finalize(checkUserStmt);
-
-                        // if not, send SEND_MESSAGE_RESPONSE INVALID_USER_DATA
-                        if (userCount == 0)
-                        {
-                            Packet responsePacket;
-                            responsePacket.type = SEND_MESSAGE_RESPONSE;
-                            responsePacket.error = INVALID_USER_DATA;
-                            unsigned char buffer[sizeof(Packet)];
-                            encode_vigenere_packet(&responsePacket, vigenere_key);
-                            serializePacket(&responsePacket, buffer, sizeof(buffer));
-                            send(clientSocket, buffer, sizeof(buffer), 0);
-                        }
-                        else
-                        {
-                            if (receivedPacket.message.replyId[0] != '\0')
-                            {
-                                pthread_mutex_lock(&connectionListMutex);
-                                // check if the reply ID exists in the Messages table and is part of the same conversation
-                                const char *checkReplyQuery = "SELECT content FROM Messages WHERE id = ? AND ((sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?));";
-                                sqlite3_stmt *checkReplyStmt;
-                                rc = sqlite3_prepare_v2(db, checkReplyQuery, -1, &checkReplyStmt, NULL);
-                                handleDbError(rc, "Failed to prepare SQL statement for checking reply ID existence");
-
-                                rc = sqlite3_bind_text(checkReplyStmt, 1, receivedPacket.message.replyId, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind reply ID parameter for checking reply ID existence");
-                                rc = sqlite3_bind_text(checkReplyStmt, 2, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind sender parameter for checking reply ID existence");
-                                rc = sqlite3_bind_text(checkReplyStmt, 3, receivedPacket.message.receiver, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind receiver parameter for checking reply ID existence");
-                                rc = sqlite3_bind_text(checkReplyStmt, 4, receivedPacket.message.receiver, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind sender parameter for checking reply ID existence");
-                                rc = sqlite3_bind_text(checkReplyStmt, 5, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind receiver parameter for checking reply ID existence");
-                                rc = sqlite3_step(checkReplyStmt);
-                                pthread_mutex_unlock(&connectionListMutex);
-                                if (rc == SQLITE_ROW)
-                                {
-                                    const char *originalContent = (const char *)sqlite3_column_text(checkReplyStmt, 0);
-                                    sprintf(replyContent, "REPLY TO: '%s'\0", originalContent);
-                                }
-                                else
-                                {
-                                    okToAdd = 0;
-                                    // reply ID does not exist in the same conversation, send SEND_MESSAGE_RESPONSE INVALID_REPLY_ID
-                                    Packet responsePacket;
-                                    responsePacket.type = SEND_MESSAGE_RESPONSE;
-                                    responsePacket.error = INVALID_REPLY_ID;
-                                    unsigned char buffer[sizeof(Packet)];
-                                    encode_vigenere_packet(&responsePacket, vigenere_key);
-                                    serializePacket(&responsePacket, buffer, sizeof(buffer));
-                                    send(clientSocket, buffer, sizeof(buffer), 0);
-                                    decode_vigenere_packet(&responsePacket, vigenere_key);
-                                }
-                                if (checkReplyStmt != NULL)
-                                    sqlite3_finalize(checkReplyStmt);
-                            }
-                            if (okToAdd)
-                            {
-                                pthread_mutex_lock(&connectionListMutex);
-                                // insert the message into the db
-                                const char *insertMessageQuery = "INSERT INTO Messages (sender, receiver, content, timeStamp, replyId, isDeleted) VALUES (?, ?, ?, CURRENT_TIMESTAMP, ?, 0);";
-                                sqlite3_stmt *insertMessageStmt;
-                                if (receivedPacket.message.replyId[0] != '\0')
-                                {
-                                    char aux[CONTENT_LENGTH];
-                                    memset(aux, 0, sizeof(aux));
-                                    strcpy(aux, receivedPacket.message.content);
-                                    memset(receivedPacket.message.content, 0, sizeof(receivedPacket.message.content));
-                                    strcat(receivedPacket.message.content, replyContent);
-                                    strcat(receivedPacket.message.content, "\n");
-                                    strcat(receivedPacket.message.content, aux);
-                                    
-                                }
-                                rc = sqlite3_prepare_v2(db, insertMessageQuery, -1, &insertMessageStmt, NULL);
-                                handleDbError(rc, "Failed to prepare SQL statement for message insertion");
-                                strcpy(receivedPacket.message.sender, connectionList[connectionIndex].username);
-                                rc = sqlite3_bind_text(insertMessageStmt, 1, receivedPacket.message.sender, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind sender parameter for message insertion");
-                                rc = sqlite3_bind_text(insertMessageStmt, 2, receivedPacket.message.receiver, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind receiver parameter for message insertion");
-                                rc = sqlite3_bind_text(insertMessageStmt, 3, receivedPacket.message.content, -1, SQLITE_STATIC);
-                                handleDbError(rc, "Failed to bind content parameter for message insertion");
-                                pthread_mutex_unlock(&connectionListMutex);
-                                if (strcmp(receivedPacket.message.replyId, "") == 0)
-                                    rc = sqlite3_bind_null(insertMessageStmt, 4);
-                                else
-                                {
-                                    rc = sqlite3_bind_int(insertMessageStmt, 4, atoi(receivedPacket.message.replyId));
-                                }
-                                handleDbError(rc, "Failed to bind reply ID parameter for message insertion");
-
-                                rc = sqlite3_step(insertMessageStmt);
-                                if (rc == SQLITE_DONE)
-                                {
-                                    int messageId = sqlite3_last_insert_rowid(db);
-                                    sprintf(receivedPacket.message.id, "%d", messageId);
-                                    pthread_mutex_lock(&connectionListMutex);
-                                    // if the receiver is currently connected, send MESSAGE_NOTIFICATION
-                                    int found = -1;
-                                    for (int j = 0; j < MAX_CLIENTS; j++)
-                                    {
-                                        if (strcmp(connectionList[j].username, receivedPacket.message.receiver) == 0 && strcmp(connectionList[j].viewingConvo, connectionList[connectionIndex].username) == 0)
-                                        {
-                                            found = j;
-                                            break;
-                                        }
-                                    }
-
-                                    Packet destPacket;
-                                    destPacket.type = MESSAGE_NOTIFICATION;
-                                    strcpy(destPacket.message.id, receivedPacket.message.id);
-                                    strcpy(destPacket.message.sender, connectionList[connectionIndex].username);
-                                    strcpy(destPacket.message.receiver, receivedPacket.message.receiver);
-                                    strcpy(destPacket.message.content, receivedPacket.message.content);
-
-                                    const char *getTimeQuery = "SELECT CURRENT_TIMESTAMP FROM Messages;";
-                                    sqlite3_stmt *getTimeStmt;
-
-                                    rc = sqlite3_prepare_v2(db, getTimeQuery, -1, &getTimeStmt, NULL);
-                                    handleDbError(rc, "Failed to prepare SQL statement for getting current timestamp");
-
-                                    rc = sqlite3_step(getTimeStmt);
-
-                                    if (rc == SQLITE_ROW)
-                                    {
-                                        const char *currentTimestamp = (const char *)sqlite3_column_text(getTimeStmt, 0);
-
-                                        strcpy(destPacket.message.timeStamp, currentTimestamp);
-                                        unsigned char buffer[sizeof(Packet)];
-                                        encode_vigenere_packet(&destPacket, vigenere_key);
-                                        serializePacket(&destPacket, buffer, sizeof(buffer));
-                                        send(clientSocket, buffer, sizeof(buffer), 0);
-                                        decode_vigenere_packet(&destPacket, vigenere_key);
-                                    }
-                                    else
-                                        printf("Failed to retrieve current timestamp.\n");
-                                    sqlite3_finalize(getTimeStmt);
-                                    
-                                    if (found != -1)
-                                    {
-                                        // send(connectionList[found].sd, &destPacket, sizeof(Packet), 0);
-                                        unsigned char buffer[sizeof(Packet)];
-                                        encode_vigenere_packet(&destPacket, vigenere_key);
-                                        serializePacket(&destPacket, buffer, sizeof(buffer));
-                                        send(connectionList[found].sd, buffer, sizeof(buffer), 0);
-                                        decode_vigenere_packet(&destPacket, vigenere_key);
-                                    }
-                                    pthread_mutex_unlock(&connectionListMutex);
-                                    // send SEND_MESSAGE_RESPONSE SUCCESS
-                                    Packet responsePacket;
-                                    responsePacket.type = SEND_MESSAGE_RESPONSE;
-                                    responsePacket.error = SUCCESS;
-                                    unsigned char buffer[sizeof(Packet)];
-                                    encode_vigenere_packet(&responsePacket, vigenere_key);
-                                    serializePacket(&responsePacket, buffer, sizeof(buffer));
-                                    send(clientSocket, buffer, sizeof(buffer), 0);
-                                }
-                                else
-                                    printf("Failed to insert message into the database.\n");
-                                sqlite3_finalize(insertMessageStmt);
-                            }
-                        }
-                    }
+// drops the username's entry, if it still belongs to this connection
+void releaseSession(const char *username, Shard *shard, int connectionIndex)
+{
+    if (username[0] == '\0')
+        return;
+    SessionStripe *stripe = sessionStripe(username);
+    lockTraced(&stripe->mutex, TRACE_LOCK_SESSIONS);
+    const SessionMap *current = stripe->sessions.load();
+    auto found = current->find(username);
+    if (found != current->end() && found->second.shard == shard->index && found->second.connectionIndex == connectionIndex
+        && found->second.generation == connectionAt(shard, connectionIndex)->generation)
+    {
+        SessionMap *sessions = new SessionMap(*current);
+        sessions->erase(username);
+        publishSessions(shard, stripe, sessions);
+        moveGauge(shard->metrics->sessions, -1);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+}
 
-                    break;
-                }
-                case VIEW_ALL_CONVOS: {
-                    pthread_mutex_lock(&connectionListMutex);
-                    if (strcmp(connectionList[connectionIndex].username, "") == 0)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = VIEW_ALL_CONVOS_RESPONSE;
-                        responsePacket.error = NOT_LOGGED_IN;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        strcpy(connectionList[connectionIndex].viewingConvo, "");
-                        connectionList[connectionIndex].currentView = MAIN_VIEW;
-                        // select all unique users where the current user is either the sender or receiver
-                        const char *selectParticipantsQuery = "SELECT DISTINCT participant FROM ("
-                                                            "    SELECT sender AS participant FROM Messages WHERE receiver = ?"
-                                                            "    UNION"
-                                                            "    SELECT receiver AS participant FROM Messages WHERE sender = ?"
-                                                            ");";
-                        sqlite3_stmt *selectParticipantsStmt;
-
-                        int rc = sqlite3_prepare_v2(db, selectParticipantsQuery, -1, &selectParticipantsStmt, NULL);
-                        handleDbError(rc, "Failed to prepare SQL statement for selecting participants");
-
-                        rc = sqlite3_bind_text(selectParticipantsStmt, 1, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind username parameter for selecting participants");
-
-                        rc = sqlite3_bind_text(selectParticipantsStmt, 2, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind username parameter for selecting participants");
-
-                        while ((rc = sqlite3_step(selectParticipantsStmt)) == SQLITE_ROW)
-                        {
-                            const char *participant = (const char *)sqlite3_column_text(selectParticipantsStmt, 0);
-
-                            Packet responsePacket;
-                            responsePacket.type = VIEW_ALL_CONVOS_RESPONSE;
-                            strcpy(responsePacket.user.username, participant);
-                            unsigned char buffer[sizeof(Packet)];
-                            encode_vigenere_packet(&responsePacket, vigenere_key);
-                            serializePacket(&responsePacket, buffer, sizeof(buffer));
-                            send(clientSocket, buffer, sizeof(buffer), 0);
-                        }
-
-                        sqlite3_finalize(selectParticipantsStmt);
-                    }
-                    pthread_mutex_unlock(&connectionListMutex);
-                    break;
-                }
-                case VIEW_CONVERSATION: {
-                    pthread_mutex_lock(&connectionListMutex);
-                    if (strcmp(connectionList[connectionIndex].username, "") == 0)
-                    {
-                        Packet responsePacket;
-                        responsePacket.type = VIEW_CONVERSATION_RESPONSE;
-                        responsePacket.error = NOT_LOGGED_IN;
-                        unsigned char buffer[sizeof(Packet)];
-                        encode_vigenere_packet(&responsePacket, vigenere_key);
-                        serializePacket(&responsePacket, buffer, sizeof(buffer));
-                        send(clientSocket, buffer, sizeof(buffer), 0);
-                    }
-                    else
-                    {
-                        // check if user in table
-                        const char *checkUserQuery = "SELECT COUNT(*) FROM Users WHERE username = ?;";
-                        sqlite3_stmt *checkUserStmt;
-
-                        int rc = sqlite3_prepare_v2(db, checkUserQuery, -1, &checkUserStmt, NULL);
-                        handleDbError(rc, "Failed to prepare SQL statement for checking user existence");
-
-                        rc = sqlite3_bind_text(checkUserStmt, 1, receivedPacket.user.username, -1, SQLITE_STATIC);
-                        handleDbError(rc, "Failed to bind username parameter for checking user existence");
-
-                        int userCount = 0;
-                        rc = sqlite3_step(checkUserStmt);
-                        if (rc == SQLITE_ROW)
-                        {
-                            userCount = sqlite3_column_int(checkUserStmt, 0);
-                        }
-                        sqlite3_finalize(checkUserStmt);
-
-                        // if not, send VIEW_CONVERSATION_RESPONSE INVALID_USER_DATA
-                        if (userCount == 0)
-                        {
-                            Packet responsePacket;
-                            responsePacket.type = VIEW_CONVERSATION_RESPONSE;
-                            responsePacket.error = INVALID_USER_DATA;
-                            unsigned char buffer[sizeof(Packet)];
-                            encode_vigenere_packet(&responsePacket, vigenere_key);
-                            serializePacket(&responsePacket, buffer, sizeof(buffer));
-                            send(clientSocket, buffer, sizeof(buffer), 0);
-                        }
-                        else
-                        {
-                            connectionList[connectionIndex].currentView = CONVERSATION_VIEW;
-                            strcpy(connectionList[connectionIndex].viewingConvo, receivedPacket.user.username);
-                            // get all messages from that convo
-                            const char *selectMessagesQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
-                                                            "(sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?) ORDER BY timeStamp;";
-                            sqlite3_stmt *selectMessagesStmt;
-
-                            rc = sqlite3_prepare_v2(db, selectMessagesQuery, -1, &selectMessagesStmt, NULL);
-                            handleDbError(rc, "Failed to prepare SQL statement for selecting messages");
-
-                            rc = sqlite3_bind_text(selectMessagesStmt, 1, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                            handleDbError(rc, "Failed to bind sender parameter for selecting messages");
-
-                            rc = sqlite3_bind_text(selectMessagesStmt, 2, receivedPacket.user.username, -1, SQLITE_STATIC);
-                            handleDbError(rc, "Failed to bind receiver parameter for selecting messages");
-
-                            rc = sqlite3_bind_text(selectMessagesStmt, 3, receivedPacket.user.username, -1, SQLITE_STATIC);
-                            handleDbError(rc, "Failed to bind sender parameter for selecting messages");
-
-                            rc = sqlite3_bind_text(selectMessagesStmt, 4, connectionList[connectionIndex].username, -1, SQLITE_STATIC);
-                            handleDbError(rc, "Failed to bind receiver parameter for selecting messages");
-
-                            // each message is sent through one packet
-                            while ((rc = sqlite3_step(selectMessagesStmt)) == SQLITE_ROW)
-                            {
-                                const char *id = (const char *)sqlite3_column_text(selectMessagesStmt, 0);
-                                const char *sender = (const char *)sqlite3_column_text(selectMessagesStmt, 1);
-                                const char *receiver = (const char *)sqlite3_column_text(selectMessagesStmt, 2);
-                                const char *content = (const char *)sqlite3_column_text(selectMessagesStmt, 3);
-                                const char *timeStamp = (const char *)sqlite3_column_text(selectMessagesStmt, 4);
-
-                                Packet responsePacket;
-                                responsePacket.type = VIEW_CONVERSATION_RESPONSE;
-                                responsePacket.error = SUCCESS;
-                                strcpy(responsePacket.message.id, id);
-                                strcpy(responsePacket.message.sender, sender);
-                                strcpy(responsePacket.message.receiver, receiver);
-                                strcpy(responsePacket.message.content, content);
-                                strcpy(responsePacket.message.timeStamp, timeStamp);
-
-                                unsigned char buffer[sizeof(Packet)];
-                                encode_vigenere_packet(&responsePacket, vigenere_key);
-                                serializePacket(&responsePacket, buffer, sizeof(buffer));
-                                send(clientSocket, buffer, sizeof(buffer), 0);
-                            }
-
-                            sqlite3_finalize(selectMessagesStmt);
-                        }
-                    }
-                    pthread_mutex_unlock(&connectionListMutex);
-                    break;
-                }
-                default: {
-                    Packet P2;
-                    P2.type = EMPTY;
-                    P2.error = SUCCESS;
-                    unsigned char buffer[sizeof(Packet)];
-                    encode_vigenere_packet(&P2, vigenere_key);
-                    serializePacket(&P2, buffer, sizeof(buffer));
-                    send(clientSocket, buffer, sizeof(buffer), 0);
-                    // send(clientSocket, &P2, sizeof(Packet), 0);
-                }
+// returns 1 and where the user is connected, 0 if they are offline; takes no lock,
+// only valid while the calling shard or database worker has its readEpoch set
+int findSession(const char *username, SessionRef *session)
+{
+    const SessionMap *sessions = sessionStripe(username)->sessions.load();
+    auto found = sessions->find(username);
+    int online = found != sessions->end();
+    if (online)
+        *session = found->second;
+    return online;
+}
+
+// polls for input unless the read buffer is full, and for output while something is pending
+void updateInterest(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    unsigned int events = 0;
+    if (connection->readLength < MAX_READ_BUFFER)
+        events |= EPOLLIN;
+    if (connection->writeLength > connection->writeOffset)
+        events |= EPOLLOUT;
+    if (events == connection->pollEvents)
+        return;
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = connectionHandle(shard, connectionIndex);
+    epoll_ctl(shard->epollFd, EPOLL_CTL_MOD, connection->sd, &event);
+    connection->pollEvents = events;
+}
+
+void closeConnection(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->sd == -1)
+        return;
+    epoll_ctl(shard->epollFd, EPOLL_CTL_DEL, connection->sd, NULL);
+    close(connection->sd);
+    connection->sd = -1;
+    moveGauge(shard->metrics->connections, -1);
+    releaseSession(connection->username, shard, connectionIndex);
+    connection->generation++;
+    strcpy(connection->username, "");
+    strcpy(connection->viewingConvo, "");
+    connection->currentView = LOGIN_VIEW;
+    connection->wireFormat = WIRE_UNKNOWN;
+    connection->busy = 0;
+    connection->exclusive = 0;
+    connection->replyTo = 0;
+    free(connection->readBuffer);
+    connection->readBuffer = NULL;
+    connection->readLength = connection->readCapacity = 0;
+    free(connection->writeBuffer);
+    connection->writeBuffer = NULL;
+    connection->writeOffset = connection->writeLength = connection->writeCapacity = 0;
+    connection->inboxUpTo = 0;
+    connection->pollEvents = 0;
+    freeConnection(shard, connectionIndex);
+}
+
+void inboxSent(Shard *shard, int connectionIndex);
+
+// writes as much of the pending output as the socket takes, returns -1 if the peer is gone
+int flushConnection(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    uint64_t start = monotonicNs();
+    size_t pending = connection->writeLength - connection->writeOffset;
+    while (connection->writeOffset < connection->writeLength)
+    {
+        ssize_t sent = send(connection->sd, connection->writeBuffer + connection->writeOffset,
+                            connection->writeLength - connection->writeOffset, MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            connection->writeOffset += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        return -1;
+    }
+    traceSpan(TRACE_SEND, start, monotonicNs(), -1, pending - (connection->writeLength - connection->writeOffset));
+    if (connection->writeOffset == connection->writeLength)
+    {
+        connection->writeOffset = connection->writeLength = 0;
+        inboxSent(shard, connectionIndex);
+    }
+    updateInterest(shard, connectionIndex);
+    return 0;
+}
+
+// makes room for length more bytes of output, returns where they go or NULL if the connection had to be dropped
+unsigned char *reserveOutput(Shard *shard, int connectionIndex, size_t length)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->sd == -1)
+        return NULL;
+    if (connection->writeLength + length > connection->writeCapacity)
+    {
+        if (connection->writeOffset > 0)
+        {
+            memmove(connection->writeBuffer, connection->writeBuffer + connection->writeOffset, connection->writeLength - connection->writeOffset);
+            connection->writeLength -= connection->writeOffset;
+            connection->writeOffset = 0;
+        }
+        if (connection->writeLength + length > connection->writeCapacity)
+        {
+            size_t capacity = connection->writeCapacity ? connection->writeCapacity : 4 * sizeof(LegacyPacket);
+            while (connection->writeLength + length > capacity)
+                capacity *= 2;
+            if (capacity > MAX_WRITE_BUFFER)
+            {
+                closeConnection(shard, connectionIndex);
+                return NULL;
             }
-        } else if (bytesReceived <= 0) {
-            // client closed connection
-            pthread_mutex_lock(&connectionListMutex);
-            close(clientSocket);
-            connectionList[connectionIndex].sd = -1;
-            strcpy(connectionList[connectionIndex].username, "");
-            pthread_mutex_unlock(&connectionListMutex);
-            pthread_exit(NULL);
+            connection->writeBuffer = (unsigned char *)realloc(connection->writeBuffer, capacity);
+            connection->writeCapacity = capacity;
         }
     }
+    return connection->writeBuffer + connection->writeLength;
+}
 
-    close(clientSocket);
-    pthread_exit(NULL);
+// queues length reserved bytes and tries to push them out right away if nothing was waiting before them
+void commitOutput(Shard *shard, int connectionIndex, size_t length)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    connection->writeLength += length;
+    if (connection->writeLength - connection->writeOffset == length && flushConnection(shard, connectionIndex) == -1)
+        closeConnection(shard, connectionIndex);
 }
 
-int main() {
-    signal(SIGINT, sigintHandler);
-    char *errorMessage = nullptr;
-    int rc = sqlite3_open("database.db", &db);
-    if (rc != SQLITE_OK)
+// encodes the packet, in the connection's format, into its write buffer and tries to push it out right away.
+// a legacy client gets only the types it knows: page and sync ends mean nothing without their count
+void sendPacket(Shard *shard, int connectionIndex, Packet *packet)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->wireFormat == WIRE_LEGACY && packet->type >= LEGACY_PACKET_TYPES)
+        return;
+    uint64_t start = monotonicNs();
+    if (packet->error != SUCCESS)
+        shard->metrics->responseErrors++;
+    packet->requestId = connection->replyTo;
+    size_t length = connection->wireFormat == WIRE_LEGACY ? sizeof(LegacyPacket) : compactFrameLength(packet);
+    unsigned char *output = reserveOutput(shard, connectionIndex, length);
+    if (output == NULL)
+        return;
+    if (connection->wireFormat == WIRE_LEGACY)
+        encodeLegacyPacket(packet, output);
+    else
+        encodeCompactFrame(packet, output, 1);
+    commitOutput(shard, connectionIndex, length);
+    shard->metrics->sendNs += monotonicNs() - start;
+}
+
+// compact: a BULK_RESPONSE frame whose body is the records' own frames, encoded in one pass
+void sendCompactBulk(Shard *shard, int connectionIndex, const Packet *packets, size_t count, size_t bodyLength)
+{
+    uint64_t start = monotonicNs();
+    size_t length = FRAME_PREFIX + varintLength(bodyLength) + bodyLength;
+    unsigned char *output = reserveOutput(shard, connectionIndex, length);
+    if (output == NULL)
+        return;
+    size_t offset;
+    putFrameHeader(output, BULK_RESPONSE, SUCCESS, 0, bodyLength, &offset);
+    unsigned char *body = output + offset;
+    size_t written = 0;
+    for (size_t i = 0; i < count; i++)
+        written += encodeCompactFrame(&packets[i], body + written, 0);
+    encode_vigenere_bytes(body, bodyLength);
+    commitOutput(shard, connectionIndex, length);
+    shard->metrics->sendNs += monotonicNs() - start;
+}
+
+// list responses go out as BULK_RESPONSE frames of up to bulkFrameBytes of records,
+// one cipher pass and one send per frame instead of per row. legacy clients get them a packet each, as they always did
+void sendPackets(Shard *shard, int connectionIndex, std::vector<Packet> &packets)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    // every record carries the request id, the BULK_RESPONSE frame around them is only framing
+    for (size_t i = 0; i < packets.size(); i++)
+        packets[i].requestId = connection->replyTo;
+    if (bulkFrameBytes == 0 || connection->wireFormat == WIRE_LEGACY)
     {
-        std::cerr << "error: cannot open database: " << sqlite3_errmsg(db) << std::endl;
-        sqlite3_close(db);
-        return rc;
+        for (size_t i = 0; i < packets.size(); i++)
+            sendPacket(shard, connectionIndex, &packets[i]);
+        return;
     }
-    initializeConnectionList();
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    int reuse = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    struct sockaddr_in serverAddress;
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(SERVER_PORT);
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    size_t first = 0;
+    while (first < packets.size())
+    {
+        // as many records as fit in bulkFrameBytes, at least one
+        size_t count = 0, bodyLength = 0;
+        while (first + count < packets.size())
+        {
+            size_t frameLength = compactFrameLength(&packets[first + count]);
+            if (count > 0 && bodyLength + frameLength > bulkFrameBytes)
+                break;
+            bodyLength += frameLength;
+            count++;
+        }
+        sendCompactBulk(shard, connectionIndex, &packets[first], count, bodyLength);
+        first += count;
+    }
+}
 
-    if (bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
-        perror("bind error");
-        close(serverSocket);
-        return EXIT_FAILURE;
+void sendResponse(Shard *shard, int connectionIndex, PacketType type, ErrorType error)
+{
+    Packet responsePacket;
+    memset(&responsePacket, 0, sizeof(responsePacket));
+    responsePacket.type = type;
+    responsePacket.error = error;
+    sendPacket(shard, connectionIndex, &responsePacket);
+}
+
+// hands an item to a shard's thread without taking any lock
+void pushInbox(Shard *target, InboxItem *item)
+{
+    InboxItem *head = target->inbox.load(std::memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!target->inbox.compare_exchange_weak(head, item, std::memory_order_release, std::memory_order_relaxed));
+    if (head == NULL)
+    {
+        uint64_t one = 1;
+        write(target->inboxFd, &one, sizeof(one));
     }
+}
 
-    if (listen(serverSocket, 5) == -1) {
-        perror("listen error");
-        close(serverSocket);
-        return EXIT_FAILURE;
+void postToShard(Shard *target, int connectionIndex, unsigned int generation, const Packet *packet)
+{
+    InboxItem *item = (InboxItem *)malloc(sizeof(InboxItem));
+    item->type = INBOX_NOTIFICATION;
+    item->packet = *packet;
+    item->connectionIndex = connectionIndex;
+    item->generation = generation;
+    item->job = NULL;
+    pushInbox(target, item);
+}
+
+// sends a MESSAGE_NOTIFICATION if the connection still holds the receiver's session and is viewing the sender's convo
+void deliverLocalNotification(Shard *shard, int connectionIndex, unsigned int generation, Packet *notification)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->sd != -1 && connection->generation == generation
+        && strcmp(connection->username, notification->message.receiver) == 0
+        && strcmp(connection->viewingConvo, notification->message.sender) == 0)
+        sendPacket(shard, connectionIndex, notification);
+}
+
+// looks the receiver up in the session index and hands the notification to their shard only
+void deliverNotification(Shard *shard, Packet *notification)
+{
+    SessionRef session;
+    if (!findSession(notification->message.receiver, &session))
+        return;
+    if (session.shard == shard->index)
+        deliverLocalNotification(shard, session.connectionIndex, session.generation, notification);
+    else
+        postToShard(&shards[session.shard], session.connectionIndex, session.generation, notification);
+}
+
+// returns -1 when the queue is full, the caller answers SERVER_BUSY instead of blocking its reactor
+int submitDbJob(DbJob *job)
+{
+    lockTraced(&dbQueue.mutex, TRACE_LOCK_DB_QUEUE);
+    if (dbQueue.count == dbQueue.capacity)
+    {
+        pthread_mutex_unlock(&dbQueue.mutex);
+        return -1;
     }
+    dbQueue.jobs[(dbQueue.head + dbQueue.count) % dbQueue.capacity] = job;
+    dbQueue.count++;
+    pthread_cond_signal(&dbQueue.notEmpty);
+    pthread_mutex_unlock(&dbQueue.mutex);
+    return 0;
+}
 
-    while(1) {
-        struct sockaddr_in clientAddress;
-        socklen_t clientAddressLen = sizeof(clientAddress);
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLen);
+// the inbox pages queued for the connection have all been handed to the socket: a job without a shard stores
+// where they brought the user. if the connection closes first, or the queue is full, the next login pushes them again
+void inboxSent(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->inboxUpTo == 0 || connection->writeLength != 0 || connection->username[0] == '\0')
+        return;
+    DbJob *job = new DbJob();
+    job->shard = NULL;
+    job->request.type = SYNC;
+    strcpy(job->username, connection->username);
+    job->inboxUpTo = connection->inboxUpTo;
+    job->queuedAt = monotonicNs();
+    connection->inboxUpTo = 0;
+    if (submitDbJob(job) == -1)
+        delete job;
+}
 
-        if (clientSocket == -1) {
-            perror("accept error");
-            continue;
-        }
-        pthread_mutex_lock(&connectionListMutex);
-        int connectionIndex;
-        for(connectionIndex = 0; connectionIndex < MAX_CLIENTS; connectionIndex++) {
-            if(connectionList[connectionIndex].sd == -1) {
-                connectionList[connectionIndex].sd = clientSocket;
+DbJob *takeDbJob()
+{
+    lockTraced(&dbQueue.mutex, TRACE_LOCK_DB_QUEUE);
+    while (dbQueue.count == 0)
+        pthread_cond_wait(&dbQueue.notEmpty, &dbQueue.mutex);
+    DbJob *job = dbQueue.jobs[dbQueue.head];
+    dbQueue.head = (dbQueue.head + 1) % dbQueue.capacity;
+    dbQueue.count--;
+    pthread_mutex_unlock(&dbQueue.mutex);
+    return job;
+}
+
+long long currentTimeMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// the server clock: a new message id and the millisecond it is stamped with. never goes backwards,
+// even if the system clock does, so ids and (createdAt, id) both follow the order ids were handed out in
+sqlite3_int64 nextMessageId(long long *createdAt)
+{
+    uint64_t last = messageClock.load();
+    uint64_t next;
+    do
+    {
+        next = std::max((uint64_t)(currentTimeMs() - ID_EPOCH_MS) << ID_SEQUENCE_BITS, last + 1);
+    } while (!messageClock.compare_exchange_weak(last, next));
+    uint64_t ms = next >> ID_SEQUENCE_BITS;
+    *createdAt = ID_EPOCH_MS + ms;
+    return (sqlite3_int64)((ms << (ID_NODE_BITS + ID_SEQUENCE_BITS)) | ((uint64_t)idNode << ID_SEQUENCE_BITS) | (next & ((1 << ID_SEQUENCE_BITS) - 1)));
+}
+
+// same text SQLite's CURRENT_TIMESTAMP produces (UTC), kept in the timeStamp column and sent to clients
+void formatTimeStamp(long long ms, char *timeStamp)
+{
+    time_t seconds = ms / 1000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    strftime(timeStamp, TIMESTAMP_LENGTH, "%Y-%m-%d %H:%M:%S", &utc);
+}
+
+// hands a SEND_MESSAGE job to the message writer, waiting while its queue is full. the message id is taken
+// under the queue's lock, so the queue, and the writer committing it in order, go in id order: a reader that
+// saw an id has seen every id before it. answered, if given, is the job the sender is answered from now
+void queueMessage(DbJob *job, DbJob *answered)
+{
+    lockTraced(&messageQueue.mutex, TRACE_LOCK_WRITE_QUEUE);
+    if (messageQueue.count == messageQueue.capacity)
+    {
+        uint64_t start = monotonicNs();
+        while (messageQueue.count == messageQueue.capacity)
+            pthread_cond_wait(&messageQueue.notFull, &messageQueue.mutex);
+        traceSpan(TRACE_WRITE_QUEUE_FULL, start, monotonicNs(), -1, 0);
+    }
+    job->messageId = nextMessageId(&job->createdAt);
+    snprintf(job->notification.message.id, ID_LENGTH, "%lld", (long long)job->messageId);
+    formatTimeStamp(job->createdAt, job->notification.message.timeStamp);
+    if (answered != NULL)
+    {
+        answered->messageId = job->messageId;
+        answered->createdAt = job->createdAt;
+        answered->notification = job->notification;
+    }
+    messageQueue.jobs[(messageQueue.head + messageQueue.count) % messageQueue.capacity] = job;
+    messageQueue.count++;
+    pthread_cond_signal(&messageQueue.notEmpty);
+    pthread_mutex_unlock(&messageQueue.mutex);
+}
+
+// waits for at least one message, then up to writeDelayUs for writeBatch of them, and takes what is there
+void takeMessageBatch(std::vector<DbJob*> &batch)
+{
+    lockTraced(&messageQueue.mutex, TRACE_LOCK_WRITE_QUEUE);
+    while (messageQueue.count == 0)
+        pthread_cond_wait(&messageQueue.notEmpty, &messageQueue.mutex);
+    if (messageQueue.count < writeBatch && writeDelayUs > 0)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)writeDelayUs * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (messageQueue.count < writeBatch)
+            if (pthread_cond_timedwait(&messageQueue.notEmpty, &messageQueue.mutex, &deadline) == ETIMEDOUT)
                 break;
-            }
-        }
-        pthread_mutex_unlock(&connectionListMutex);
-        if (connectionIndex == MAX_CLIENTS) {
-            close(clientSocket);
-            continue;
-        }
-        int* args = (int*)malloc(2 * sizeof(int));
-        args[0] = clientSocket;
-        args[1] = connectionIndex;
-        pthread_t threadId;
-        if(pthread_create(&threadId, NULL, clientHandler, args) != 0) {
-            perror("pthread_create error");
-            close(clientSocket);
+    }
+    batch.clear();
+    while (messageQueue.count > 0 && (int)batch.size() < writeBatch)
+    {
+        batch.push_back(messageQueue.jobs[messageQueue.head]);
+        messageQueue.head = (messageQueue.head + 1) % messageQueue.capacity;
+        messageQueue.count--;
+    }
+    pthread_cond_broadcast(&messageQueue.notFull);
+    pthread_mutex_unlock(&messageQueue.mutex);
+}
+
+// returns the worker's prepared statement for this query, preparing it on first use
+int prepareCached(DbWorker *worker, const char *query, sqlite3_stmt **stmt)
+{
+    for (int i = 0; i < worker->statementCount; i++)
+    {
+        CachedStatement *cached = &worker->statements[i];
+        if (cached->query == query || strcmp(cached->query, query) == 0)
+        {
+            worker->statementHits++;
+            *stmt = cached->stmt;
+            return SQLITE_OK;
         }
-        pthread_detach(threadId);
     }
+    worker->statementMisses++;
+    int rc = sqlite3_prepare_v3(worker->db, query, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+    if (rc != SQLITE_OK)
+        return rc;
+    if (worker->statementCount == STATEMENT_CACHE_SIZE)
+    {
+        // full, drop the last entry to make room
+        worker->statementCount--;
+        sqlite3_finalize(worker->statements[worker->statementCount].stmt);
+    }
+    worker->statements[worker->statementCount].query = query;
+    worker->statements[worker->statementCount].stmt = *stmt;
+    worker->statementCount++;
+    return SQLITE_OK;
+}
+
+// takes the place of sqlite3_finalize: the statement stays prepared for the next request
+void releaseCached(sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
 
-    close(serverSocket);
+// FNV-1a, and a second hash derived from it, BLOOM_HASHES probes are h1 + i * h2
+uint64_t usernameHash(const char *username)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)username; *c; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void bloomAdd(UserDirectory *directory, const char *username)
+{
+    uint64_t h1 = usernameHash(username);
+    uint64_t h2 = (h1 >> 33 | h1 << 31) | 1;
+    uint64_t bits = directory->bloom.size() * 64;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) % bits;
+        directory->bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+int bloomMayContain(const UserDirectory *directory, const char *username)
+{
+    uint64_t h1 = usernameHash(username);
+    uint64_t h2 = (h1 >> 33 | h1 << 31) | 1;
+    uint64_t bits = directory->bloom.size() * 64;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) % bits;
+        if (!(directory->bloom[bit / 64] & (1ULL << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+// sizes the filter for users (at least MIN_BLOOM_USERS) and fills it from the map, called with the lock held for writing
+void rebuildBloom(UserDirectory *directory, size_t users)
+{
+    if (users < MIN_BLOOM_USERS)
+        users = MIN_BLOOM_USERS;
+    directory->bloomUsers = users;
+    directory->bloom.assign((users * BLOOM_BITS_PER_USER + 63) / 64, 0);
+    for (auto &user : directory->passwords)
+        bloomAdd(directory, user.first.c_str());
+}
+
+int loadUserDirectory(sqlite3 *db)
+{
+    pthread_rwlock_init(&userDirectory.lock, NULL);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT username, password FROM Users;", -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "error: cannot read Users: " << sqlite3_errmsg(db) << std::endl;
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        userDirectory.passwords.emplace((const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+    sqlite3_finalize(stmt);
+    rebuildBloom(&userDirectory, userDirectory.passwords.size() * 2);
+    return 0;
+}
+
+void addUser(const char *username, const char *storedPassword)
+{
+    pthread_rwlock_wrlock(&userDirectory.lock);
+    userDirectory.passwords.emplace(username, storedPassword);
+    if (userDirectory.passwords.size() > userDirectory.bloomUsers)
+        rebuildBloom(&userDirectory, userDirectory.bloomUsers * 2);
+    else
+        bloomAdd(&userDirectory, username);
+    pthread_rwlock_unlock(&userDirectory.lock);
+}
+
+// returns 1 if the user exists and, when storedPassword is given, it matches
+int checkUser(const char *username, const char *storedPassword)
+{
+    userDirectory.lookups++;
+    pthread_rwlock_rdlock(&userDirectory.lock);
+    int found = 0;
+    if (!bloomMayContain(&userDirectory, username))
+        userDirectory.bloomRejects++;
+    else
+    {
+        auto user = userDirectory.passwords.find(username);
+        found = user != userDirectory.passwords.end() && (storedPassword == NULL || user->second == storedPassword);
+    }
+    pthread_rwlock_unlock(&userDirectory.lock);
+    return found;
+}
+
+int userExists(const char *username)
+{
+    return checkUser(username, NULL);
+}
+
+// the password column holds the password encoded with the encoded username as key
+void encryptPassword(const char *username, const char *password, char *encryptedPass)
+{
+    char encryptedUser[256];
+    strcpy(encryptedUser, username);
+    encode_vigenere(encryptedUser, vigenere_key);
+    strcpy(encryptedPass, password);
+    encode_vigenere(encryptedPass, encryptedUser);
+}
+
+Packet messageRowPacket(sqlite3_stmt *selectMessagesStmt)
+{
+    const char *id = (const char *)sqlite3_column_text(selectMessagesStmt, 0);
+    const char *sender = (const char *)sqlite3_column_text(selectMessagesStmt, 1);
+    const char *receiver = (const char *)sqlite3_column_text(selectMessagesStmt, 2);
+    const char *content = (const char *)sqlite3_column_text(selectMessagesStmt, 3);
+    const char *timeStamp = (const char *)sqlite3_column_text(selectMessagesStmt, 4);
+
+    Packet responsePacket;
+    memset(&responsePacket, 0, sizeof(responsePacket));
+    responsePacket.type = VIEW_CONVERSATION_RESPONSE;
+    responsePacket.error = SUCCESS;
+    strcpy(responsePacket.message.id, id);
+    strcpy(responsePacket.message.sender, sender);
+    strcpy(responsePacket.message.receiver, receiver);
+    strcpy(responsePacket.message.content, content);
+    strcpy(responsePacket.message.timeStamp, timeStamp);
+    return responsePacket;
+}
+
+// key of the conversation between two users (0 if they never talked), created on demand when create is set
+sqlite3_int64 findConversation(DbWorker *worker, const char *first, const char *second, int create)
+{
+    const char *userA = strcmp(first, second) < 0 ? first : second;
+    const char *userB = userA == first ? second : first;
+
+    const char *selectConversationQuery = "SELECT id FROM Conversations WHERE userA = ? AND userB = ?;";
+    sqlite3_stmt *selectConversationStmt;
+    int rc = prepareCached(worker, selectConversationQuery, &selectConversationStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for finding conversation");
+    sqlite3_bind_text(selectConversationStmt, 1, userA, -1, SQLITE_STATIC);
+    sqlite3_bind_text(selectConversationStmt, 2, userB, -1, SQLITE_STATIC);
+    sqlite3_int64 conversationId = 0;
+    if (sqlite3_step(selectConversationStmt) == SQLITE_ROW)
+        conversationId = sqlite3_column_int64(selectConversationStmt, 0);
+    releaseCached(selectConversationStmt);
+    if (conversationId != 0 || !create)
+        return conversationId;
+
+    // OR IGNORE: another worker may have created it since the select
+    const char *insertConversationQuery = "INSERT OR IGNORE INTO Conversations (userA, userB) VALUES (?, ?);";
+    sqlite3_stmt *insertConversationStmt;
+    lockTraced(&writerMutex, TRACE_LOCK_WRITER);
+    rc = prepareCached(&dbWriter, insertConversationQuery, &insertConversationStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for creating conversation");
+    sqlite3_bind_text(insertConversationStmt, 1, userA, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insertConversationStmt, 2, userB, -1, SQLITE_STATIC);
+    rc = sqlite3_step(insertConversationStmt);
+    releaseCached(insertConversationStmt);
+    if (rc == SQLITE_DONE && sqlite3_changes(dbWriter.db) == 1)
+        conversationId = sqlite3_last_insert_rowid(dbWriter.db);
+    pthread_mutex_unlock(&writerMutex);
+    if (conversationId != 0)
+        return conversationId;
+    return findConversation(worker, first, second, 0);
+}
+
+void markConversationRead(const char *owner, const char *peer)
+{
+    const char *markReadQuery = "UPDATE ConversationSummaries SET unreadCount = 0 WHERE owner = ? AND peer = ? AND unreadCount <> 0;";
+    sqlite3_stmt *markReadStmt;
+    lockTraced(&writerMutex, TRACE_LOCK_WRITER);
+    int rc = prepareCached(&dbWriter, markReadQuery, &markReadStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for marking conversation read");
+    sqlite3_bind_text(markReadStmt, 1, owner, -1, SQLITE_STATIC);
+    sqlite3_bind_text(markReadStmt, 2, peer, -1, SQLITE_STATIC);
+    sqlite3_step(markReadStmt);
+    releaseCached(markReadStmt);
+    pthread_mutex_unlock(&writerMutex);
+}
+
+// one page of the inbox: what owner received after the cursor (their deliveredUpTo if the client sends none),
+// as MESSAGE_NOTIFICATIONs followed by a SYNC_END. conversations that are caught up are skipped, so what was
+// read (or seen live) is not pushed again. job->inboxUpTo is past every message looked at, deliveredUpTo
+// moves there only once the shard has handed the page to the socket (inboxSent)
+void readInbox(DbWorker *worker, DbJob *job, const char *owner, const char *cursor, int pageSize)
+{
+    const char *selectDeliveredQuery = "SELECT deliveredUpTo FROM Inboxes WHERE owner = ?;";
+    sqlite3_stmt *selectDeliveredStmt;
+    int rc = prepareCached(worker, selectDeliveredQuery, &selectDeliveredStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for reading the inbox cursor");
+    sqlite3_bind_text(selectDeliveredStmt, 1, owner, -1, SQLITE_STATIC);
+    sqlite3_int64 delivered = 0;
+    if (sqlite3_step(selectDeliveredStmt) == SQLITE_ROW)
+        delivered = sqlite3_column_int64(selectDeliveredStmt, 0);
+    releaseCached(selectDeliveredStmt);
+    sqlite3_int64 lastSeen = cursor[0] == '\0' ? delivered : atoll(cursor);
+
+    // peers with unread messages and how many. the planner would rather walk the owner's whole primary key range,
+    // the partial SummariesUnread index only holds the conversations that have something unread
+    const char *selectUnreadQuery = "SELECT peer, unreadCount FROM ConversationSummaries INDEXED BY SummariesUnread WHERE owner = ? AND unreadCount > 0;";
+    sqlite3_stmt *selectUnreadStmt;
+    rc = prepareCached(worker, selectUnreadQuery, &selectUnreadStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for reading unread conversations");
+    sqlite3_bind_text(selectUnreadStmt, 1, owner, -1, SQLITE_STATIC);
+    std::vector<std::pair<std::string, int>> unreadCounts;
+    job->unread = 0;
+    while (sqlite3_step(selectUnreadStmt) == SQLITE_ROW)
+    {
+        int unread = sqlite3_column_int(selectUnreadStmt, 1);
+        unreadCounts.emplace_back((const char *)sqlite3_column_text(selectUnreadStmt, 0), unread);
+        job->unread += unread;
+    }
+    releaseCached(selectUnreadStmt);
+
+    // of each conversation only its unreadCount latest messages are new, the older ones were seen live.
+    // where they start is looked up in the whole conversation, not in the page, so every page cuts at the same place
+    std::unordered_map<std::string, sqlite3_int64> firstUnread;
+    if (!unreadCounts.empty())
+    {
+        const char *selectFirstUnreadQuery = "SELECT id FROM Messages WHERE conversationId = ? AND sender = ? ORDER BY createdAt DESC, id DESC LIMIT 1 OFFSET ?;";
+        sqlite3_stmt *selectFirstUnreadStmt;
+        rc = prepareCached(worker, selectFirstUnreadQuery, &selectFirstUnreadStmt);
+        handleDbError(rc, "Failed to prepare SQL statement for finding the first unread message");
+        for (auto &peer : unreadCounts)
+        {
+            sqlite3_bind_int64(selectFirstUnreadStmt, 1, findConversation(worker, owner, peer.first.c_str(), 0));
+            sqlite3_bind_text(selectFirstUnreadStmt, 2, peer.first.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(selectFirstUnreadStmt, 3, peer.second - 1);
+            // fewer messages than the count: all of them are new
+            firstUnread[peer.first] = sqlite3_step(selectFirstUnreadStmt) == SQLITE_ROW ? sqlite3_column_int64(selectFirstUnreadStmt, 0) : 0;
+            sqlite3_reset(selectFirstUnreadStmt);
+        }
+        releaseCached(selectFirstUnreadStmt);
+    }
+
+    // the (receiver, id) index makes this proportional to what arrived after the cursor
+    sqlite3_int64 last = lastSeen;
+    int more = 0;
+    if (!firstUnread.empty())
+    {
+        const char *selectInboxQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE receiver = ? AND id > ? ORDER BY id LIMIT ?;";
+        sqlite3_stmt *selectInboxStmt;
+        rc = prepareCached(worker, selectInboxQuery, &selectInboxStmt);
+        handleDbError(rc, "Failed to prepare SQL statement for reading the inbox");
+        sqlite3_bind_text(selectInboxStmt, 1, owner, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(selectInboxStmt, 2, lastSeen);
+        // one extra row tells whether there is more
+        sqlite3_bind_int(selectInboxStmt, 3, pageSize + 1);
+        int rows = 0;
+        while (sqlite3_step(selectInboxStmt) == SQLITE_ROW)
+        {
+            if (rows++ == pageSize)
+            {
+                more = 1;
+                break;
+            }
+            last = sqlite3_column_int64(selectInboxStmt, 0);
+            auto peer = firstUnread.find((const char *)sqlite3_column_text(selectInboxStmt, 1));
+            if (peer != firstUnread.end() && last >= peer->second)
+            {
+                job->responses.push_back(messageRowPacket(selectInboxStmt));
+                job->responses.back().type = MESSAGE_NOTIFICATION;
+            }
+        }
+        releaseCached(selectInboxStmt);
+    }
+
+    job->inboxUpTo = last > delivered ? last : 0;
+
+    Packet endPacket;
+    memset(&endPacket, 0, sizeof(endPacket));
+    endPacket.type = SYNC_END;
+    snprintf(endPacket.message.id, ID_LENGTH, "%lld", (long long)last);
+    endPacket.count = more;
+    job->responses.push_back(endPacket);
+}
+
+// the inbox pages up to upTo reached owner's socket, the next login starts after them
+void storeDelivered(const char *owner, sqlite3_int64 upTo)
+{
+    const char *updateDeliveredQuery = "INSERT INTO Inboxes (owner, deliveredUpTo) VALUES (?1, ?2)"
+                                        "    ON CONFLICT (owner) DO UPDATE SET deliveredUpTo = max(deliveredUpTo, excluded.deliveredUpTo);";
+    sqlite3_stmt *updateDeliveredStmt;
+    lockTraced(&writerMutex, TRACE_LOCK_WRITER);
+    int rc = prepareCached(&dbWriter, updateDeliveredQuery, &updateDeliveredStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for updating the inbox cursor");
+    sqlite3_bind_text(updateDeliveredStmt, 1, owner, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(updateDeliveredStmt, 2, upTo);
+    sqlite3_step(updateDeliveredStmt);
+    releaseCached(updateDeliveredStmt);
+    pthread_mutex_unlock(&writerMutex);
+}
+
+// 1 if the message is one of the conversation's: a cursor the keyset queries can start from
+int messageInConversation(DbWorker *worker, const char *id, sqlite3_int64 conversationId)
+{
+    const char *selectCursorQuery = "SELECT 1 FROM Messages WHERE id = ? AND conversationId = ?;";
+    sqlite3_stmt *selectCursorStmt;
+    int rc = prepareCached(worker, selectCursorQuery, &selectCursorStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for checking a cursor");
+    sqlite3_bind_text(selectCursorStmt, 1, id, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(selectCursorStmt, 2, conversationId);
+    int found = sqlite3_step(selectCursorStmt) == SQLITE_ROW;
+    releaseCached(selectCursorStmt);
+    return found;
+}
+
+// the messages of one conversation after the cursor (from the start without one), oldest first, then a SYNC_END.
+// a cursor that is not one of its messages (deleted, or from another database) is INVALID_USER_DATA
+void readConversationSince(DbWorker *worker, DbJob *job, const char *peer, const char *cursor, int pageSize)
+{
+    sqlite3_int64 conversationId = findConversation(worker, job->username, peer, 0);
+    if (cursor[0] != '\0' && !messageInConversation(worker, cursor, conversationId))
+    {
+        job->error = INVALID_USER_DATA;
+        return;
+    }
+    const char *selectSinceQuery;
+    if (cursor[0] == '\0')
+        selectSinceQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                        "conversationId = ?1 ORDER BY createdAt, id LIMIT ?2;";
+    else
+        selectSinceQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                        "conversationId = ?1 AND (createdAt, id) > (SELECT createdAt, id FROM Messages WHERE id = ?3 AND conversationId = ?1) "
+                        "ORDER BY createdAt, id LIMIT ?2;";
+    sqlite3_stmt *selectSinceStmt;
+    int rc = prepareCached(worker, selectSinceQuery, &selectSinceStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for syncing a conversation");
+    sqlite3_bind_int64(selectSinceStmt, 1, conversationId);
+    sqlite3_bind_int(selectSinceStmt, 2, pageSize + 1);
+    if (cursor[0] != '\0')
+        sqlite3_bind_text(selectSinceStmt, 3, cursor, -1, SQLITE_STATIC);
+    int rows = 0;
+    int more = 0;
+    while (sqlite3_step(selectSinceStmt) == SQLITE_ROW)
+    {
+        if (rows++ == pageSize)
+        {
+            more = 1;
+            break;
+        }
+        job->responses.push_back(messageRowPacket(selectSinceStmt));
+    }
+    releaseCached(selectSinceStmt);
+
+    Packet endPacket;
+    memset(&endPacket, 0, sizeof(endPacket));
+    endPacket.type = SYNC_END;
+    strcpy(endPacket.user.username, peer);
+    strcpy(endPacket.message.id, rows > 0 ? job->responses.back().message.id : cursor);
+    endPacket.count = more;
+    job->responses.push_back(endPacket);
+}
+
+std::string conversationKey(const char *first, const char *second)
+{
+    return strcmp(first, second) < 0 ? std::string(first) + "\n" + second : std::string(second) + "\n" + first;
+}
+
+HotMessage *hotMessageAt(HotConversation *conversation, int i)
+{
+    return &conversation->ring[(conversation->head + i) % conversation->capacity];
+}
+
+// drops least recently used conversations until the cache fits its budget again, keeping the front one
+void evictHotConversations()
+{
+    while (hotCache.bytes > hotCache.budget && hotCache.conversations.size() > 1)
+    {
+        HotConversation &victim = hotCache.conversations.back();
+        hotCache.bytes -= victim.capacity * sizeof(HotMessage);
+        free(victim.ring);
+        hotCache.index.erase(victim.key);
+        hotCache.conversations.pop_back();
+        hotCache.evictions++;
+    }
+}
+
+void resizeHotRing(HotConversation *conversation, int capacity)
+{
+    HotMessage *ring = (HotMessage *)malloc(capacity * sizeof(HotMessage));
+    for (int i = 0; i < conversation->count; i++)
+        ring[i] = *hotMessageAt(conversation, i);
+    free(conversation->ring);
+    hotCache.bytes += (capacity - conversation->capacity) * sizeof(HotMessage);
+    conversation->ring = ring;
+    conversation->capacity = capacity;
+    conversation->head = 0;
+}
+
+Packet hotMessagePacket(const HotConversation *conversation, const HotMessage *message)
+{
+    Packet responsePacket;
+    memset(&responsePacket, 0, sizeof(responsePacket));
+    responsePacket.type = VIEW_CONVERSATION_RESPONSE;
+    responsePacket.error = SUCCESS;
+    snprintf(responsePacket.message.id, ID_LENGTH, "%lld", (long long)message->id);
+    strcpy(responsePacket.message.sender, message->fromA ? conversation->userA.c_str() : conversation->userB.c_str());
+    strcpy(responsePacket.message.receiver, message->fromA ? conversation->userB.c_str() : conversation->userA.c_str());
+    strcpy(responsePacket.message.content, message->content);
+    strcpy(responsePacket.message.timeStamp, message->timeStamp);
+    return responsePacket;
+}
+
+// answers a VIEW_CONVERSATION from memory if the ring covers it: the whole conversation (pageSize <= 0)
+// or pageSize messages before cursor (empty for the latest). returns 0 on a miss, responses untouched
+int readHotConversation(const std::string &key, const char *cursor, int pageSize, std::vector<Packet> &responses, int *more)
+{
+    lockTraced(&hotCache.mutex, TRACE_LOCK_HOT_CACHE);
+    auto found = hotCache.index.find(key);
+    if (found == hotCache.index.end())
+    {
+        hotCache.misses++;
+        pthread_mutex_unlock(&hotCache.mutex);
+        return 0;
+    }
+    HotConversation *conversation = &*found->second;
+    int end = conversation->count; // messages before the cursor
+    if (pageSize > 0 && cursor[0] != '\0')
+    {
+        sqlite3_int64 cursorId = atoll(cursor);
+        for (end = conversation->count - 1; end >= 0 && hotMessageAt(conversation, end)->id != cursorId; end--)
+            ;
+    }
+    // the whole conversation starts before the ring's oldest message, unless the ring holds all of it
+    int start = pageSize > 0 ? end - pageSize : -1;
+    // served if the cursor is in the ring and the page does not reach past its oldest message, unless nothing is older
+    int served = end >= 0 && (start >= 0 || conversation->complete);
+    if (served)
+    {
+        if (start < 0)
+            start = 0;
+        for (int i = start; i < end; i++)
+            responses.push_back(hotMessagePacket(conversation, hotMessageAt(conversation, i)));
+        *more = start > 0 || !conversation->complete;
+        hotCache.conversations.splice(hotCache.conversations.begin(), hotCache.conversations, found->second);
+        hotCache.hits++;
+    }
+    else
+        hotCache.misses++;
+    pthread_mutex_unlock(&hotCache.mutex);
+    return served;
+}
+
+// loads the latest HOT_MESSAGES messages of a conversation not in the cache yet
+void fillHotConversation(DbWorker *worker, const std::string &key, const char *first, const char *second, sqlite3_int64 conversationId)
+{
+    if (hotCache.budget == 0)
+        return;
+    unsigned long *writes = &hotCache.writes[std::hash<std::string>()(key) % HOT_WRITE_SLOTS];
+    lockTraced(&hotCache.mutex, TRACE_LOCK_HOT_CACHE);
+    unsigned long writesBefore = *writes;
+    pthread_mutex_unlock(&hotCache.mutex);
+
+    HotConversation conversation;
+    conversation.key = key;
+    conversation.userA = strcmp(first, second) < 0 ? first : second;
+    conversation.userB = strcmp(first, second) < 0 ? second : first;
+    conversation.capacity = 4;
+    conversation.ring = (HotMessage *)malloc(conversation.capacity * sizeof(HotMessage));
+    conversation.head = conversation.count = 0;
+    conversation.complete = 1;
+    if (conversationId != 0)
+    {
+        const char *selectLatestQuery = "SELECT id, sender, receiver, content, timeStamp, createdAt FROM Messages WHERE "
+                                        "conversationId = ?1 ORDER BY createdAt DESC, id DESC LIMIT ?2;";
+        sqlite3_stmt *selectLatestStmt;
+        int rc = prepareCached(worker, selectLatestQuery, &selectLatestStmt);
+        handleDbError(rc, "Failed to prepare SQL statement for filling the conversation cache");
+        sqlite3_bind_int64(selectLatestStmt, 1, conversationId);
+        sqlite3_bind_int(selectLatestStmt, 2, HOT_MESSAGES + 1);
+        // rows come newest first, they are put in oldest first from the end of a HOT_MESSAGES ring
+        HotMessage *latest = (HotMessage *)malloc(HOT_MESSAGES * sizeof(HotMessage));
+        while (sqlite3_step(selectLatestStmt) == SQLITE_ROW)
+        {
+            if (conversation.count == HOT_MESSAGES)
+            {
+                conversation.complete = 0;
+                break;
+            }
+            HotMessage *message = &latest[HOT_MESSAGES - 1 - conversation.count++];
+            message->id = sqlite3_column_int64(selectLatestStmt, 0);
+            message->fromA = conversation.userA == (const char *)sqlite3_column_text(selectLatestStmt, 1);
+            snprintf(message->content, MAX_CONTENT_LENGTH, "%s", (const char *)sqlite3_column_text(selectLatestStmt, 3));
+            snprintf(message->timeStamp, TIMESTAMP_LENGTH, "%s", (const char *)sqlite3_column_text(selectLatestStmt, 4));
+            message->createdAt = sqlite3_column_int64(selectLatestStmt, 5);
+        }
+        releaseCached(selectLatestStmt);
+        while (conversation.capacity < conversation.count)
+            conversation.capacity *= 2;
+        conversation.ring = (HotMessage *)realloc(conversation.ring, conversation.capacity * sizeof(HotMessage));
+        memcpy(conversation.ring, latest + HOT_MESSAGES - conversation.count, conversation.count * sizeof(HotMessage));
+        free(latest);
+    }
+
+    lockTraced(&hotCache.mutex, TRACE_LOCK_HOT_CACHE);
+    if (*writes == writesBefore && hotCache.index.find(key) == hotCache.index.end())
+    {
+        hotCache.conversations.push_front(conversation);
+        hotCache.index[key] = hotCache.conversations.begin();
+        hotCache.bytes += conversation.capacity * sizeof(HotMessage);
+        evictHotConversations();
+    }
+    else
+        free(conversation.ring); // an insert came in meanwhile, the next read fills it again
+    pthread_mutex_unlock(&hotCache.mutex);
+}
+
+// a message was just stored: put it at the end of the conversation's ring, if the conversation is cached
+void appendHotMessage(const std::string &key, const HotMessage *message)
+{
+    if (hotCache.budget == 0)
+        return;
+    lockTraced(&hotCache.mutex, TRACE_LOCK_HOT_CACHE);
+    hotCache.writes[std::hash<std::string>()(key) % HOT_WRITE_SLOTS]++;
+    auto found = hotCache.index.find(key);
+    if (found != hotCache.index.end())
+    {
+        HotConversation *conversation = &*found->second;
+        if (conversation->count == conversation->capacity && conversation->capacity < HOT_MESSAGES)
+            resizeHotRing(conversation, conversation->capacity * 2);
+        if (conversation->count == conversation->capacity)
+        {
+            // full: the oldest message leaves the ring
+            conversation->head = (conversation->head + 1) % conversation->capacity;
+            conversation->count--;
+            conversation->complete = 0;
+        }
+        // the writer stores messages in id order, so the new one is the latest
+        *hotMessageAt(conversation, conversation->count++) = *message;
+        hotCache.conversations.splice(hotCache.conversations.begin(), hotCache.conversations, found->second);
+        evictHotConversations();
+    }
+    pthread_mutex_unlock(&hotCache.mutex);
+}
+
+// runs on a database worker: only SQLite work, the session itself is touched in completeDbJob on the shard.
+// returns 1 if the job was passed on to the message writer, which completes it
+int executeDbJob(DbWorker *worker, DbJob *job)
+{
+    Packet &receivedPacket = job->request;
+    job->error = SUCCESS;
+    memset(&job->notification, 0, sizeof(job->notification));
+    switch(receivedPacket.type) {
+        case REGISTER: {
+            // check if user already exists
+            // if yes, send USER_ALREADY_EXISTS response
+            if (userExists(receivedPacket.user.username))
+            {
+                job->error = USER_ALREADY_EXISTS;
+            }
+            else
+            {
+                // if no, ok! insert new user into the database
+                const char *insertUserQuery = "INSERT INTO Users (username, password) VALUES (?, ?);";
+                sqlite3_stmt *insertUserStmt;
+
+                lockTraced(&writerMutex, TRACE_LOCK_WRITER);
+                int rc = prepareCached(&dbWriter, insertUserQuery, &insertUserStmt);
+                handleDbError(rc, "Failed to prepare SQL statement for user registration");
+
+                rc = sqlite3_bind_text(insertUserStmt, 1, receivedPacket.user.username, -1, SQLITE_STATIC);
+                handleDbError(rc, "Failed to bind username parameter for user registration");
+
+                char encryptedPass[256];
+                encryptPassword(receivedPacket.user.username, receivedPacket.user.password, encryptedPass);
+
+                rc = sqlite3_bind_text(insertUserStmt, 2, encryptedPass, -1, SQLITE_STATIC);
+                handleDbError(rc, "Failed to bind password parameter for user registration");
+
+                rc = sqlite3_step(insertUserStmt);
+                releaseCached(insertUserStmt);
+                pthread_mutex_unlock(&writerMutex);
+                // two workers may race on the same new name, the primary key lets only one insert through
+                if (rc == SQLITE_DONE)
+                    addUser(receivedPacket.user.username, encryptedPass);
+                else
+                    job->error = USER_ALREADY_EXISTS;
+            }
+            break;
+        }
+        case LOGIN: {
+            // check if username and password combination exists (the user directory mirrors Users)
+            char encryptedPass[256];
+            encryptPassword(receivedPacket.user.username, receivedPacket.user.password, encryptedPass);
+            if (!checkUser(receivedPacket.user.username, encryptedPass))
+            {
+                job->error = INVALID_USER_DATA;
+                break;
+            }
+            // what arrived while the user was away goes out right after LOGIN_RESPONSE, unless the
+            // session is taken and the login is going to be refused (completeDbJob decides, this only
+            // keeps a refused login from moving the inbox cursor)
+            SessionRef session;
+            worker->readEpoch.store(sessionEpoch.load());
+            int taken = findSession(receivedPacket.user.username, &session);
+            worker->readEpoch.store(0);
+            if (taken)
+                break;
+            readInbox(worker, job, receivedPacket.user.username, "", INBOX_PUSH);
+            // nothing pending: no SYNC_END either, for clients that do not know it
+            if (job->responses.size() == 1 && job->responses.back().count == 0)
+                job->responses.clear();
+            break;
+        }
+        case SEND_MESSAGE: {
+            char replyContent[CONTENT_LENGTH];
+            memset(replyContent, 0, sizeof(replyContent));
+            // check if receiver username exists in db
+            // if not, send SEND_MESSAGE_RESPONSE INVALID_USER_DATA
+            if (!userExists(receivedPacket.message.receiver))
+            {
+                job->error = INVALID_USER_DATA;
+                break;
+            }
+            int rc;
+            if (receivedPacket.message.replyId[0] != '\0')
+            {
+                // check if the reply ID exists in the Messages table and is part of the same conversation
+                const char *checkReplyQuery = "SELECT content FROM Messages WHERE id = ? AND conversationId = ?;";
+                sqlite3_stmt *checkReplyStmt;
+                rc = prepareCached(worker, checkReplyQuery, &checkReplyStmt);
+                handleDbError(rc, "Failed to prepare SQL statement for checking reply ID existence");
+
+                rc = sqlite3_bind_text(checkReplyStmt, 1, receivedPacket.message.replyId, -1, SQLITE_STATIC);
+                handleDbError(rc, "Failed to bind reply ID parameter for checking reply ID existence");
+                rc = sqlite3_bind_int64(checkReplyStmt, 2, findConversation(worker, job->username, receivedPacket.message.receiver, 0));
+                handleDbError(rc, "Failed to bind conversation parameter for checking reply ID existence");
+                rc = sqlite3_step(checkReplyStmt);
+                if (rc == SQLITE_ROW)
+                {
+                    const char *originalContent = (const char *)sqlite3_column_text(checkReplyStmt, 0);
+                    snprintf(replyContent, sizeof(replyContent), "REPLY TO: '%s'", originalContent);
+                }
+                else
+                {
+                    // reply ID does not exist in the same conversation, send SEND_MESSAGE_RESPONSE INVALID_REPLY_ID
+                    job->error = INVALID_REPLY_ID;
+                }
+                releaseCached(checkReplyStmt);
+                if (job->error != SUCCESS)
+                    break;
+            }
+            if (receivedPacket.message.replyId[0] != '\0')
+            {
+                // the quote is kept short (replyContent), the reply itself is cut if both do not fit
+                char aux[MAX_CONTENT_LENGTH];
+                memset(aux, 0, sizeof(aux));
+                strcpy(aux, receivedPacket.message.content);
+                memset(receivedPacket.message.content, 0, sizeof(receivedPacket.message.content));
+                int room = sizeof(receivedPacket.message.content) - strlen(replyContent) - 2;
+                snprintf(receivedPacket.message.content, sizeof(receivedPacket.message.content), "%s\n%.*s", replyContent, room, aux);
+
+            }
+            strcpy(receivedPacket.message.sender, job->username);
+            // id and timestamp come from the server clock when the message is queued, so it is complete before it is stored
+            job->conversationId = findConversation(worker, job->username, receivedPacket.message.receiver, 1);
+            Packet &destPacket = job->notification;
+            destPacket.type = MESSAGE_NOTIFICATION;
+            strcpy(destPacket.message.sender, job->username);
+            strcpy(destPacket.message.receiver, receivedPacket.message.receiver);
+            strcpy(destPacket.message.content, receivedPacket.message.content);
+
+            if (durability == DURABLE_QUEUED)
+            {
+                // the sender and the receiver hear about it now, the writer stores a copy nobody waits for
+                DbJob *stored = new DbJob(*job);
+                stored->shard = NULL;
+                queueMessage(stored, job);
+                return 0;
+            }
+            // the message writer inserts it and completes the job once it is committed
+            queueMessage(job, NULL);
+            return 1;
+        }
+        case VIEW_ALL_CONVOS: {
+            // messages that arrived while the user had the conversation open were seen live
+            if (receivedPacket.user.username[0] != '\0')
+                markConversationRead(job->username, receivedPacket.user.username);
+            // the user's conversation summaries, most recent first
+            const char *selectParticipantsQuery = "SELECT peer, lastMessageId, lastTimeStamp, preview, unreadCount FROM ConversationSummaries"
+                                                "    WHERE owner = ? ORDER BY lastCreatedAt DESC, lastMessageId DESC;";
+            sqlite3_stmt *selectParticipantsStmt;
+
+            int rc = prepareCached(worker, selectParticipantsQuery, &selectParticipantsStmt);
+            handleDbError(rc, "Failed to prepare SQL statement for selecting participants");
+
+            rc = sqlite3_bind_text(selectParticipantsStmt, 1, job->username, -1, SQLITE_STATIC);
+            handleDbError(rc, "Failed to bind username parameter for selecting participants");
+
+            while ((rc = sqlite3_step(selectParticipantsStmt)) == SQLITE_ROW)
+            {
+                const char *participant = (const char *)sqlite3_column_text(selectParticipantsStmt, 0);
+                const char *lastId = (const char *)sqlite3_column_text(selectParticipantsStmt, 1);
+                const char *lastTimeStamp = (const char *)sqlite3_column_text(selectParticipantsStmt, 2);
+                const char *preview = (const char *)sqlite3_column_text(selectParticipantsStmt, 3);
+
+                Packet responsePacket;
+                memset(&responsePacket, 0, sizeof(responsePacket));
+                responsePacket.type = VIEW_ALL_CONVOS_RESPONSE;
+                strcpy(responsePacket.user.username, participant);
+                strcpy(responsePacket.message.id, lastId);
+                strcpy(responsePacket.message.timeStamp, lastTimeStamp);
+                strcpy(responsePacket.message.content, preview);
+                responsePacket.count = sqlite3_column_int(selectParticipantsStmt, 4);
+                job->responses.push_back(responsePacket);
+            }
+
+            releaseCached(selectParticipantsStmt);
+            break;
+        }
+        case VIEW_CONVERSATION: {
+            // check if user in table
+            // if not, send VIEW_CONVERSATION_RESPONSE INVALID_USER_DATA
+            if (!userExists(receivedPacket.user.username))
+            {
+                job->error = INVALID_USER_DATA;
+                break;
+            }
+            int pageSize = receivedPacket.count;
+            if (pageSize > MAX_HISTORY_PAGE)
+                pageSize = MAX_HISTORY_PAGE;
+            // active chats are answered from the hot conversation cache, opening one that is not cached fills it
+            std::string key = conversationKey(job->username, receivedPacket.user.username);
+            int more = 0;
+            int cached = readHotConversation(key, receivedPacket.message.id, pageSize, job->responses, &more);
+            sqlite3_int64 conversationId = cached ? 0 : findConversation(worker, job->username, receivedPacket.user.username, 0);
+            if (!cached && receivedPacket.message.id[0] == '\0')
+            {
+                fillHotConversation(worker, key, job->username, receivedPacket.user.username, conversationId);
+                cached = readHotConversation(key, receivedPacket.message.id, pageSize, job->responses, &more);
+            }
+            int rc;
+            if (pageSize <= 0)
+            {
+                // no page size: the whole conversation, oldest first, walking the (conversationId, createdAt, id) index
+                if (!cached)
+                {
+                    const char *selectMessagesQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                                                    "conversationId = ? ORDER BY createdAt, id;";
+                    sqlite3_stmt *selectMessagesStmt;
+
+                    rc = prepareCached(worker, selectMessagesQuery, &selectMessagesStmt);
+                    handleDbError(rc, "Failed to prepare SQL statement for selecting messages");
+
+                    rc = sqlite3_bind_int64(selectMessagesStmt, 1, conversationId);
+                    handleDbError(rc, "Failed to bind conversation parameter for selecting messages");
+
+                    // each message is sent through one packet
+                    while ((rc = sqlite3_step(selectMessagesStmt)) == SQLITE_ROW)
+                        job->responses.push_back(messageRowPacket(selectMessagesStmt));
+
+                    releaseCached(selectMessagesStmt);
+                }
+                markConversationRead(job->username, receivedPacket.user.username);
+                break;
+            }
+
+            // one page: the pageSize latest messages before the cursor (message.id, empty for the latest page),
+            // read backwards from the index so the cost does not grow with the age of the cursor
+            if (!cached)
+            {
+                // without its row the cursor subquery is NULL and the page would come back empty, as if nothing were older
+                if (receivedPacket.message.id[0] != '\0' && !messageInConversation(worker, receivedPacket.message.id, conversationId))
+                {
+                    job->error = INVALID_USER_DATA;
+                    break;
+                }
+                const char *selectPageQuery;
+                if (receivedPacket.message.id[0] == '\0')
+                    selectPageQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                                    "conversationId = ?1 ORDER BY createdAt DESC, id DESC LIMIT ?2;";
+                else
+                    selectPageQuery = "SELECT id, sender, receiver, content, timeStamp FROM Messages WHERE "
+                                    "conversationId = ?1 AND (createdAt, id) < (SELECT createdAt, id FROM Messages WHERE id = ?3 AND conversationId = ?1) "
+                                    "ORDER BY createdAt DESC, id DESC LIMIT ?2;";
+                sqlite3_stmt *selectPageStmt;
+
+                rc = prepareCached(worker, selectPageQuery, &selectPageStmt);
+                handleDbError(rc, "Failed to prepare SQL statement for selecting a page of messages");
+
+                rc = sqlite3_bind_int64(selectPageStmt, 1, conversationId);
+                handleDbError(rc, "Failed to bind conversation parameter for selecting a page of messages");
+                // one extra row tells whether there is anything older
+                rc = sqlite3_bind_int(selectPageStmt, 2, pageSize + 1);
+                handleDbError(rc, "Failed to bind page size parameter for selecting a page of messages");
+                if (receivedPacket.message.id[0] != '\0')
+                {
+                    rc = sqlite3_bind_text(selectPageStmt, 3, receivedPacket.message.id, -1, SQLITE_STATIC);
+                    handleDbError(rc, "Failed to bind cursor parameter for selecting a page of messages");
+                }
+
+                while ((rc = sqlite3_step(selectPageStmt)) == SQLITE_ROW)
+                {
+                    if ((int)job->responses.size() == pageSize)
+                    {
+                        more = 1;
+                        break;
+                    }
+                    job->responses.push_back(messageRowPacket(selectPageStmt));
+                }
+                releaseCached(selectPageStmt);
+                // the page was read newest first, the client gets it oldest first
+                std::reverse(job->responses.begin(), job->responses.end());
+            }
+
+            Packet endPacket;
+            memset(&endPacket, 0, sizeof(endPacket));
+            endPacket.type = VIEW_CONVERSATION_END;
+            strcpy(endPacket.user.username, receivedPacket.user.username);
+            if (!job->responses.empty())
+                strcpy(endPacket.message.id, job->responses.front().message.id);
+            endPacket.count = more;
+            job->responses.push_back(endPacket);
+
+            if (receivedPacket.message.id[0] == '\0')
+                markConversationRead(job->username, receivedPacket.user.username);
+            break;
+        }
+        case SYNC: {
+            if (job->shard == NULL)
+            {
+                // posted by inboxSent, nobody waits for it
+                storeDelivered(job->username, job->inboxUpTo);
+                break;
+            }
+            int pageSize = receivedPacket.count;
+            if (pageSize <= 0 || pageSize > MAX_HISTORY_PAGE)
+                pageSize = MAX_HISTORY_PAGE;
+            if (receivedPacket.user.username[0] == '\0')
+                readInbox(worker, job, job->username, receivedPacket.message.id, pageSize);
+            else if (!userExists(receivedPacket.user.username))
+                job->error = INVALID_USER_DATA;
+            else
+                readConversationSince(worker, job, receivedPacket.user.username, receivedPacket.message.id, pageSize);
+            break;
+        }
+        default:
+            break;
+    }
+    return 0;
+}
+
+void postCompletion(DbJob *job)
+{
+    InboxItem *item = (InboxItem *)malloc(sizeof(InboxItem));
+    item->type = INBOX_COMPLETION;
+    item->job = job;
+    pushInbox(job->shard, item);
+}
+
+void* dbWorkerLoop(void* args) {
+    DbWorker *worker = (DbWorker *)args;
+    traceRing = worker->trace;
+    while (1)
+    {
+        DbJob *job = takeDbJob();
+        // the job may be gone as soon as it is handed on, what the span needs is taken first
+        uint64_t start = monotonicNs();
+        int type = metricType(job->request.type);
+        uint64_t queuedUs = (start - job->queuedAt) / 1000;
+        traceRequest = job->traceRequest;
+        if (executeDbJob(worker, job) == 0)
+        {
+            if (job->shard == NULL)
+                delete job;
+            else
+                postCompletion(job);
+        }
+        traceSpan(TRACE_EXECUTE, start, monotonicNs(), type, queuedUs);
+        traceRequest = 0;
+    }
+    return NULL;
+}
+
+// inserts a batch of messages in one transaction, so they share one commit (and one sync) instead of one each.
+// a message that could not be stored gets its notification turned back to EMPTY
+void commitMessageBatch(DbWorker *writer, std::vector<DbJob*> &batch)
+{
+    const char *insertMessageQuery = "INSERT INTO Messages (id, sender, receiver, content, timeStamp, replyId, isDeleted, conversationId, createdAt) VALUES (?, ?, ?, ?, ?, ?, 0, ?, ?);";
+    sqlite3_stmt *insertMessageStmt;
+    lockTraced(&writerMutex, TRACE_LOCK_WRITER);
+    int rc = prepareCached(writer, insertMessageQuery, &insertMessageStmt);
+    handleDbError(rc, "Failed to prepare SQL statement for message insertion");
+    std::vector<char> stored(batch.size(), 0);
+
+    rc = sqlite3_exec(writer->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    for (size_t i = 0; i < batch.size() && rc == SQLITE_OK; i++)
+    {
+        Message &message = batch[i]->notification.message;
+        // MessagesUpdateSummaries (schema.h) refreshes both conversation summaries with it
+        sqlite3_bind_int64(insertMessageStmt, 1, batch[i]->messageId);
+        sqlite3_bind_text(insertMessageStmt, 2, message.sender, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insertMessageStmt, 3, message.receiver, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insertMessageStmt, 4, message.content, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insertMessageStmt, 5, message.timeStamp, -1, SQLITE_STATIC);
+        if (batch[i]->request.message.replyId[0] == '\0')
+            sqlite3_bind_null(insertMessageStmt, 6);
+        else
+            sqlite3_bind_int64(insertMessageStmt, 6, atoll(batch[i]->request.message.replyId));
+        sqlite3_bind_int64(insertMessageStmt, 7, batch[i]->conversationId);
+        sqlite3_bind_int64(insertMessageStmt, 8, batch[i]->createdAt);
+        if (sqlite3_step(insertMessageStmt) == SQLITE_DONE)
+            stored[i] = 1;
+        else
+            printf("Failed to insert message into the database.\n");
+        sqlite3_reset(insertMessageStmt);
+    }
+    releaseCached(insertMessageStmt);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(writer->db, "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+    {
+        printf("Failed to commit %zu messages: %s\n", batch.size(), sqlite3_errmsg(writer->db));
+        sqlite3_exec(writer->db, "ROLLBACK;", NULL, NULL, NULL);
+        stored.assign(batch.size(), 0);
+    }
+    pthread_mutex_unlock(&writerMutex);
+    if (rc == SQLITE_OK)
+        writtenBatches++;
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        DbJob *job = batch[i];
+        Packet &destPacket = job->notification;
+        if (!stored[i])
+        {
+            destPacket.type = EMPTY;
+            continue;
+        }
+        writtenMessages++;
+        HotMessage message;
+        message.id = job->messageId;
+        message.createdAt = job->createdAt;
+        message.fromA = strcmp(destPacket.message.sender, destPacket.message.receiver) < 0;
+        strcpy(message.timeStamp, destPacket.message.timeStamp);
+        strcpy(message.content, destPacket.message.content);
+        appendHotMessage(conversationKey(destPacket.message.sender, destPacket.message.receiver), &message);
+    }
+}
+
+void* messageWriterLoop(void* args) {
+    DbWorker *writer = (DbWorker *)args;
+    traceRing = writer->trace;
+    std::vector<DbJob*> batch;
+    while (1)
+    {
+        takeMessageBatch(batch);
+        uint64_t start = monotonicNs();
+        commitMessageBatch(writer, batch);
+        traceSpan(TRACE_COMMIT, start, monotonicNs(), -1, batch.size());
+        for (DbJob *job : batch)
+        {
+            // -d queued: a copy whose sender was answered when it was queued
+            if (job->shard == NULL)
+                delete job;
+            else
+                postCompletion(job);
+        }
+    }
+    return NULL;
+}
+
+void processInput(Shard *shard, int connectionIndex);
+
+// pages of the inbox were just queued for the connection: their cursor is stored once they are all sent
+void noteInbox(Shard *shard, int connectionIndex, sqlite3_int64 upTo)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (upTo == 0 || connection->sd == -1)
+        return;
+    if (upTo > connection->inboxUpTo)
+        connection->inboxUpTo = upTo;
+    inboxSent(shard, connectionIndex);
+}
+
+// back on the connection's shard: apply the outcome of a DbJob to the session and answer the client
+void completeDbJob(Shard *shard, DbJob *job)
+{
+    int connectionIndex = job->connectionIndex;
+    Connection *connection = connectionAt(shard, connectionIndex);
+    if (connection->sd == -1 || connection->generation != job->generation)
+    {
+        // the client went away while the database was working, a message it sent still reaches the receiver
+        if (job->request.type == SEND_MESSAGE && job->notification.type == MESSAGE_NOTIFICATION)
+            deliverNotification(shard, &job->notification);
+        delete job;
+        return;
+    }
+    connection->busy--;
+    connection->exclusive = 0;
+    connection->replyTo = job->request.requestId;
+    Packet &receivedPacket = job->request;
+    int type = metricType(receivedPacket.type);
+    uint64_t completing = monotonicNs();
+    traceRequest = job->traceRequest;
+    traceSpan(TRACE_DB, job->queuedAt, completing, type, 0);
+    recordLatency(shard->metrics, type, PHASE_DB, completing - job->queuedAt);
+    startSend(shard->metrics);
+    switch (receivedPacket.type) {
+        case REGISTER: {
+            if (job->error != SUCCESS)
+            {
+                sendResponse(shard, connectionIndex, REGISTER_RESPONSE, job->error);
+                break;
+            }
+            releaseSession(connection->username, shard, connectionIndex);
+            claimSession(receivedPacket.user.username, shard, connectionIndex);
+            strcpy(connection->username, receivedPacket.user.username);
+            connection->currentView = MAIN_VIEW;
+
+            // send SUCCESS response
+            Packet responsePacket;
+            memset(&responsePacket, 0, sizeof(responsePacket));
+            responsePacket.type = REGISTER_RESPONSE;
+            responsePacket.error = SUCCESS;
+            strcpy(responsePacket.user.username, connection->username);
+            sendPacket(shard, connectionIndex, &responsePacket);
+            break;
+        }
+        case LOGIN: {
+            // the session index spans every shard, so a session on another core is found too
+            if (job->error != SUCCESS)
+            {
+                // if the login combination is incorrect, send LOGIN_RESPONSE INVALID_USER_DATA
+                sendResponse(shard, connectionIndex, LOGIN_RESPONSE, job->error);
+            }
+            else if (claimSession(receivedPacket.user.username, shard, connectionIndex) == 0)
+            {
+                sendResponse(shard, connectionIndex, LOGIN_RESPONSE, USER_ALREADY_CONNECTED);
+            }
+            else
+            {
+                // mark connectionList[i].username and send LOGIN_RESPONSE SUCCESS
+                releaseSession(connection->username, shard, connectionIndex);
+                connection->currentView = MAIN_VIEW;
+                strcpy(connection->username, receivedPacket.user.username);
+
+                Packet responsePacket;
+                memset(&responsePacket, 0, sizeof(responsePacket));
+                responsePacket.type = LOGIN_RESPONSE;
+                responsePacket.error = SUCCESS;
+                strcpy(responsePacket.user.username, connection->username);
+                responsePacket.count = job->unread;
+                sendPacket(shard, connectionIndex, &responsePacket);
+                // the inbox, read by the worker
+                if (!job->responses.empty())
+                    sendPackets(shard, connectionIndex, job->responses);
+                noteInbox(shard, connectionIndex, job->inboxUpTo);
+            }
+            break;
+        }
+        case SEND_MESSAGE: {
+            if (job->error != SUCCESS)
+            {
+                sendResponse(shard, connectionIndex, SEND_MESSAGE_RESPONSE, job->error);
+                break;
+            }
+            if (job->notification.type != MESSAGE_NOTIFICATION)
+            {
+                // the insert failed (logged by the message writer): the sender still gets its answer, or a
+                // pipelining client would keep the request's slot forever
+                sendResponse(shard, connectionIndex, SEND_MESSAGE_RESPONSE, SERVER_BUSY);
+                break;
+            }
+            sendPacket(shard, connectionIndex, &job->notification);
+            // if the receiver is currently connected, send MESSAGE_NOTIFICATION
+            deliverNotification(shard, &job->notification);
+            // send SEND_MESSAGE_RESPONSE SUCCESS
+            sendResponse(shard, connectionIndex, SEND_MESSAGE_RESPONSE, SUCCESS);
+            break;
+        }
+        case VIEW_ALL_CONVOS: {
+            sendPackets(shard, connectionIndex, job->responses);
+            break;
+        }
+        case VIEW_CONVERSATION: {
+            if (job->error != SUCCESS)
+            {
+                sendResponse(shard, connectionIndex, VIEW_CONVERSATION_RESPONSE, job->error);
+                break;
+            }
+            connection->currentView = CONVERSATION_VIEW;
+            strcpy(connection->viewingConvo, receivedPacket.user.username);
+            sendPackets(shard, connectionIndex, job->responses);
+            break;
+        }
+        case SYNC: {
+            if (job->error != SUCCESS)
+            {
+                sendResponse(shard, connectionIndex, SYNC_END, job->error);
+            }
+            else
+            {
+                sendPackets(shard, connectionIndex, job->responses);
+                noteInbox(shard, connectionIndex, job->inboxUpTo);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    finishSend(shard->metrics, type);
+    traceSpan(TRACE_COMPLETE, completing, monotonicNs(), type, 0);
+    traceRequest = 0;
+    delete job;
+    connection->replyTo = 0;
+    // packets that arrived while the job ran are handled now, in order
+    if (connection->sd != -1)
+        processInput(shard, connectionIndex);
+}
+
+void drainInbox(Shard *shard)
+{
+    uint64_t start = monotonicNs();
+    uint64_t items = 0;
+    uint64_t count;
+    read(shard->inboxFd, &count, sizeof(count));
+    InboxItem *item = shard->inbox.exchange(NULL, std::memory_order_acquire);
+    // the stack pops newest first, reverse it so items keep their order
+    InboxItem *ordered = NULL;
+    while (item != NULL)
+    {
+        InboxItem *next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+    while (ordered != NULL)
+    {
+        InboxItem *next = ordered->next;
+        bumpCounter(shard->metrics->inboxItems, 1);
+        items++;
+        if (ordered->type == INBOX_NOTIFICATION)
+            deliverLocalNotification(shard, ordered->connectionIndex, ordered->generation, &ordered->packet);
+        else
+            completeDbJob(shard, ordered->job);
+        free(ordered);
+        ordered = next;
+    }
+    traceSpan(TRACE_INBOX, start, monotonicNs(), -1, items);
+}
+
+// requests that may run alongside others of the same connection: the client matches their answers by request id,
+// and they do not change the session, so the order they finish in does not matter
+int pipelinable(PacketType type, int hasRequestId)
+{
+    return hasRequestId && (type == SEND_MESSAGE || type == SYNC);
+}
+
+// queues the packet for a database worker. unless it is pipelinable, the connection reads nothing else until the reply is back
+void startDbJob(Shard *shard, int connectionIndex, Packet &receivedPacket, PacketType responseType)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    DbJob *job = new DbJob();
+    job->shard = shard;
+    job->connectionIndex = connectionIndex;
+    job->generation = connection->generation;
+    job->request = receivedPacket;
+    strcpy(job->username, connection->username);
+    strcpy(job->viewingConvo, connection->viewingConvo);
+    job->queuedAt = monotonicNs();
+    job->traceRequest = traceRequest;
+    if (submitDbJob(job) == -1)
+    {
+        delete job;
+        sendResponse(shard, connectionIndex, responseType, SERVER_BUSY);
+        return;
+    }
+    shard->metrics->startedJob = 1;
+    connection->busy++;
+    if (!pipelinable((PacketType)receivedPacket.type, receivedPacket.requestId != 0))
+        connection->exclusive = 1;
+}
+
+void handlePacket(Shard *shard, int connectionIndex, Packet &receivedPacket) {
+    Connection *connection = connectionAt(shard, connectionIndex);
+    connection->replyTo = receivedPacket.requestId;
+    switch(receivedPacket.type) {
+        case REGISTER: {
+            startDbJob(shard, connectionIndex, receivedPacket, REGISTER_RESPONSE);
+            break;
+        }
+        case LOGIN: {
+            startDbJob(shard, connectionIndex, receivedPacket, LOGIN_RESPONSE);
+            break;
+        }
+        case LOGOUT: {
+            if (strcmp(connection->username, "") == 0)
+            {
+                // user is not logged in, send error through Packet
+                sendResponse(shard, connectionIndex, LOGOUT_RESPONSE, NOT_LOGGED_IN);
+            }
+            else
+            {
+                Packet responsePacket;
+                memset(&responsePacket, 0, sizeof(responsePacket));
+                strcpy(responsePacket.user.username, connection->username);
+                releaseSession(connection->username, shard, connectionIndex);
+                strcpy(connection->username, "");
+                connection->inboxUpTo = 0; // not all sent yet: the next login pushes it again
+                connection->currentView = LOGIN_VIEW;
+                responsePacket.type = LOGOUT_RESPONSE;
+                responsePacket.error = SUCCESS;
+                sendPacket(shard, connectionIndex, &responsePacket);
+            }
+            break;
+        }
+        case SEND_MESSAGE: {
+            strcpy(receivedPacket.message.receiver, connection->viewingConvo);
+            if (connection->currentView != CONVERSATION_VIEW)
+            {
+                sendResponse(shard, connectionIndex, SEND_MESSAGE_RESPONSE, WRONG_VIEW);
+            }
+            else if (strcmp(connection->username, "") == 0)
+            {
+                sendResponse(shard, connectionIndex, SEND_MESSAGE_RESPONSE, NOT_LOGGED_IN);
+            }
+            else
+            {
+                startDbJob(shard, connectionIndex, receivedPacket, SEND_MESSAGE_RESPONSE);
+            }
+            break;
+        }
+        case VIEW_ALL_CONVOS: {
+            if (strcmp(connection->username, "") == 0)
+            {
+                sendResponse(shard, connectionIndex, VIEW_ALL_CONVOS_RESPONSE, NOT_LOGGED_IN);
+            }
+            else
+            {
+                // tell the job which conversation is being left, if any
+                strcpy(receivedPacket.user.username, connection->currentView == CONVERSATION_VIEW ? connection->viewingConvo : "");
+                strcpy(connection->viewingConvo, "");
+                connection->currentView = MAIN_VIEW;
+                startDbJob(shard, connectionIndex, receivedPacket, VIEW_ALL_CONVOS_RESPONSE);
+            }
+            break;
+        }
+        case VIEW_CONVERSATION: {
+            if (strcmp(connection->username, "") == 0)
+            {
+                sendResponse(shard, connectionIndex, VIEW_CONVERSATION_RESPONSE, NOT_LOGGED_IN);
+            }
+            else
+            {
+                startDbJob(shard, connectionIndex, receivedPacket, VIEW_CONVERSATION_RESPONSE);
+            }
+            break;
+        }
+        case SYNC: {
+            if (strcmp(connection->username, "") == 0)
+                sendResponse(shard, connectionIndex, SYNC_END, NOT_LOGGED_IN);
+            else
+                startDbJob(shard, connectionIndex, receivedPacket, SYNC_END);
+            break;
+        }
+        default: {
+            sendResponse(shard, connectionIndex, EMPTY, SUCCESS);
+        }
+    }
+    connection->replyTo = 0;
+}
+
+// handles every complete Packet in the read buffer, stopping early while a database job is in flight
+// takes the next request out of buffer: 1 and the bytes used if there is a whole one, 0 if more must arrive, -1 if it is garbage
+int readFrame(Connection *connection, unsigned char *buffer, size_t available, Packet *packet, size_t *consumed)
+{
+    if (connection->wireFormat == WIRE_UNKNOWN)
+        connection->wireFormat = buffer[0] == FRAME_MAGIC ? WIRE_COMPACT : WIRE_LEGACY;
+    if (connection->wireFormat == WIRE_LEGACY)
+    {
+        if (available < sizeof(LegacyPacket))
+            return 0;
+        decodeLegacyPacket(buffer, packet);
+        *consumed = sizeof(LegacyPacket);
+        return 1;
+    }
+    FrameHeader header;
+    int headerLength = parseFrameHeader(buffer, available, &header);
+    if (headerLength <= 0)
+        return headerLength;
+    if (header.length > MAX_REQUEST_LENGTH)
+        return -1;
+    if (available < headerLength + header.length)
+        return 0;
+    unsigned char *body = buffer + headerLength;
+    decode_vigenere_bytes(body, header.length);
+    if (decodeCompactFrame(&header, body, packet) == -1)
+        return -1;
+    *consumed = headerLength + header.length;
+    return 1;
+}
+
+// handles every complete request in the read buffer, stopping early while a database job is in flight,
+// unless both it and the next request are pipelinable (the frame header tells, before the body is decoded)
+void processInput(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    size_t offset = 0;
+    while (connection->sd != -1 && !connection->exclusive && connection->readLength > offset)
+    {
+        if (connection->busy > 0)
+        {
+            const unsigned char *next = connection->readBuffer + offset;
+            if (connection->wireFormat != WIRE_COMPACT || connection->readLength - offset < FRAME_PREFIX
+                || !pipelinable((PacketType)next[2], next[4] & FRAME_FLAG_REQUEST_ID) || connection->busy >= PIPELINE_DEPTH)
+                break;
+        }
+        Packet receivedPacket;
+        size_t consumed;
+        uint64_t decodeStart = monotonicNs();
+        int rc = readFrame(connection, connection->readBuffer + offset, connection->readLength - offset, &receivedPacket, &consumed);
+        if (rc == 0)
+            break;
+        if (rc == -1)
+        {
+            closeConnection(shard, connectionIndex);
+            return;
+        }
+        offset += consumed;
+        uint64_t decoded = monotonicNs();
+        ShardMetrics *metrics = shard->metrics;
+        int type = metricType(receivedPacket.type);
+        traceRequest = (uint64_t)(shard->index + 1) << 40 | ++shard->requestCount;
+        traceSpan(TRACE_DECODE, decodeStart, decoded, type, 0);
+        bumpCounter(metrics->requests[type], 1);
+        recordLatency(metrics, type, PHASE_DECODE, decoded - decodeStart);
+        startSend(metrics);
+        metrics->startedJob = 0;
+        handlePacket(shard, connectionIndex, receivedPacket);
+        // a request that went to the database is answered (and counted) when its job completes
+        if (!metrics->startedJob)
+            finishSend(metrics, type);
+        traceSpan(TRACE_HANDLE, decoded, monotonicNs(), type, 0);
+        traceRequest = 0;
+    }
+    if (connection->sd == -1)
+        return;
+    if (offset > 0)
+    {
+        memmove(connection->readBuffer, connection->readBuffer + offset, connection->readLength - offset);
+        connection->readLength -= offset;
+    }
+    updateInterest(shard, connectionIndex);
+}
+
+// drains the socket into the read buffer, reassembling whole requests out of however the bytes arrived
+void readConnection(Shard *shard, int connectionIndex)
+{
+    Connection *connection = connectionAt(shard, connectionIndex);
+    while (connection->sd != -1 && connection->readLength < MAX_READ_BUFFER)
+    {
+        if (connection->readCapacity - connection->readLength < READ_CHUNK / 4)
+        {
+            size_t capacity = connection->readCapacity ? connection->readCapacity * 2 : READ_CHUNK;
+            if (capacity > MAX_READ_BUFFER)
+                capacity = MAX_READ_BUFFER;
+            connection->readBuffer = (unsigned char *)realloc(connection->readBuffer, capacity);
+            connection->readCapacity = capacity;
+        }
+        ssize_t bytesReceived = recv(connection->sd, connection->readBuffer + connection->readLength, connection->readCapacity - connection->readLength, 0);
+        if (bytesReceived == -1 && errno == EINTR)
+            continue;
+        if (bytesReceived == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (bytesReceived <= 0)
+        {
+            // client closed connection
+            closeConnection(shard, connectionIndex);
+            return;
+        }
+        connection->readLength += bytesReceived;
+        processInput(shard, connectionIndex);
+    }
+    if (connection->sd != -1)
+        updateInterest(shard, connectionIndex);
+}
+
+// accepts up to ACCEPT_BATCH pending connections, leaving the rest for the next wakeup
+void acceptConnections(Shard *shard)
+{
+    for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++)
+    {
+        struct sockaddr_in clientAddress;
+        socklen_t clientAddressLen = sizeof(clientAddress);
+        int clientSocket = accept4(shard->listenSocket, (struct sockaddr*)&clientAddress, &clientAddressLen, SOCK_NONBLOCK);
+
+        if (clientSocket == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept error");
+            return;
+        }
+        int connectionIndex = allocateConnection(shard);
+        if (connectionIndex == -1) {
+            close(clientSocket);
+            continue;
+        }
+        Connection *connection = connectionAt(shard, connectionIndex);
+        connection->sd = clientSocket;
+        connection->generation++;
+        connection->currentView = LOGIN_VIEW;
+        strcpy(connection->username, "");
+        strcpy(connection->viewingConvo, "");
+        connection->wireFormat = WIRE_UNKNOWN;
+        connection->busy = 0;
+        connection->exclusive = 0;
+        connection->replyTo = 0;
+        connection->readLength = connection->readCapacity = 0;
+        connection->writeOffset = connection->writeLength = connection->writeCapacity = 0;
+        connection->inboxUpTo = 0;
+        connection->pollEvents = EPOLLIN;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = connectionHandle(shard, connectionIndex);
+        if (epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+            perror("epoll_ctl error");
+            connection->sd = -1;
+            close(clientSocket);
+            freeConnection(shard, connectionIndex);
+            continue;
+        }
+        moveGauge(shard->metrics->connections, 1);
+    }
+}
+
+void* shardLoop(void* args) {
+    Shard *shard = (Shard *)args;
+    traceRing = shard->trace;
+    if (shard->cpu != -1)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while(1) {
+        shard->readEpoch.store(0);
+        reclaimSessions(shard);
+        int ready = epoll_wait(shard->epollFd, events, MAX_EVENTS, -1);
+        shard->readEpoch.store(sessionEpoch.load());
+        if (ready == -1) {
+            if (errno != EINTR)
+                perror("epoll_wait error");
+            continue;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.u64 == LISTEN_TAG)
+            {
+                acceptConnections(shard);
+                continue;
+            }
+            if (events[i].data.u64 == INBOX_TAG)
+            {
+                drainInbox(shard);
+                continue;
+            }
+            int connectionIndex = (int)(uint32_t)events[i].data.u64;
+            Connection *connection = connectionAt(shard, connectionIndex);
+            if (connection->sd == -1 || connection->generation != (unsigned int)(events[i].data.u64 >> 32))
+                continue;
+            if (events[i].events & EPOLLOUT)
+            {
+                if (flushConnection(shard, connectionIndex) == -1)
+                {
+                    closeConnection(shard, connectionIndex);
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readConnection(shard, connectionIndex);
+        }
+    }
+    return NULL;
+}
+
+// every shard binds its own socket to SERVER_PORT, SO_REUSEPORT lets the kernel spread accepts across them
+int createListenSocket()
+{
+    int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    struct sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(SERVER_PORT);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
+        perror("bind error");
+        close(serverSocket);
+        return -1;
+    }
+
+    if (listen(serverSocket, listenBacklog) == -1) {
+        perror("listen error");
+        close(serverSocket);
+        return -1;
+    }
+    return serverSocket;
+}
+
+int initializeShard(Shard *shard, int index, int cpu, int capacity)
+{
+    shard->index = index;
+    shard->cpu = cpu;
+    shard->inbox.store(NULL);
+    shard->readEpoch.store(0);
+    shard->metrics = (ShardMetrics *)calloc(1, sizeof(ShardMetrics));
+    char traceName[32];
+    snprintf(traceName, sizeof(traceName), "shard %d", index);
+    shard->trace = newTraceRing(traceName);
+    shard->requestCount = 0;
+    initializeConnectionList(shard, capacity);
+
+    shard->listenSocket = createListenSocket();
+    if (shard->listenSocket == -1)
+        return -1;
+    shard->epollFd = epoll_create1(0);
+    shard->inboxFd = eventfd(0, EFD_NONBLOCK);
+    if (shard->epollFd == -1 || shard->inboxFd == -1) {
+        perror("epoll/eventfd error");
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_TAG;
+    epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->listenSocket, &event);
+    event.events = EPOLLIN;
+    event.data.u64 = INBOX_TAG;
+    epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->inboxFd, &event);
+    return 0;
+}
+
+int pragma(sqlite3 *db, const std::string &statement)
+{
+    char *errorMessage = nullptr;
+    int rc = sqlite3_exec(db, statement.c_str(), nullptr, nullptr, &errorMessage);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "error: " << statement << ": " << errorMessage << std::endl;
+        sqlite3_free(errorMessage);
+    }
+    return rc;
+}
+
+// each worker keeps its own handle so statement state never crosses threads. the writer's connection
+// is opened first and switches the database to WAL, so the read-only ones read alongside its transactions
+int initializeDbWorker(DbWorker *worker, int readOnly)
+{
+    worker->readEpoch.store(0);
+    int rc = sqlite3_open_v2("database.db", &worker->db, readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE, nullptr);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "error: cannot open database: " << sqlite3_errmsg(worker->db) << std::endl;
+        sqlite3_close(worker->db);
+        return -1;
+    }
+    sqlite3_busy_timeout(worker->db, 5000);
+    int version = schemaVersion(worker->db);
+    if (version < SCHEMA_VERSION)
+    {
+        std::cerr << "error: database.db is at schema version " << version << ", this server needs " << SCHEMA_VERSION << ", run ./migratedb first" << std::endl;
+        sqlite3_close(worker->db);
+        return -1;
+    }
+    rc = pragma(worker->db, "PRAGMA cache_size = -" + std::to_string(dbCacheKb) + ";");
+    if (rc == SQLITE_OK)
+        rc = pragma(worker->db, "PRAGMA mmap_size = " + std::to_string((long long)mmapMb * 1024 * 1024) + ";");
+    if (rc == SQLITE_OK && !readOnly)
+        rc = pragma(worker->db, "PRAGMA journal_mode = WAL;");
+    if (rc == SQLITE_OK && !readOnly)
+        rc = pragma(worker->db, std::string("PRAGMA synchronous = ") + synchronousMode + ";");
+    if (rc == SQLITE_OK && !readOnly)
+        rc = pragma(worker->db, "PRAGMA wal_autocheckpoint = " + std::to_string(checkpointPages) + ";");
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_close(worker->db);
+        return -1;
+    }
+    worker->statementCount = 0;
+    worker->statementHits = worker->statementMisses = 0;
+    return 0;
+}
+
+void appendf(std::string &out, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out.append(line, length < (int)sizeof(line) ? length : sizeof(line) - 1);
+}
+
+int queueDepth(DbQueue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+// every shard's metrics summed up, in the Prometheus text format. the histograms are exported with a bucket
+// per power of two from 1us, the quantiles come from the full resolution ones
+void writeMetrics(std::string &out)
+{
+    static uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t requests[PACKET_TYPES] = {0}, errors[PACKET_TYPES] = {0};
+    for (int s = 0; s < shardCount; s++)
+    {
+        for (int type = 0; type < PACKET_TYPES; type++)
+        {
+            requests[type] += shards[s].metrics->requests[type].load(std::memory_order_relaxed);
+            errors[type] += shards[s].metrics->errors[type].load(std::memory_order_relaxed);
+        }
+    }
+    out += "# HELP messenger_requests_total Requests read, by packet type.\n# TYPE messenger_requests_total counter\n";
+    for (int type = 0; type < PACKET_TYPES; type++)
+        if (requests[type] > 0)
+            appendf(out, "messenger_requests_total{type=\"%s\"} %llu\n", packetTypeNames[type], (unsigned long long)requests[type]);
+    out += "# HELP messenger_request_errors_total Requests answered with an error, by packet type.\n# TYPE messenger_request_errors_total counter\n";
+    for (int type = 0; type < PACKET_TYPES; type++)
+        if (requests[type] > 0)
+            appendf(out, "messenger_request_errors_total{type=\"%s\"} %llu\n", packetTypeNames[type], (unsigned long long)errors[type]);
+
+    std::string quantiles;
+    out += "# HELP messenger_request_phase_seconds Time a request spent decoding, in the database and sending its answer.\n"
+           "# TYPE messenger_request_phase_seconds histogram\n";
+    for (int type = 0; type < PACKET_TYPES; type++)
+    {
+        for (int phase = 0; phase < REQUEST_PHASES; phase++)
+        {
+            uint64_t count = 0, sumNs = 0;
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                buckets[b] = 0;
+            for (int s = 0; s < shardCount; s++)
+            {
+                LatencyHistogram *histogram = &shards[s].metrics->latency[type][phase];
+                for (int b = 0; b < LATENCY_BUCKETS; b++)
+                    buckets[b] += histogram->buckets[b].load(std::memory_order_relaxed);
+                sumNs += histogram->sumNs.load(std::memory_order_relaxed);
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                count += buckets[b];
+            if (count == 0)
+                continue;
+            const char *labels = packetTypeNames[type];
+            uint64_t cumulative = 0;
+            int b = 0;
+            for (int exponent = 10; exponent <= LATENCY_MAX_EXPONENT; exponent++)
+            {
+                // the buckets below 2^exponent ns
+                for (; b < ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS); b++)
+                    cumulative += buckets[b];
+                appendf(out, "messenger_request_phase_seconds_bucket{type=\"%s\",phase=\"%s\",le=\"%.9f\"} %llu\n",
+                        labels, requestPhaseNames[phase], (double)(1ULL << exponent) / 1e9, (unsigned long long)cumulative);
+            }
+            appendf(out, "messenger_request_phase_seconds_bucket{type=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+                    labels, requestPhaseNames[phase], (unsigned long long)count);
+            appendf(out, "messenger_request_phase_seconds_sum{type=\"%s\",phase=\"%s\"} %.9f\n", labels, requestPhaseNames[phase], sumNs / 1e9);
+            appendf(out, "messenger_request_phase_seconds_count{type=\"%s\",phase=\"%s\"} %llu\n", labels, requestPhaseNames[phase], (unsigned long long)count);
+
+            const double fractions[] = {0.5, 0.99, 0.999};
+            for (double fraction : fractions)
+            {
+                uint64_t rank = (uint64_t)ceil(fraction * count);
+                uint64_t seen = buckets[0];
+                int q = 0;
+                while (seen < rank && q < LATENCY_BUCKETS - 1)
+                    seen += buckets[++q];
+                appendf(quantiles, "messenger_request_phase_quantile_seconds{type=\"%s\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                        labels, requestPhaseNames[phase], fraction, latencyBucketLimit(q) / 1e9);
+            }
+        }
+    }
+    out += "# HELP messenger_request_phase_quantile_seconds Upper bound of the quantile, within 12.5%, since the server started.\n"
+           "# TYPE messenger_request_phase_quantile_seconds gauge\n";
+    out += quantiles;
+
+    int64_t sessions = 0;
+    uint64_t inboxItems = 0;
+    out += "# HELP messenger_connections Open client connections, by reactor thread.\n# TYPE messenger_connections gauge\n";
+    for (int s = 0; s < shardCount; s++)
+    {
+        appendf(out, "messenger_connections{shard=\"%d\"} %lld\n", s, (long long)shards[s].metrics->connections.load(std::memory_order_relaxed));
+        sessions += shards[s].metrics->sessions.load(std::memory_order_relaxed);
+        inboxItems += shards[s].metrics->inboxItems.load(std::memory_order_relaxed);
+    }
+    appendf(out, "# HELP messenger_online_users Logged in users.\n# TYPE messenger_online_users gauge\nmessenger_online_users %lld\n", (long long)sessions);
+    appendf(out, "# HELP messenger_db_queue_depth Requests waiting for a database worker.\n# TYPE messenger_db_queue_depth gauge\n"
+                 "messenger_db_queue_depth %d\n", queueDepth(&dbQueue));
+    appendf(out, "# HELP messenger_db_queue_capacity Requests the database queue holds before answering SERVER_BUSY.\n"
+                 "# TYPE messenger_db_queue_capacity gauge\nmessenger_db_queue_capacity %d\n", dbQueue.capacity);
+    appendf(out, "# HELP messenger_write_queue_depth Messages waiting for the message writer.\n# TYPE messenger_write_queue_depth gauge\n"
+                 "messenger_write_queue_depth %d\n", queueDepth(&messageQueue));
+    appendf(out, "# HELP messenger_write_queue_capacity Messages the writer's queue holds before the workers wait.\n"
+                 "# TYPE messenger_write_queue_capacity gauge\nmessenger_write_queue_capacity %d\n", messageQueue.capacity);
+    appendf(out, "# HELP messenger_inbox_items_total Notifications and completed jobs handed to a reactor thread by another one.\n"
+                 "# TYPE messenger_inbox_items_total counter\nmessenger_inbox_items_total %llu\n", (unsigned long long)inboxItems);
+}
+
+// the spans of the last seconds of every thread, in the Chrome trace event format (chrome://tracing, Perfetto):
+// one track per thread, plus the database phase of each request on a track of its own
+void writeTrace(std::string &out, double seconds)
+{
+    uint64_t now = monotonicNs();
+    uint64_t since = seconds * 1e9 < now ? now - (uint64_t)(seconds * 1e9) : 0;
+    int pid = getpid();
+    out += "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    int first = 1;
+    for (size_t t = 0; t < traceRings.size(); t++)
+    {
+        TraceRing *ring = traceRings[t];
+        appendf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", pid, t + 1, ring->name);
+        first = 0;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t capacity = ring->mask + 1;
+        for (uint64_t i = head > capacity ? head - capacity : 0; i < head; i++)
+        {
+            // a slot the thread rewrote since head was read, or is rewriting, is dropped
+            TraceSpan *slot = &ring->spans[i & ring->mask];
+            if (slot->sequence.load(std::memory_order_acquire) != i + 1)
+                continue;
+            uint64_t span[4];
+            span[0] = slot->start.load(std::memory_order_relaxed);
+            span[1] = slot->duration.load(std::memory_order_relaxed);
+            span[2] = slot->request.load(std::memory_order_relaxed);
+            span[3] = slot->detail.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot->sequence.load(std::memory_order_relaxed) != i + 1)
+                continue;
+            if (span[0] < since)
+                continue;
+            int name = span[3] & 0xff;
+            int type = (int)((span[3] >> 8) & 0xff) - 1;
+            uint64_t value = span[3] >> 16;
+            if (name >= TRACE_NAMES)
+                continue;
+            std::string args;
+            if (type >= 0 && type < PACKET_TYPES)
+                appendf(args, ", \"type\": \"%s\"", packetTypeNames[type]);
+            if (span[2] != 0)
+                appendf(args, ", \"request\": \"%llu.%llu\"", (unsigned long long)(span[2] >> 40) - 1, (unsigned long long)(span[2] & ((1ULL << 40) - 1)));
+            if (traceValueNames[name] != NULL)
+                appendf(args, ", \"%s\": %llu", traceValueNames[name], (unsigned long long)value);
+            if (!args.empty())
+                args = "{" + args.substr(2) + "}";
+            else
+                args = "{}";
+            if (name == TRACE_DB)
+            {
+                // overlaps whatever else the shard does meanwhile, so it is an async span keyed by the request
+                appendf(out, ",\n{\"name\": \"%s\", \"cat\": \"request\", \"ph\": \"b\", \"id\": %llu, \"pid\": %d, \"tid\": %zu, \"ts\": %.3f, \"args\": %s}",
+                        traceNames[name], (unsigned long long)span[2], pid, t + 1, span[0] / 1e3, args.c_str());
+                appendf(out, ",\n{\"name\": \"%s\", \"cat\": \"request\", \"ph\": \"e\", \"id\": %llu, \"pid\": %d, \"tid\": %zu, \"ts\": %.3f}",
+                        traceNames[name], (unsigned long long)span[2], pid, t + 1, (span[0] + span[1]) / 1e3);
+            }
+            else
+                appendf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f, \"args\": %s}",
+                        traceNames[name], pid, t + 1, span[0] / 1e3, span[1] / 1e3, args.c_str());
+        }
+    }
+    out += "\n]}\n";
+}
+
+// SIGUSR1 is blocked in every thread and taken here, where writing a file is safe
+void* traceSignalLoop(void*) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int dumps = 0;
+    while (1)
+    {
+        int signal;
+        if (sigwait(&signals, &signal) != 0)
+            continue;
+        std::string out;
+        writeTrace(out, DEFAULT_TRACE_SECONDS);
+        char path[64];
+        snprintf(path, sizeof(path), "trace-%d-%d.json", (int)getpid(), ++dumps);
+        FILE *file = fopen(path, "w");
+        if (file == NULL)
+        {
+            perror("trace file error");
+            continue;
+        }
+        fwrite(out.data(), 1, out.size(), file);
+        fclose(file);
+        printf("trace of the last %d seconds written to %s\n", DEFAULT_TRACE_SECONDS, path);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// answers one admin connection: a command on one line, the answer, then the connection is closed
+void handleAdminCommand(int clientSocket)
+{
+    // a client that never sends its command does not hold the admin thread for long
+    struct timeval timeout = {1, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char command[ADMIN_COMMAND_LENGTH];
+    size_t length = 0;
+    while (length < sizeof(command) - 1)
+    {
+        ssize_t received = recv(clientSocket, command + length, sizeof(command) - 1 - length, 0);
+        if (received <= 0)
+            break;
+        length += received;
+        if (memchr(command, '\n', length) != NULL)
+            break;
+    }
+    command[length] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+
+    std::string out;
+    if (strcmp(command, "metrics") == 0)
+        writeMetrics(out);
+    else if (strncmp(command, "trace", 5) == 0 && (command[5] == '\0' || command[5] == ' '))
+        writeTrace(out, command[5] == ' ' && atof(command + 6) > 0 ? atof(command + 6) : DEFAULT_TRACE_SECONDS);
+    else
+        appendf(out, "unknown command '%s', try: metrics, trace [seconds]\n", command);
+    size_t offset = 0;
+    while (offset < out.size())
+    {
+        ssize_t sent = send(clientSocket, out.data() + offset, out.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0)
+            break;
+        offset += sent;
+    }
+}
+
+// local only: a Unix socket only its owner can connect to, e.g. echo metrics | nc -U admin.sock
+void* adminLoop(void* args) {
+    int adminSocket = (int)(intptr_t)args;
+    while (1)
+    {
+        int clientSocket = accept(adminSocket, NULL, NULL);
+        if (clientSocket == -1)
+        {
+            if (errno != EINTR)
+                perror("admin accept error");
+            continue;
+        }
+        handleAdminCommand(clientSocket);
+        close(clientSocket);
+    }
+    return NULL;
+}
+
+int createAdminSocket(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "admin socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int adminSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (adminSocket == -1)
+    {
+        perror("admin socket error");
+        return -1;
+    }
+    struct stat info;
+    if (lstat(path, &info) == 0)
+    {
+        // only a socket file left behind by a server that did not exit cleanly is removed
+        if (!S_ISSOCK(info.st_mode))
+        {
+            fprintf(stderr, "admin socket path exists and is not a socket: %s\n", path);
+            close(adminSocket);
+            return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int answered = probe != -1 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (probe != -1)
+            close(probe);
+        if (answered)
+        {
+            fprintf(stderr, "another server is listening on the admin socket: %s\n", path);
+            close(adminSocket);
+            return -1;
+        }
+        unlink(path);
+    }
+    // owner only before it listens, no one can connect in between
+    if (bind(adminSocket, (struct sockaddr *)&address, sizeof(address)) == -1
+        || chmod(path, 0600) == -1 || listen(adminSocket, 16) == -1)
+    {
+        perror("admin socket error");
+        return -1;
+    }
+    return adminSocket;
+}
+
+int main(int argc, char *argv[]) {
+    int threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int workerCount = DEFAULT_DB_WORKERS;
+    int queueCapacity = DEFAULT_DB_QUEUE;
+    int hotCacheMb = DEFAULT_HOT_CACHE_MB;
+    int writeQueueCapacity = DEFAULT_WRITE_QUEUE;
+    const char *adminPath = ADMIN_SOCKET;
+    int option;
+    while ((option = getopt(argc, argv, "b:t:w:q:B:c:m:d:g:l:Q:s:k:C:M:n:A:T:")) != -1)
+    {
+        switch (option)
+        {
+            case 'b':
+                listenBacklog = atoi(optarg);
+                break;
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            case 'w':
+                workerCount = atoi(optarg);
+                break;
+            case 'q':
+                queueCapacity = atoi(optarg);
+                break;
+            case 'B':
+                bulkFrameBytes = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'c':
+                maxConnections = atoi(optarg);
+                break;
+            case 'm':
+                hotCacheMb = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'd':
+                if (strcmp(optarg, "commit") != 0 && strcmp(optarg, "queued") != 0)
+                {
+                    fprintf(stderr, "durability is either commit or queued\n");
+                    return EXIT_FAILURE;
+                }
+                durability = strcmp(optarg, "queued") == 0 ? DURABLE_QUEUED : DURABLE_COMMIT;
+                break;
+            case 'g':
+                writeBatch = atoi(optarg);
+                break;
+            case 'l':
+                writeDelayUs = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'Q':
+                writeQueueCapacity = atoi(optarg);
+                break;
+            case 'n':
+                idNode = atoi(optarg);
+                if (idNode < 0 || idNode >= (1 << ID_NODE_BITS))
+                {
+                    fprintf(stderr, "node is between 0 and %d\n", (1 << ID_NODE_BITS) - 1);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "normal") != 0 && strcmp(optarg, "full") != 0)
+                {
+                    fprintf(stderr, "synchronous is either normal or full\n");
+                    return EXIT_FAILURE;
+                }
+                synchronousMode = strcmp(optarg, "normal") == 0 ? "NORMAL" : "FULL";
+                break;
+            case 'k':
+                checkpointPages = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'C':
+                dbCacheKb = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'M':
+                mmapMb = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'A':
+                adminPath = optarg;
+                break;
+            case 'T':
+                traceEvents = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            default:
+                fprintf(stderr, "Syntax: %s [-b listen_backlog] [-t reactor_threads] [-w db_workers] [-q db_queue_size] [-B bulk_frame_bytes] [-c max_connections] [-m conversation_cache_mb]\n"
+                            "       [-d commit|queued] [-g write_batch] [-l write_delay_us] [-Q write_queue_size]\n"
+                            "       [-s normal|full] [-k checkpoint_pages] [-C db_cache_kb] [-M mmap_mb] [-n node]\n"
+                            "       [-A admin_socket, \"\" for none] [-T trace_events_per_thread, 0 for none]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (bulkFrameBytes > MAX_FRAME_LENGTH / 2)
+        bulkFrameBytes = MAX_FRAME_LENGTH / 2;
+    if (threadCount < 1)
+        threadCount = 1;
+    if (workerCount < 1)
+        workerCount = 1;
+    if (queueCapacity < 1)
+        queueCapacity = 1;
+    if (writeBatch < 1)
+        writeBatch = 1;
+    if (writeQueueCapacity < 1)
+        writeQueueCapacity = 1;
+    if (maxConnections < threadCount)
+        maxConnections = threadCount;
+    signal(SIGINT, sigintHandler);
+    signal(SIGPIPE, SIG_IGN);
+    // every thread started from here on inherits the mask, traceSignalLoop takes the signal
+    sigset_t traceSignals;
+    sigemptyset(&traceSignals);
+    sigaddset(&traceSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &traceSignals, NULL);
+
+    dbQueue.jobs = (DbJob **)calloc(queueCapacity, sizeof(DbJob *));
+    dbQueue.capacity = queueCapacity;
+    dbQueue.head = dbQueue.count = 0;
+    pthread_mutex_init(&dbQueue.mutex, NULL);
+    pthread_cond_init(&dbQueue.notEmpty, NULL);
+    messageQueue.jobs = (DbJob **)calloc(writeQueueCapacity, sizeof(DbJob *));
+    messageQueue.capacity = writeQueueCapacity;
+    messageQueue.head = messageQueue.count = 0;
+    pthread_mutex_init(&messageQueue.mutex, NULL);
+    pthread_cond_init(&messageQueue.notEmpty, NULL);
+    pthread_cond_init(&messageQueue.notFull, NULL);
+    pthread_mutex_init(&hotCache.mutex, NULL);
+    hotCache.budget = (size_t)hotCacheMb * 1024 * 1024;
+    for (int i = 0; i < SESSION_STRIPES; i++)
+    {
+        pthread_mutex_init(&sessionIndex[i].mutex, NULL);
+        sessionIndex[i].sessions.store(new SessionMap());
+    }
+    dbWorkers = new DbWorker[workerCount];
+    pthread_mutex_init(&writerMutex, NULL);
+    if (initializeDbWorker(&dbWriter, 0) == -1)
+        return EXIT_FAILURE;
+    dbWriter.trace = newTraceRing("message writer");
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (initializeDbWorker(&dbWorkers[i], 1) == -1)
+            return EXIT_FAILURE;
+        char traceName[32];
+        snprintf(traceName, sizeof(traceName), "db worker %d", i);
+        dbWorkers[i].trace = newTraceRing(traceName);
+        dbWorkerCount++;
+    }
+    if (loadUserDirectory(dbWorkers[0].db) == -1)
+        return EXIT_FAILURE;
+
+    // pin shard i to the i-th cpu this process is allowed to run on
+    cpu_set_t allowed;
+    int allowedCpus[CPU_SETSIZE];
+    int allowedCount = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                allowedCpus[allowedCount++] = cpu;
+    }
+
+    shards = new Shard[threadCount];
+    for (int i = 0; i < threadCount; i++)
+    {
+        // the first maxConnections % threadCount shards take one more
+        int capacity = maxConnections / threadCount + (i < maxConnections % threadCount ? 1 : 0);
+        if (initializeShard(&shards[i], i, allowedCount > 0 ? allowedCpus[i % allowedCount] : -1, capacity) == -1)
+            return EXIT_FAILURE;
+        shardCount++;
+    }
+    // before any thread runs, so a path that cannot be bound stops the server before it serves anyone
+    int adminSocket = -1;
+    if (adminPath[0] != '\0' && (adminSocket = createAdminSocket(adminPath)) == -1)
+        return EXIT_FAILURE;
+    for (int i = 0; i < dbWorkerCount; i++)
+    {
+        if (pthread_create(&dbWorkers[i].thread, NULL, dbWorkerLoop, &dbWorkers[i]) != 0) {
+            perror("pthread_create error");
+            return EXIT_FAILURE;
+        }
+    }
+    if (pthread_create(&dbWriter.thread, NULL, messageWriterLoop, &dbWriter) != 0) {
+        perror("pthread_create error");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < shardCount; i++)
+    {
+        if (pthread_create(&shards[i].thread, NULL, shardLoop, &shards[i]) != 0) {
+            perror("pthread_create error");
+            return EXIT_FAILURE;
+        }
+    }
+    if (adminSocket != -1)
+    {
+        pthread_t adminThread;
+        if (pthread_create(&adminThread, NULL, adminLoop, (void *)(intptr_t)adminSocket) != 0) {
+            perror("pthread_create error");
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_t traceThread;
+    if (pthread_create(&traceThread, NULL, traceSignalLoop, NULL) != 0) {
+        perror("pthread_create error");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < shardCount; i++)
+        pthread_join(shards[i].thread, NULL);
     return 0;
 }
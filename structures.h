@@ -1,11 +1,14 @@
 #include <cstring>
+#include <stdint.h>
+#include <stdlib.h>
 
 // GENERAL STRUCTURES USED BY BOTH CLIENT & SERVER
 
 #define USERNAME_LENGTH 32
 #define PASSWORD_LENGTH 32
 #define ID_LENGTH 16
-#define CONTENT_LENGTH 64
+#define CONTENT_LENGTH 64 // what fits in a LegacyPacket
+#define MAX_CONTENT_LENGTH 1024 // what the compact format carries
 #define TIMESTAMP_LENGTH 32
 
 struct User {
@@ -17,7 +20,7 @@ struct Message {
     char id[ID_LENGTH];
     char sender[USERNAME_LENGTH];
     char receiver[USERNAME_LENGTH];
-    char content[CONTENT_LENGTH];
+    char content[MAX_CONTENT_LENGTH];
     char timeStamp[TIMESTAMP_LENGTH];
     char replyId[ID_LENGTH]; // optional, only if this message is replying to another one
 };
@@ -36,7 +39,11 @@ enum PacketType {
     VIEW_ALL_CONVOS,
     VIEW_ALL_CONVOS_RESPONSE,  // client will analyze the User part of the Packet it receives from server
     VIEW_CONVERSATION,
-    VIEW_CONVERSATION_RESPONSE // client will analyze the Message part of the Packet it receives from server
+    VIEW_CONVERSATION_RESPONSE, // client will analyze the Message part of the Packet it receives from server
+    VIEW_CONVERSATION_END, // closes a page of history: message.id is the cursor for the page before it, count is 1 if there is one
+    BULK_RESPONSE, // compact only: its body is the frames of the records
+    SYNC, // messages newer than message.id: the inbox if user is empty, else the conversation with user
+    SYNC_END // closes a sync (or the inbox pushed after LOGIN_RESPONSE): message.id is the cursor for the next one, count is 1 if there is more
 };
 
 enum ErrorType {
@@ -47,7 +54,8 @@ enum ErrorType {
     NOT_LOGGED_IN, // when user tries to send message or log out, but it is not logged in the first place
     NOT_LOGGED_OUT, // when user tries to login, but they are already logged in
     INVALID_REPLY_ID, // for when the user tries to respond to an inexistent message
-    WRONG_VIEW
+    WRONG_VIEW,
+    SERVER_BUSY // the server's database queue is full, or the database failed the request: it was not processed
 };
 
 struct Packet {
@@ -55,8 +63,70 @@ struct Packet {
     ErrorType error;
     User user;
     Message message;
+    int count; // VIEW_ALL_CONVOS_RESPONSE: unread messages in that conversation, VIEW_CONVERSATION: page size (0 for the whole history),
+               // SYNC: page size (0 for the server's largest), LOGIN_RESPONSE: unread messages in all conversations
+    uint32_t requestId; // compact format only: picked by the client, echoed on everything that answers that request, 0 for none
+}; // in memory only, on the wire it is either a LegacyPacket or a compact frame
+
+// LEGACY FIXED-SIZE FORMAT: the whole struct memcpy'd and encoded, byte for byte the packet clients spoke before the
+// compact format. it has no count and no request id, and its clients know no type after VIEW_CONVERSATION_RESPONSE
+
+struct LegacyMessage {
+    char id[ID_LENGTH];
+    char sender[USERNAME_LENGTH];
+    char receiver[USERNAME_LENGTH];
+    char content[CONTENT_LENGTH];
+    char timeStamp[TIMESTAMP_LENGTH];
+    char replyId[ID_LENGTH];
+};
+
+struct LegacyPacket {
+    PacketType type;
+    ErrorType error;
+    User user;
+    LegacyMessage message;
 };
 
+static_assert(sizeof(LegacyPacket) == 264, "LegacyPacket must keep the original packet's layout");
+
+#define LEGACY_PACKET_TYPES (VIEW_CONVERSATION_RESPONSE + 1) // the types a legacy client knows
+
+void messageToLegacy(const Message *message, LegacyMessage *legacy) {
+    memcpy(legacy->id, message->id, ID_LENGTH);
+    memcpy(legacy->sender, message->sender, USERNAME_LENGTH);
+    memcpy(legacy->receiver, message->receiver, USERNAME_LENGTH);
+    memcpy(legacy->content, message->content, CONTENT_LENGTH - 1); // longer content is cut
+    legacy->content[CONTENT_LENGTH - 1] = '\0';
+    memcpy(legacy->timeStamp, message->timeStamp, TIMESTAMP_LENGTH);
+    memcpy(legacy->replyId, message->replyId, ID_LENGTH);
+}
+
+void legacyToMessage(const LegacyMessage *legacy, Message *message) {
+    memset(message, 0, sizeof(Message));
+    memcpy(message->id, legacy->id, ID_LENGTH);
+    memcpy(message->sender, legacy->sender, USERNAME_LENGTH);
+    memcpy(message->receiver, legacy->receiver, USERNAME_LENGTH);
+    memcpy(message->content, legacy->content, CONTENT_LENGTH);
+    memcpy(message->timeStamp, legacy->timeStamp, TIMESTAMP_LENGTH);
+    memcpy(message->replyId, legacy->replyId, ID_LENGTH);
+}
+
+void packetToLegacy(const Packet *packet, LegacyPacket *legacy) {
+    memset(legacy, 0, sizeof(LegacyPacket));
+    legacy->type = packet->type;
+    legacy->error = packet->error;
+    legacy->user = packet->user;
+    messageToLegacy(&packet->message, &legacy->message);
+}
+
+void legacyToPacket(const LegacyPacket *legacy, Packet *packet) {
+    memset(packet, 0, sizeof(Packet));
+    packet->type = legacy->type;
+    packet->error = legacy->error;
+    packet->user = legacy->user;
+    legacyToMessage(&legacy->message, &packet->message);
+}
+
 enum ViewType {
     LOGIN_VIEW,
     MAIN_VIEW,
@@ -64,19 +134,40 @@ enum ViewType {
 };
 
 // STRUCTURES USED BY SERVER
+enum WireFormat {
+    WIRE_UNKNOWN, // nothing received yet, the first byte decides
+    WIRE_LEGACY,
+    WIRE_COMPACT
+};
+
 struct Connection {
     int sd;
+    unsigned int generation; // bumped on every accept, so late database replies for a previous client are dropped
     char username[USERNAME_LENGTH];
     ViewType currentView;
     char viewingConvo[USERNAME_LENGTH];
+    WireFormat wireFormat; // what this client speaks, answers go out the same way
+    int busy; // database jobs in flight for this connection
+    int exclusive; // the one in flight must finish before anything else is read, later packets wait in readBuffer
+    uint32_t replyTo; // request id of the request being answered, stamped on what is sent to this connection meanwhile
+    unsigned char *readBuffer; // received bytes not yet handled, may end in a partial frame
+    size_t readLength;
+    size_t readCapacity;
+    unsigned char *writeBuffer; // encoded packets the socket was not ready to take yet
+    size_t writeOffset;
+    size_t writeLength;
+    size_t writeCapacity;
+    int64_t inboxUpTo; // the inbox cursor the queued pages bring the user to, stored once they are all with the socket
+    unsigned int pollEvents; // events currently registered with epoll
+    int nextFree; // next slot on the shard's free list, while this one is closed
 }; // server will manage an array of type Connection through which it will know how many clients are connected and with what users
 
-void serializePacket(const Packet *packet, unsigned char *buffer, size_t bufferSize) {
-    memcpy(buffer, packet, sizeof(Packet));
+void serializePacket(const LegacyPacket *packet, unsigned char *buffer, size_t bufferSize) {
+    memcpy(buffer, packet, sizeof(LegacyPacket));
 }
 
-void deserializePacket(const unsigned char *buffer, Packet *packet) {
-    memcpy(packet, buffer, sizeof(Packet));
+void deserializePacket(const unsigned char *buffer, LegacyPacket *packet) {
+    memcpy(packet, buffer, sizeof(LegacyPacket));
 }
 
 const char *key = "tenacity"; // should be the same on both client and server
@@ -139,48 +230,380 @@ void decode_vigenere(char* plain_text, char* key)
 
 char vigenere_key[256] = "tenacity\0";
 
-void encode_vigenere_packet(Packet* P, char* key)
+// BYTE CIPHER
+// the same byte-wise vigenere as the packet encoding always was (byte + key byte mod 256, the key restarting
+// at the start of every buffer), precomputed once into a keystream whose length is a multiple of both the key
+// and CIPHER_BLOCK, so each block of the data lines up with a slice of it: no %, no strlen, no copies
+
+#define CIPHER_BLOCK 32 // the widest vector used
+#define MAX_KEY_LENGTH 255
+
+struct CipherContext {
+    size_t period; // key length * CIPHER_BLOCK, 0 for an empty key
+    unsigned char keystream[MAX_KEY_LENGTH * CIPHER_BLOCK];
+};
+
+void initCipherContext(CipherContext *context, const char *key)
 {
-    unsigned char buffer[sizeof(Packet)];
-    serializePacket(P, buffer, sizeof(buffer));
-    // unsigned char encrypted_text[256];
-    int text_length = sizeof(Packet);
-    int key_length = strlen(key);
-    for(int i=0;i<text_length;i++)
+    size_t keyLength = strnlen(key, MAX_KEY_LENGTH);
+    context->period = keyLength * CIPHER_BLOCK;
+    for (size_t i = 0; i < context->period; i++)
+        context->keystream[i] = (unsigned char)key[i % keyLength];
+}
+
+// the tail after the last whole block, or everything when no vector unit is used
+void cipherScalar(const CipherContext *context, unsigned char *data, size_t length, size_t position, int decode)
+{
+    const unsigned char *keystream = context->keystream;
+    for (size_t i = 0; i < length; i++)
     {
-        int rez = (int)(buffer[i]) + (int)(key[i%key_length]);
-        rez = rez % 256;
-        int poz = i % key_length;
-        int init = buffer[i];
-        int another = key[poz];
-        init += another;
-        init = init % 256;
-        char ch = (char)(init);
-        buffer[i] = ch;
+        data[i] = decode ? data[i] - keystream[position] : data[i] + keystream[position];
+        if (++position == context->period)
+            position = 0;
     }
-    deserializePacket(buffer, P);
 }
 
-void decode_vigenere_packet(Packet *P, char* key)
+#if defined(__SSE2__)
+#include <immintrin.h>
+
+void cipherSse2(const CipherContext *context, unsigned char *data, size_t length, int decode)
 {
-    unsigned char buffer[sizeof(Packet)];
-    serializePacket(P, buffer, sizeof(buffer));
-    // unsigned char encrypted_text[256];
-    int text_length = sizeof(Packet);
-    int key_length = strlen(key);
-    for(int i=0;i<text_length;i++)
+    size_t position = 0, i = 0;
+    for (; i + 16 <= length; i += 16)
     {
-        int rez = (int)(buffer[i]) - (int)(key[i%key_length]);
-        rez = rez % 256;
-            int poz = i % key_length;
-            int init = buffer[i];
-            int another = key[poz];
-            init -= another;
-            while(init<0)
-                init+=256;
-            init = init % 256;
-            char ch = (char)(init);
-            buffer[i] = ch;
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i key = _mm_loadu_si128((const __m128i *)(context->keystream + position));
+        block = decode ? _mm_sub_epi8(block, key) : _mm_add_epi8(block, key);
+        _mm_storeu_si128((__m128i *)(data + i), block);
+        position += 16;
+        if (position == context->period)
+            position = 0;
+    }
+    cipherScalar(context, data + i, length - i, position, decode);
+}
+
+__attribute__((target("avx2")))
+void cipherAvx2(const CipherContext *context, unsigned char *data, size_t length, int decode)
+{
+    size_t position = 0, i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i key = _mm256_loadu_si256((const __m256i *)(context->keystream + position));
+        block = decode ? _mm256_sub_epi8(block, key) : _mm256_add_epi8(block, key);
+        _mm256_storeu_si256((__m256i *)(data + i), block);
+        position += 32;
+        if (position == context->period)
+            position = 0;
+    }
+    cipherScalar(context, data + i, length - i, position, decode);
+}
+#endif
+
+// encodes (or decodes) length bytes in place with the widest implementation this cpu has
+void cipherTransform(const CipherContext *context, unsigned char *data, size_t length, int decode)
+{
+    if (context->period == 0)
+        return;
+#if defined(__SSE2__)
+    static const int hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2)
+        cipherAvx2(context, data, length, decode);
+    else
+        cipherSse2(context, data, length, decode);
+#else
+    cipherScalar(context, data, length, 0, decode);
+#endif
+}
+
+CipherContext *newCipherContext(const char *key)
+{
+    CipherContext *context = (CipherContext *)malloc(sizeof(CipherContext));
+    initCipherContext(context, key);
+    return context;
+}
+
+// the context for vigenere_key, built by whichever thread needs it first
+const CipherContext *vigenereContext()
+{
+    static const CipherContext *context = newCipherContext(vigenere_key);
+    return context;
+}
+
+void encode_vigenere_bytes(unsigned char *buffer, size_t length)
+{
+    cipherTransform(vigenereContext(), buffer, length, 0);
+}
+
+void decode_vigenere_bytes(unsigned char *buffer, size_t length)
+{
+    cipherTransform(vigenereContext(), buffer, length, 1);
+}
+
+void encode_vigenere_packet(LegacyPacket* P)
+{
+    encode_vigenere_bytes((unsigned char *)P, sizeof(LegacyPacket));
+}
+
+void decode_vigenere_packet(LegacyPacket *P)
+{
+    decode_vigenere_bytes((unsigned char *)P, sizeof(LegacyPacket));
+}
+
+// a Packet as the sizeof(LegacyPacket) bytes the legacy format puts on the wire, encoded where it lands
+void encodeLegacyPacket(const Packet *packet, unsigned char *buffer)
+{
+    LegacyPacket legacy;
+    packetToLegacy(packet, &legacy);
+    serializePacket(&legacy, buffer, sizeof(LegacyPacket));
+    encode_vigenere_bytes(buffer, sizeof(LegacyPacket));
+}
+
+void decodeLegacyPacket(const unsigned char *buffer, Packet *packet)
+{
+    LegacyPacket legacy;
+    deserializePacket(buffer, &legacy);
+    decode_vigenere_packet(&legacy);
+    legacyToPacket(&legacy, packet);
+}
+
+// COMPACT FORMAT
+// frame = magic, version, type, error, flags (one byte each), body length (varint), body
+// body = varint mask of the fields present, then each present field in bit order:
+//        strings as varint length + bytes (no terminator), count as a zigzag varint, request id as a varint
+// only the body is encoded with the cipher, so a reader can frame without decoding
+// a legacy stream can never start with FRAME_MAGIC: its first byte is an encoded PacketType
+
+#define FRAME_MAGIC 0xC5
+#define WIRE_VERSION 1
+#define FRAME_PREFIX 5
+#define MAX_FRAME_HEADER (FRAME_PREFIX + 5)
+#define MAX_FRAME_LENGTH (1 << 20) // body bytes, a longer frame is malformed
+
+// set on a frame whose body has a request id. on a request it also says the client matches the answers by it,
+// so the server may run it alongside the connection's other requests and answer it out of order
+#define FRAME_FLAG_REQUEST_ID 0x01
+
+enum FrameField {
+    FIELD_USERNAME = 1 << 0,
+    FIELD_PASSWORD = 1 << 1,
+    FIELD_ID = 1 << 2,
+    FIELD_SENDER = 1 << 3,
+    FIELD_RECEIVER = 1 << 4,
+    FIELD_CONTENT = 1 << 5,
+    FIELD_TIMESTAMP = 1 << 6,
+    FIELD_REPLY_ID = 1 << 7,
+    FIELD_COUNT = 1 << 8,
+    FIELD_REQUEST_ID = 1 << 9
+};
+
+struct FrameHeader {
+    unsigned char version;
+    unsigned char type;
+    unsigned char error;
+    unsigned char flags; // FRAME_FLAG_REQUEST_ID or 0
+    uint32_t length;
+};
+
+size_t putVarint(unsigned char *buffer, uint32_t value)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        buffer[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
     }
-    deserializePacket(buffer, P);
-}
\ No newline at end of file
+    buffer[length++] = (unsigned char)value;
+    return length;
+}
+
+// returns the bytes read, 0 if the varint is not complete yet, -1 if it is longer than a uint32 allows
+int getVarint(const unsigned char *buffer, size_t available, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        if ((size_t)i >= available)
+            return 0;
+        result |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0)
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+size_t varintLength(uint32_t value)
+{
+    size_t length = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+// the string fields in mask bit order
+void frameFields(Packet *packet, char *fields[8], size_t sizes[8])
+{
+    fields[0] = packet->user.username;    sizes[0] = USERNAME_LENGTH;
+    fields[1] = packet->user.password;    sizes[1] = PASSWORD_LENGTH;
+    fields[2] = packet->message.id;       sizes[2] = ID_LENGTH;
+    fields[3] = packet->message.sender;   sizes[3] = USERNAME_LENGTH;
+    fields[4] = packet->message.receiver; sizes[4] = USERNAME_LENGTH;
+    fields[5] = packet->message.content;  sizes[5] = MAX_CONTENT_LENGTH;
+    fields[6] = packet->message.timeStamp; sizes[6] = TIMESTAMP_LENGTH;
+    fields[7] = packet->message.replyId;  sizes[7] = ID_LENGTH;
+}
+
+uint32_t zigzag(int value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+size_t frameBodyLength(const Packet *packet, uint32_t *mask)
+{
+    char *fields[8];
+    size_t sizes[8];
+    frameFields((Packet *)packet, fields, sizes);
+    size_t length = 0;
+    *mask = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        size_t fieldLength = strnlen(fields[i], sizes[i] - 1);
+        if (fieldLength > 0)
+        {
+            *mask |= 1u << i;
+            length += varintLength(fieldLength) + fieldLength;
+        }
+    }
+    if (packet->count != 0)
+    {
+        *mask |= FIELD_COUNT;
+        length += varintLength(zigzag(packet->count));
+    }
+    if (packet->requestId != 0)
+    {
+        *mask |= FIELD_REQUEST_ID;
+        length += varintLength(packet->requestId);
+    }
+    return length + varintLength(*mask);
+}
+
+// the whole frame's size, header included
+size_t compactFrameLength(const Packet *packet)
+{
+    uint32_t mask;
+    size_t bodyLength = frameBodyLength(packet, &mask);
+    return FRAME_PREFIX + varintLength(bodyLength) + bodyLength;
+}
+
+void putFrameHeader(unsigned char *buffer, PacketType type, ErrorType error, unsigned char flags, size_t bodyLength, size_t *offset)
+{
+    buffer[0] = FRAME_MAGIC;
+    buffer[1] = WIRE_VERSION;
+    buffer[2] = (unsigned char)type;
+    buffer[3] = (unsigned char)error;
+    buffer[4] = flags;
+    *offset = FRAME_PREFIX + putVarint(buffer + FRAME_PREFIX, bodyLength);
+}
+
+// writes compactFrameLength(packet) bytes, encoding the body unless it will be encoded as part of a larger one
+size_t encodeCompactFrame(const Packet *packet, unsigned char *buffer, int encode)
+{
+    char *fields[8];
+    size_t sizes[8];
+    uint32_t mask;
+    size_t bodyLength = frameBodyLength(packet, &mask);
+    size_t offset;
+    putFrameHeader(buffer, packet->type, packet->error, packet->requestId ? FRAME_FLAG_REQUEST_ID : 0, bodyLength, &offset);
+    unsigned char *body = buffer + offset;
+    size_t length = putVarint(body, mask);
+    frameFields((Packet *)packet, fields, sizes);
+    for (int i = 0; i < 8; i++)
+    {
+        if (mask & (1u << i))
+        {
+            size_t fieldLength = strnlen(fields[i], sizes[i] - 1);
+            length += putVarint(body + length, fieldLength);
+            memcpy(body + length, fields[i], fieldLength);
+            length += fieldLength;
+        }
+    }
+    if (mask & FIELD_COUNT)
+        length += putVarint(body + length, zigzag(packet->count));
+    if (mask & FIELD_REQUEST_ID)
+        length += putVarint(body + length, packet->requestId);
+    if (encode)
+        encode_vigenere_bytes(body, length);
+    return offset + length;
+}
+
+// returns the header's size, 0 if more bytes are needed, -1 if this is not a frame this side understands
+int parseFrameHeader(const unsigned char *buffer, size_t available, FrameHeader *header)
+{
+    if (available < FRAME_PREFIX)
+        return 0;
+    if (buffer[0] != FRAME_MAGIC || buffer[1] != WIRE_VERSION || (buffer[4] & ~FRAME_FLAG_REQUEST_ID) != 0)
+        return -1;
+    uint32_t length;
+    int lengthBytes = getVarint(buffer + FRAME_PREFIX, available - FRAME_PREFIX, &length);
+    if (lengthBytes <= 0)
+        return lengthBytes;
+    if (length > MAX_FRAME_LENGTH)
+        return -1;
+    header->version = buffer[1];
+    header->type = buffer[2];
+    header->error = buffer[3];
+    header->flags = buffer[4];
+    header->length = length;
+    return FRAME_PREFIX + lengthBytes;
+}
+
+// fills packet from an already decoded body, returns -1 if a field is cut short or too long for its buffer
+int decodeCompactFrame(const FrameHeader *header, const unsigned char *body, Packet *packet)
+{
+    memset(packet, 0, sizeof(Packet));
+    packet->type = (PacketType)header->type;
+    packet->error = (ErrorType)header->error;
+    char *fields[8];
+    size_t sizes[8];
+    frameFields(packet, fields, sizes);
+    uint32_t mask;
+    int read = getVarint(body, header->length, &mask);
+    if (read <= 0)
+        return -1;
+    size_t offset = read;
+    for (int i = 0; i < 8; i++)
+    {
+        if ((mask & (1u << i)) == 0)
+            continue;
+        uint32_t fieldLength;
+        read = getVarint(body + offset, header->length - offset, &fieldLength);
+        if (read <= 0 || fieldLength >= sizes[i] || offset + read + fieldLength > header->length)
+            return -1;
+        offset += read;
+        memcpy(fields[i], body + offset, fieldLength);
+        offset += fieldLength;
+    }
+    if (mask & FIELD_COUNT)
+    {
+        uint32_t count;
+        read = getVarint(body + offset, header->length - offset, &count);
+        if (read <= 0)
+            return -1;
+        offset += read;
+        packet->count = (int)((count >> 1) ^ -(count & 1));
+    }
+    if (mask & FIELD_REQUEST_ID)
+    {
+        read = getVarint(body + offset, header->length - offset, &packet->requestId);
+        if (read <= 0)
+            return -1;
+        offset += read;
+    }
+    return offset == header->length ? 0 : -1;
+}